@@ -35,6 +35,10 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lightmediascanner.h"
 #include "lightmediascanner_private.h"
@@ -44,6 +48,15 @@
 #define DEFAULT_SLAVE_TIMEOUT 1000
 #define DEFAULT_COMMIT_INTERVAL 100
 
+/* Pressure stall information is only re-read every THROTTLE_SAMPLE_INTERVAL
+ * milliseconds, it is a 10 seconds average anyway. */
+#define THROTTLE_SAMPLE_INTERVAL 500
+#define THROTTLE_SLOW_DELAY 50
+#define THROTTLE_PAUSE_POLL 250
+/* never stall a single file longer than this, the slave may be holding
+ * the database lock while the master waits */
+#define THROTTLE_MAX_PAUSE 5000
+
 #ifdef HAVE_MAGIC_H
 static magic_t _magic_handle;
 
@@ -138,6 +151,7 @@ static int
 _parser_load(struct parser *p, const char *so_path)
 {
     lms_plugin_t *(*plugin_open)(void);
+    const struct lms_plugin_info *(*plugin_info)(void);
     char *errmsg;
 
     log_info("so_path = %s", so_path);
@@ -172,6 +186,20 @@ _parser_load(struct parser *p, const char *so_path)
         log_error("ERROR: plugin \"%s\" failed to init.", so_path);
         return -4;
     }
+
+    /* optional, recorded with the files the plugin parsed so only its
+     * files are parsed again when it's upgraded */
+    plugin_info = dlsym(p->dl_handle, "lms_plugin_info");
+    if (!dlerror() && plugin_info) {
+        const struct lms_plugin_info *pinfo = plugin_info();
+        if (pinfo && pinfo->version) {
+            p->version = strdup(pinfo->version);
+            if (!p->version) {
+                perror("strdup");
+                return -3;
+            }
+        }
+    }
     return 0;
 }
 
@@ -200,6 +228,8 @@ _parser_unload(struct parser *p)
     }
     if (p->so_path)
       free(p->so_path);
+    if (p->version)
+      free(p->version);
     return r;
 }
 
@@ -231,6 +261,7 @@ lms_new(const char *db_path)
     }
     lms->commit_interval = DEFAULT_COMMIT_INTERVAL;
     lms->slave_timeout = DEFAULT_SLAVE_TIMEOUT;
+    lms->prefetch_depth = 1;
     lms->db_path = strdup(db_path);
     if (!lms->db_path) {
         perror("strdup");
@@ -238,6 +269,18 @@ lms_new(const char *db_path)
         free(lms);
         return NULL;
     }
+    /* cancellation token, shared with the forked slaves so a stop
+     * request reaches the parser that is currently running */
+    lms->cancel = mmap(NULL, sizeof(*lms->cancel), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lms->cancel == MAP_FAILED) {
+        perror("mmap");
+        free(lms->db_path);
+        lms_charset_conv_free(lms->cs_conv);
+        free(lms);
+        return NULL;
+    }
+    *lms->cancel = 0;
     return lms;
 }
 
@@ -266,6 +309,7 @@ lms_free(lms_t *lms)
     if (lms->progress.data && lms->progress.free_data)
         lms->progress.free_data(lms->progress.data);
     free(lms->db_path);
+    munmap((void *)lms->cancel, sizeof(*lms->cancel));
     lms_charset_conv_free(lms->cs_conv);
     g_list_free_full(lms->completed_scan_paths, g_free);
     free(lms);
@@ -637,6 +681,40 @@ lms_set_commit_duration(lms_t *lms, double duration)
     lms->commit_duration = duration;
 }
 
+/**
+ * Set the order files of a directory are handed to the parsers.
+ *
+ * By default files are processed in alphabetical order. With
+ * LMS_STORAGE_ORDER_INODE they are sorted by inode number and with
+ * LMS_STORAGE_ORDER_BLOCK by the physical block of their first extent
+ * (FIEMAP, falling back to the inode number for directories it can't
+ * map), which reduces seeks when the parsers read the file headers. Only
+ * builds with ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN list directories before
+ * walking them, the others ignore it.
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param storage_order one of lms_storage_order_t.
+ * @ingroup LMS_API
+ */
+void
+lms_set_storage_order(lms_t *lms, lms_storage_order_t storage_order)
+{
+    if (!lms) {
+        log_error("ERROR: lms_set_storage_order(NULL, %d)", storage_order);
+        return;
+    }
+
+    lms->storage_order = storage_order;
+
+#if !defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+    /* the readdir() walker streams entries, there is no list to sort */
+    if (storage_order != LMS_STORAGE_ORDER_NONE)
+        log_warning("storage order %d needs the scandir() walker "
+                    "(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN), files are "
+                    "processed in directory order", storage_order);
+#endif
+}
+
 void
 lms_set_lms_target(lms_t *lms, int lms_target)
 {
@@ -1261,6 +1339,167 @@ void lms_set_chardet_level(lms_t *lms, int level)
     lms->chardet_level = level;
 }
 
+/**
+ * Set the pressure thresholds used to throttle scans.
+ *
+ * Before each file is dispatched the "some avg10" value of
+ * /proc/pressure/cpu and /proc/pressure/io is checked (the highest of both
+ * is used). At or above @p slow_threshold every file is delayed a bit, at
+ * or above @p pause_threshold dispatching pauses until the pressure drops
+ * below @p slow_threshold again.
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param slow_threshold percentage to start slowing down, <= 0 disables
+ *        throttling.
+ * @param pause_threshold percentage to pause.
+ * @ingroup LMS_API
+ */
+void
+lms_set_pressure_thresholds(lms_t *lms, double slow_threshold, double pause_threshold)
+{
+    if (!lms) {
+        log_error("ERROR: lms_set_pressure_thresholds(NULL, %lf, %lf)",
+                slow_threshold, pause_threshold);
+        return;
+    }
+
+    if (pause_threshold < slow_threshold) {
+        log_warning("pause threshold %lf below slow threshold %lf, raised",
+                pause_threshold, slow_threshold);
+        pause_threshold = slow_threshold;
+    }
+
+    lms->throttle.slow_threshold = slow_threshold;
+    lms->throttle.pause_threshold = pause_threshold;
+}
+
+/**
+ * Set callback to be called when the throttle state changes.
+ *
+ * The callback is called from the thread running lms_check() or
+ * lms_process().
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param cb function to call or NULL to unset.
+ * @param data data to give to cb when it's called, may be NULL.
+ * @ingroup LMS_API
+ */
+void
+lms_set_throttle_callback(lms_t *lms, lms_throttle_callback_t cb, void *data)
+{
+    if (!lms) {
+        log_error("ERROR: lms_set_throttle_callback(NULL)");
+        return;
+    }
+
+    lms->throttle.cb = cb;
+    lms->throttle.data = data;
+}
+
+lms_throttle_state_t
+lms_get_throttle_state(const lms_t *lms)
+{
+    if (!lms) {
+        log_error("ERROR: lms_get_throttle_state(NULL)");
+        return LMS_THROTTLE_STATE_NONE;
+    }
+
+    return lms->throttle.state;
+}
+
+/* Returns "some avg10" of the given PSI file or -1 if it's unavailable */
+static double
+_pressure_some_avg10(const char *path)
+{
+    char line[128];
+    double avg10 = -1.0;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return -1.0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1)
+            break;
+    }
+
+    fclose(fp);
+    return avg10;
+}
+
+static long long
+_monotonic_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+_throttle_state_set(lms_t *lms, lms_throttle_state_t state)
+{
+    if (lms->throttle.state == state)
+        return;
+
+    log_info("scan throttle state %d -> %d", lms->throttle.state, state);
+
+    lms->throttle.state = state;
+    if (lms->throttle.cb)
+        lms->throttle.cb(lms, state, lms->throttle.data);
+}
+
+static void
+_throttle_sample(lms_t *lms)
+{
+    double cpu, io, pressure;
+
+    lms->throttle.last_sample = _monotonic_ms();
+
+    cpu = _pressure_some_avg10("/proc/pressure/cpu");
+    io = _pressure_some_avg10("/proc/pressure/io");
+    pressure = cpu > io ? cpu : io;
+
+    if (pressure < 0 || pressure < lms->throttle.slow_threshold)
+        _throttle_state_set(lms, LMS_THROTTLE_STATE_NONE);
+    else if (pressure >= lms->throttle.pause_threshold)
+        _throttle_state_set(lms, LMS_THROTTLE_STATE_PAUSED);
+    else if (lms->throttle.state != LMS_THROTTLE_STATE_PAUSED)
+        _throttle_state_set(lms, LMS_THROTTLE_STATE_SLOW);
+}
+
+/**
+ * Called by the master before it dispatches a file, slows down or pauses
+ * according to the current CPU and I/O pressure.
+ */
+void
+lms_throttle_dispatch(lms_t *lms)
+{
+    int waited;
+
+    if (lms->throttle.slow_threshold <= 0)
+        return;
+
+    if (_monotonic_ms() - lms->throttle.last_sample >= THROTTLE_SAMPLE_INTERVAL)
+        _throttle_sample(lms);
+
+    if (lms->throttle.state == LMS_THROTTLE_STATE_SLOW) {
+        usleep(THROTTLE_SLOW_DELAY * 1000);
+        return;
+    }
+
+    for (waited = 0;
+         lms->throttle.state == LMS_THROTTLE_STATE_PAUSED &&
+         !lms_is_cancelled(lms) && waited < THROTTLE_MAX_PAUSE;
+         waited += THROTTLE_PAUSE_POLL) {
+        usleep(THROTTLE_PAUSE_POLL * 1000);
+        _throttle_sample(lms);
+    }
+}
+
 void lms_set_mutex(lms_t *lms, pthread_mutex_t *mtx) {
     if (!lms) {
         return;
@@ -1269,6 +1508,46 @@ void lms_set_mutex(lms_t *lms, pthread_mutex_t *mtx) {
     lms->mtx = mtx;
 }
 
+/*
+ * /lms_lock is a robust mutex: a slave killed while holding it, or while
+ * waiting for it, is never unlocked on its behalf. Whoever locks it next
+ * gets EOWNERDEAD, SQLite already ignores the uncommitted transaction of
+ * the dead slave, so the lock is just made consistent again.
+ */
+static int
+_mutex_recover(pthread_mutex_t *mtx, int r)
+{
+    if (r != EOWNERDEAD)
+        return r;
+
+    log_warning("previous owner of the database lock died, recovering it");
+    return pthread_mutex_consistent(mtx);
+}
+
+/**
+ * Lock the shared database mutex, recovering it if its owner died.
+ *
+ * @param mtx mutex given to lms_set_mutex().
+ * @return On success 0 is returned, an errno value otherwise.
+ */
+int
+lms_mutex_lock(pthread_mutex_t *mtx)
+{
+    return _mutex_recover(mtx, pthread_mutex_lock(mtx));
+}
+
+/**
+ * Same as lms_mutex_lock() without waiting.
+ *
+ * @param mtx mutex given to lms_set_mutex().
+ * @return 0 if the lock was taken, EBUSY if it is held.
+ */
+int
+lms_mutex_trylock(pthread_mutex_t *mtx)
+{
+    return _mutex_recover(mtx, pthread_mutex_trylock(mtx));
+}
+
 int lms_open_database(const char* db_path) {
     sqlite3 *handle;
     char *errmsg = NULL;
@@ -1284,8 +1563,7 @@ int lms_open_database(const char* db_path) {
     }
 
     r = sqlite3_exec(handle,
-                     "PRAGMA journal_mode = WAL;"
-                      "PRAGMA wal_autocheckpoint = 1;",
+                     "PRAGMA journal_mode = WAL;",
                      NULL, NULL, &errmsg);
 
     if (r != SQLITE_OK) {
@@ -1326,6 +1604,517 @@ int lms_open_database(const char* db_path) {
     return r;
 }
 
+/*
+ * Commits of the scanning connections must not copy the WAL back into the
+ * database, lightmediascannered checkpoints from its own thread. The
+ * automatic checkpoint is only kept as a bound on the WAL for scans run
+ * without the daemon. Connections that don't take /lms_lock (or an
+ * external checkpoint) can still hold the write lock for a moment, so
+ * writers wait for it a little instead of failing with SQLITE_BUSY.
+ */
+#define LMS_WAL_AUTOCHECKPOINT_PAGES 10000
+#define LMS_WRITER_BUSY_TIMEOUT_MS 2000
+
+void
+lms_db_writer_setup(sqlite3 *handle)
+{
+    if (sqlite3_wal_autocheckpoint(handle, LMS_WAL_AUTOCHECKPOINT_PAGES) != SQLITE_OK)
+        log_warning("could not set WAL auto checkpoint: %s",
+                    sqlite3_errmsg(handle));
+
+    if (sqlite3_busy_timeout(handle, LMS_WRITER_BUSY_TIMEOUT_MS) != SQLITE_OK)
+        log_warning("could not set busy timeout: %s",
+                    sqlite3_errmsg(handle));
+}
+
+/*
+ * Last committed update_id, mirrored in shared memory so the daemon and
+ * its clients can read it without opening the database. There is one
+ * object per database, named after a hash of its path, so daemons on
+ * different databases (front and rear) don't mix their ids. Only the
+ * scanner creates and writes an object, readers map it read-only. Each
+ * is mapped once per process and never unmapped, the forked slaves
+ * inherit the mappings of their master.
+ */
+#define LMS_UPDATE_ID_SHM "/lms_update_id"
+
+struct update_id_shm {
+    volatile gint *rw;
+    const volatile gint *ro;
+};
+
+G_LOCK_DEFINE_STATIC(update_id_shm);
+static GHashTable *_update_id_shms = NULL; /* name -> struct update_id_shm */
+
+static volatile gint *
+_update_id_shm_map(const char *name, int writable)
+{
+    void *addr;
+    int fd;
+
+    if (writable)
+        fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IROTH);
+    else
+        fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        /* no scanner published anything yet */
+        if (writable || errno != ENOENT)
+            log_warning("could not open %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    /* a no-op once created, a new object reads as update_id 0 */
+    if (writable && ftruncate(fd, sizeof(gint)) != 0) {
+        log_warning("could not size %s: %s", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, sizeof(gint),
+                writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        log_warning("could not map %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    return addr;
+}
+
+static const volatile gint *
+_update_id_shm_get(const char *db_path, int writable)
+{
+    struct update_id_shm *shm;
+    const volatile gint *shared;
+    gchar *name;
+
+    if (!db_path)
+        return NULL;
+
+    name = g_strdup_printf("%s_%08x", LMS_UPDATE_ID_SHM, g_str_hash(db_path));
+
+    G_LOCK(update_id_shm);
+    if (!_update_id_shms)
+        _update_id_shms = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, g_free);
+
+    shm = g_hash_table_lookup(_update_id_shms, name);
+    if (!shm) {
+        shm = g_new0(struct update_id_shm, 1);
+        g_hash_table_insert(_update_id_shms, g_strdup(name), shm);
+    }
+
+    if (writable) {
+        if (!shm->rw)
+            shm->rw = _update_id_shm_map(name, 1);
+        shared = shm->rw;
+    } else {
+        /* a process that writes reads its own mapping */
+        if (!shm->rw && !shm->ro)
+            shm->ro = _update_id_shm_map(name, 0);
+        shared = shm->rw ? shm->rw : shm->ro;
+    }
+    G_UNLOCK(update_id_shm);
+
+    g_free(name);
+    return shared;
+}
+
+/**
+ * Publish the update_id of a transaction that was just committed.
+ *
+ * The shared value only moves forward, concurrent scans of several devices
+ * may commit the same or an older id after a newer one.
+ *
+ * @param db_path database the transaction was committed to.
+ * @param update_id id stored in lms_internal by the committed transaction.
+ */
+void
+lms_update_id_publish(const char *db_path, unsigned int update_id)
+{
+    volatile gint *shared = (volatile gint *)_update_id_shm_get(db_path, 1);
+    gint old;
+
+    if (!shared)
+        return;
+
+    do {
+        old = g_atomic_int_get(shared);
+        if ((unsigned int)old >= update_id)
+            return;
+    } while (!g_atomic_int_compare_and_exchange(shared, old, (gint)update_id));
+}
+
+/**
+ * Overwrite the shared update_id, ie: with the value read from a database
+ * that was just opened or recreated.
+ *
+ * @param db_path database the value belongs to.
+ * @param update_id new value, 0 if the database has none.
+ */
+void
+lms_update_id_reset(const char *db_path, unsigned int update_id)
+{
+    volatile gint *shared = (volatile gint *)_update_id_shm_get(db_path, 1);
+
+    if (shared)
+        g_atomic_int_set(shared, (gint)update_id);
+}
+
+/**
+ * Read the last published update_id, no database access.
+ *
+ * @param db_path database to read the value of, the same path the
+ *        scanner was given.
+ * @param update_id where to store the value.
+ *
+ * @return On success 0 is returned, -1 if the shared memory is unavailable.
+ */
+int
+lms_update_id_get_shared(const char *db_path, unsigned int *update_id)
+{
+    const volatile gint *shared = _update_id_shm_get(db_path, 0);
+
+    if (!shared)
+        return -1;
+
+    *update_id = (unsigned int)g_atomic_int_get(shared);
+    return 0;
+}
+
+static int
+_db_files_column_exists(sqlite3 *handle, const char *column)
+{
+    sqlite3_stmt *stmt;
+    int found = 0;
+
+    if (sqlite3_prepare_v2(handle, "PRAGMA table_info(files)", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        log_error("ERROR: could not get files table info: %s",
+                sqlite3_errmsg(handle));
+        return -1;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        if (name && strcmp(name, column) == 0) {
+            found = 1;
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+/**
+ * Add the columns and indexes the scanner relies on to an existing files table.
+ *
+ * Must be called after lms_db_create_core_tables_if_required(), it is a no-op
+ * on databases that are already up to date.
+ *
+ * @param handle open database connection.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_db_files_upgrade(sqlite3 *handle)
+{
+    const struct {
+        const char *column;
+        const char *sql;
+    } *itr, columns[] = {
+        /* 0 while only the presence scan saw the file, see lms_process_presence() */
+        {"parsed", "ALTER TABLE files ADD COLUMN parsed INTEGER NOT NULL DEFAULT 1"},
+        /* plugin name and version that produced the metadata, NULL for
+         * rows parsed before they were recorded, see lms_check_outdated() */
+        {"parser", "ALTER TABLE files ADD COLUMN parser TEXT"},
+        {"parser_version", "ALTER TABLE files ADD COLUMN parser_version TEXT"},
+        /* size and head/tail hash, reparse is skipped while it matches */
+        {"fingerprint", "ALTER TABLE files ADD COLUMN fingerprint INTEGER"},
+        {NULL, NULL}
+    };
+    static const char *indexes[] = {
+        /* rows left for lms_check_unparsed(), in the order it parses them */
+        "DROP INDEX IF EXISTS files_unparsed_idx",
+        "CREATE INDEX IF NOT EXISTS files_unparsed_mtime_idx ON files "
+        "(mtime DESC, id) WHERE parsed = 0",
+        /* covers the "path >= ? AND path < ?" range queries of the check
+         * and the daemon's per device cleanups, which filter on dtime and
+         * order by itime, without touching the table */
+        "CREATE INDEX IF NOT EXISTS files_path_dtime_idx ON files "
+        "(path, dtime, itime)",
+        "CREATE INDEX IF NOT EXISTS files_parser_idx ON files "
+        "(parser, parser_version)",
+        NULL
+    };
+    const char **idx;
+    char *errmsg = NULL;
+    int r;
+
+    for (itr = columns; itr->column != NULL; itr++) {
+        r = _db_files_column_exists(handle, itr->column);
+        if (r < 0)
+            return -1;
+        if (r > 0)
+            continue;
+
+        if (sqlite3_exec(handle, itr->sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+            log_error("ERROR: could not add files.%s: %s", itr->column, errmsg);
+            sqlite3_free(errmsg);
+            return -2;
+        }
+        log_info("files table upgraded with column '%s'", itr->column);
+    }
+
+    for (idx = indexes; *idx != NULL; idx++) {
+        if (sqlite3_exec(handle, *idx, NULL, NULL, &errmsg) != SQLITE_OK) {
+            log_error("ERROR: could not create index \"%s\": %s", *idx, errmsg);
+            sqlite3_free(errmsg);
+            return -3;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Cheap fingerprint of a file's content: FNV-1a of its size and of its
+ * first and last FINGERPRINT_CHUNK bytes, where tags live. A file whose
+ * mtime changed but whose fingerprint didn't (copied without keeping
+ * timestamps, touched over MTP) keeps the metadata it was parsed with.
+ */
+#define FINGERPRINT_CHUNK 4096
+
+static int
+_file_fingerprint(const char *path, int64_t size, int64_t *fingerprint)
+{
+    unsigned char buf[FINGERPRINT_CHUNK];
+    uint64_t h = 14695981039346656037ULL;
+    off_t offset = 0;
+    size_t len, i;
+    int fd, chunk, r = 0;
+
+    if (size < 0)
+        return -1;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    for (i = 0; i < sizeof(size); i++)
+        h = (h ^ (((uint64_t)size >> (i * 8)) & 0xff)) * 1099511628211ULL;
+
+    for (chunk = 0; chunk < 2 && offset < size; chunk++) {
+        len = (size - offset < FINGERPRINT_CHUNK) ? (size_t)(size - offset) : FINGERPRINT_CHUNK;
+        if (pread(fd, buf, len, offset) != (ssize_t)len) {
+            r = -1;
+            break;
+        }
+        for (i = 0; i < len; i++)
+            h = (h ^ buf[i]) * 1099511628211ULL;
+
+        /* the tail never overlaps the head */
+        offset = size - FINGERPRINT_CHUNK;
+        if (offset < FINGERPRINT_CHUNK)
+            offset = FINGERPRINT_CHUNK;
+    }
+
+    close(fd);
+    *fingerprint = (int64_t)h;
+    return r;
+}
+
+/**
+ * Check whether a file's content still matches the fingerprint stored in
+ * its row, flagging the row parsed if so.
+ *
+ * @param match statement from lms_db_compile_stmt_match_fingerprint().
+ * @param finfo file to check.
+ * @param existing whether finfo has a row already, only the fingerprint
+ *        is computed otherwise.
+ * @param fingerprint where to store the file's fingerprint.
+ * @param has_fingerprint set to whether *fingerprint could be computed.
+ *
+ * @return 1 if the content is unchanged, 0 if the file must be parsed.
+ */
+int
+lms_db_content_unchanged(sqlite3_stmt *match, const struct lms_file_info *finfo,
+                         int existing, int64_t *fingerprint, int *has_fingerprint)
+{
+    int r;
+
+    *has_fingerprint = (_file_fingerprint(finfo->path, finfo->size,
+                                          fingerprint) == 0);
+    if (!*has_fingerprint || !existing)
+        return 0;
+
+    if (sqlite3_bind_int64(match, 1, finfo->id) != SQLITE_OK ||
+        sqlite3_bind_int64(match, 2, *fingerprint) != SQLITE_OK) {
+        log_error("ERROR: could not bind fingerprint of file %lld",
+                (long long)finfo->id);
+        lms_db_reset_stmt(match);
+        return 0;
+    }
+
+    r = sqlite3_step(match);
+    lms_db_reset_stmt(match);
+    if (r != SQLITE_DONE)
+        return 0;
+
+    return sqlite3_changes(sqlite3_db_handle(match)) > 0;
+}
+
+/**
+ * Store the fingerprint of a file that was just parsed.
+ *
+ * @param stmt statement from lms_db_compile_stmt_set_fingerprint().
+ * @param id row id of the file.
+ * @param fingerprint value from lms_db_content_unchanged().
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_db_set_file_fingerprint(sqlite3_stmt *stmt, int64_t id, int64_t fingerprint)
+{
+    int r;
+
+    if (sqlite3_bind_int64(stmt, 1, fingerprint) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, id) != SQLITE_OK) {
+        log_error("ERROR: could not bind fingerprint of file %lld",
+                (long long)id);
+        lms_db_reset_stmt(stmt);
+        return -1;
+    }
+
+    r = sqlite3_step(stmt);
+    lms_db_reset_stmt(stmt);
+    if (r != SQLITE_DONE) {
+        log_error("ERROR: could not set fingerprint of file %lld: %d",
+                (long long)id, r);
+        return -2;
+    }
+
+    return 0;
+}
+
+/**
+ * Flag a file row as parsed or not and record which parser produced it.
+ *
+ * @param stmt statement from lms_db_compile_stmt_set_file_parsed().
+ * @param id row id of the file.
+ * @param parsed 1 once the file was parsed, 0 to have it parsed again.
+ * @param producer parser that owns the metadata, NULL if none.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_db_set_file_parsed(sqlite3_stmt *stmt, int64_t id, int parsed,
+                       const struct parser *producer)
+{
+    int r;
+
+    if (sqlite3_bind_int(stmt, 1, parsed) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 2, producer ? producer->plugin->name : NULL,
+                          -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 3, producer ? producer->version : NULL,
+                          -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 4, id) != SQLITE_OK) {
+        log_error("ERROR: could not bind parsed flag of file %lld",
+                (long long)id);
+        lms_db_reset_stmt(stmt);
+        return -1;
+    }
+
+    r = sqlite3_step(stmt);
+    lms_db_reset_stmt(stmt);
+    if (r != SQLITE_DONE) {
+        log_error("ERROR: could not set parsed flag of file %lld: %d",
+                (long long)id, r);
+        return -2;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse a file whose row was just written, unless its content still
+ * matches the stored fingerprint, and update the row accordingly: flagged
+ * parsed with its producer and fingerprint, left unparsed if the scan was
+ * cancelled half way, or deleted if no parser could handle it.
+ *
+ * @param lms instance whose parsers to run.
+ * @param parser_match from lms_parsers_check_using().
+ * @param finfo file to parse, with its row id.
+ * @param existing whether the row existed before this scan.
+ * @param set_file_parsed from lms_db_compile_stmt_set_file_parsed().
+ * @param match_fingerprint from lms_db_compile_stmt_match_fingerprint().
+ * @param set_fingerprint from lms_db_compile_stmt_set_fingerprint().
+ * @param delete_file_info from lms_db_compile_stmt_delete_file_info().
+ *
+ * @return 0 if the file was parsed or is unchanged, 1 if only some
+ *         parsers failed, -ECANCELED if the scan was cancelled, other
+ *         values < 0 if it could not be parsed.
+ */
+int
+lms_db_parse_file(lms_t *lms, void **parser_match, struct lms_file_info *finfo,
+                  int existing, sqlite3_stmt *set_file_parsed,
+                  sqlite3_stmt *match_fingerprint,
+                  sqlite3_stmt *set_fingerprint,
+                  sqlite3_stmt *delete_file_info)
+{
+    const struct parser *producer;
+    int64_t fingerprint;
+    int has_fingerprint, r;
+
+    /* only the times changed, the row update was all it needed */
+    if (lms_db_content_unchanged(match_fingerprint, finfo, existing,
+                                 &fingerprint, &has_fingerprint))
+        return 0;
+
+    r = lms_parsers_run(lms, sqlite3_db_handle(set_file_parsed), parser_match,
+                        finfo, &producer);
+    if (r == -ECANCELED) {
+        /* partly parsed, picked up again by the next scan */
+        lms_db_set_file_parsed(set_file_parsed, finfo->id, 0, NULL);
+        return r;
+    } else if (r < 0) {
+        log_warning("ERROR: pid=%d failed to parse \"%s\".",
+                getpid(), finfo->path);
+        lms_db_delete_file_info(delete_file_info, finfo);
+        return r;
+    }
+
+    lms_db_set_file_parsed(set_file_parsed, finfo->id, 1, producer);
+    if (has_fingerprint)
+        lms_db_set_file_fingerprint(set_fingerprint, finfo->id, fingerprint);
+
+    return r;
+}
+
+sqlite3_stmt *
+lms_db_compile_stmt_set_file_parsed(sqlite3 *db)
+{
+    return lms_db_compile_stmt(db,
+        "UPDATE files SET parsed = ?, parser = ?, parser_version = ? "
+        "WHERE id = ?");
+}
+
+sqlite3_stmt *
+lms_db_compile_stmt_match_fingerprint(sqlite3 *db)
+{
+    return lms_db_compile_stmt(db,
+        "UPDATE files SET parsed = 1 WHERE id = ? AND fingerprint = ?");
+}
+
+sqlite3_stmt *
+lms_db_compile_stmt_set_fingerprint(sqlite3 *db)
+{
+    return lms_db_compile_stmt(db,
+        "UPDATE files SET fingerprint = ? WHERE id = ?");
+}
+
 void lms_delete_database(const char* db_path) {
     char *shm = NULL;
     char *wal = NULL;
@@ -1353,6 +2142,7 @@ void lms_delete_database(const char* db_path) {
         }
         g_free(shm);
         g_free(wal);
+        lms_update_id_reset(db_path, 0);
     }
 }
 
@@ -37,6 +37,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #include <matroska/c/libmatroska_t.h>
 #include <matroska/c/libmatroska.h>
@@ -311,6 +312,86 @@ _match(struct plugin *p, const char *path, int len, int base)
       return (void*)(i + 1);
 }
 
+#define EBML_ID_HEADER      0x1A45DFA3
+#define EBML_ID_DOCTYPE     0x4282
+#define EBML_HEADER_MAX     1024
+
+/* EBML variable size integer at p, the length marker is kept for IDs */
+static const unsigned char *
+_ebml_vint(const unsigned char *p, const unsigned char *end, uint64_t *value, int keep_marker)
+{
+    unsigned char mask = 0x80;
+    int i, len = 1;
+
+    if (p >= end)
+        return NULL;
+
+    while (len <= 8 && !(p[0] & mask)) {
+        mask >>= 1;
+        len++;
+    }
+    if (len > 8 || end - p < len)
+        return NULL;
+
+    *value = keep_marker ? p[0] : (p[0] & (mask - 1));
+    for (i = 1; i < len; i++)
+        *value = (*value << 8) | p[i];
+
+    return p + len;
+}
+
+/*
+ * Look at the EBML header in the head of the file shared by the parsers,
+ * before libmatroska opens and walks it: misnamed or truncated files are
+ * rejected without another read.
+ *
+ * Return: 0 if DocType is matroska or webm, -1 otherwise. A header
+ * without DocType gets the EBML default, "matroska".
+ */
+static int
+_check_ebml_header(const struct lms_context *ctxt)
+{
+    const unsigned char *p, *end;
+    uint64_t id, size;
+    size_t len;
+
+    p = lms_context_file_head(ctxt, &len);
+    if (!p)
+        return 0; /* let libmatroska decide */
+
+    if (len > EBML_HEADER_MAX)
+        len = EBML_HEADER_MAX;
+    end = p + len;
+
+    p = _ebml_vint(p, end, &id, 1);
+    if (!p || id != EBML_ID_HEADER)
+        return -1;
+    p = _ebml_vint(p, end, &size, 0);
+    if (!p)
+        return -1;
+    if (size < (uint64_t)(end - p))
+        end = p + size;
+
+    while (p && p < end) {
+        p = _ebml_vint(p, end, &id, 1);
+        if (p)
+            p = _ebml_vint(p, end, &size, 0);
+        if (!p || size > (uint64_t)(end - p))
+            break;
+
+        if (id == EBML_ID_DOCTYPE) {
+            if ((size == 8 && memcmp(p, "matroska", 8) == 0) ||
+                (size == 4 && memcmp(p, "webm", 4) == 0))
+                return 0;
+            return -1;
+        }
+        p += size;
+    }
+
+    /* no DocType element, the default applies */
+    return p == end ? 0 : -1;
+}
+
 static int
 _parse(struct plugin *plugin, struct lms_context *ctxt, const struct lms_file_info *finfo, void *match)
 {
@@ -324,6 +405,13 @@ _parse(struct plugin *plugin, struct lms_context *ctxt, const struct lms_file_in
     c_string path = (c_string)finfo->path;
 
     g_debug("[%s:%d] start parsing [%s] ", __FUNCTION__, __LINE__, finfo->path);
+
+    if (_check_ebml_header(ctxt) != 0) {
+        r = -1;
+        g_warning("[%s:%d] no matroska EBML header [%s]", __FUNCTION__, __LINE__, finfo->path);
+        goto exit;
+    }
+
     stream = matroska_open_stream_file(path);
 
     if (stream){
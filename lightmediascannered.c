@@ -8,6 +8,7 @@
 #include <locale.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <math.h>
 
 #include "lightmediascanner.h"
@@ -32,6 +33,15 @@ static gboolean startup_scan = FALSE;
 #endif
 
 static gboolean omit_scan_progress = FALSE;
+static int scan_progress_rate = 4;
+static int max_concurrent_devices = 1;
+static gboolean two_phase_scan = FALSE;
+static gboolean single_pass_scan = FALSE;
+static gboolean fast_reattach = FALSE;
+static gboolean reparse_outdated = FALSE;
+static char *storage_order = NULL;
+static double pressure_slow_threshold = 0.0;
+static double pressure_pause_threshold = 40.0;
 
 static GHashTable *categories = NULL;
 
@@ -68,15 +78,26 @@ static const char introspection_xml[] =
     "    <property name=\"WriteLocked\" type=\"b\" access=\"read\" />"
     "    <property name=\"UpdateID\" type=\"t\" access=\"read\" />"
     "    <property name=\"Categories\" type=\"a{sv}\" access=\"read\" />"
+    "    <property name=\"ThrottleState\" type=\"u\" access=\"read\" />"
+#ifdef PATCH_LGE
+    /* see lock_hold_max_us */
+    "    <property name=\"MaxLockHoldTime\" type=\"u\" access=\"read\" />"
+#endif
     "    <method name=\"Scan\">"
     "      <arg direction=\"in\" type=\"a{sv}\" name=\"specification\" />"
     "    </method>"
+    "    <method name=\"ScanFiles\">"
+    "      <arg direction=\"in\" type=\"as\" name=\"paths\" />"
+    "    </method>"
     "    <method name=\"Stop\" />"
     "    <method name=\"RequestWriteLock\" />"
     "    <method name=\"ReleaseWriteLock\" />"
     "    <method name=\"SetPlayNG\">"
     "      <arg direction=\"in\" type=\"s\" name=\"specification\" />"
     "    </method>"
+    "    <method name=\"SetPlayNGs\">"
+    "      <arg direction=\"in\" type=\"a(sb)\" name=\"files\" />"
+    "    </method>"
     "    <signal name=\"ScanProgress\">"
     "      <arg type=\"s\" name=\"Category\" />"
     "      <arg type=\"s\" name=\"Path\" />"
@@ -108,17 +129,19 @@ typedef struct scanner_pending
     GList *paths;
 } scanner_pending_t;
 
+/* Counters of one category, summed over every path of it scanned since
+ * the scan started, see scan_worker_progress_begin() */
 typedef struct scan_progress {
     GDBusConnection *conn;
     gchar *category;
-    gchar *path;
+    gchar *path; /* last path begun, guarded by scanner->progress.lock */
+    /* added to by the scan workers, read by the main loop, atomically */
     guint64 uptodate;
     guint64 processed;
     guint64 deleted;
     guint64 skipped;
     guint64 errors;
-    time_t last_report_time;
-    gint updated;
+    guint64 reported; /* main loop only: counters sum at the last signal */
 } scan_progress_t;
 
 #ifdef PATCH_LGE
@@ -130,9 +153,11 @@ typedef struct scan_device {
 } scanDeviceType;
 #endif
 
-/* Scan progress signals will be issued if the time since last
- * emission is greated than SCAN_PROGRESS_UPDATE_TIMEOUT _and_ number
- * of items is greater than the SCAN_PROGRESS_UPDATE_COUNT.
+/* Scan progress signals are emitted from the main loop at most
+ * scan_progress_rate times per second, one per category whose counters
+ * changed since the last one. Concurrent workers scanning paths of the
+ * same category add to the same counters, the scanner thread itself
+ * only bumps them.
  *
  * Be warned that D-Bus signal will wake-up the dbus-daemon (unless
  * k-dbus) and all listener clients, which may hurt scan performance,
@@ -140,10 +165,8 @@ typedef struct scan_device {
  * conservative to not hurt performance.
  *
  * Note that at after a path is scanned (check/progress) the signal is
- * emitted even if count or timeout didn't match.
+ * emitted right away for that path with the counters of its category.
  */
-#define SCAN_PROGRESS_UPDATE_TIMEOUT 1 /* in seconds */
-#define SCAN_PROGRESS_UPDATE_COUNT  50 /* in number of items */
 #define SCAN_MOUNTPOINTS_TIMEOUT 1 /* in seconds */
 #define MAX_COLS 255
 
@@ -153,14 +176,22 @@ typedef struct scanner {
     unsigned write_lock_name_watcher;
     GDBusMethodInvocation *pending_stop;
     GList *pending_scan; /* of scanner_pending_t, see scanner_thread_work */
+    GPtrArray *pending_files; /* of char *, see scanner_files_thread_work */
     GList *pending_device_scan;
     GThread *thread; /* see scanner_thread_work */
     unsigned cleanup_thread_idler; /* see scanner_thread_work */
-    scan_progress_t *scan_progress;
-#ifdef PATCH_LGE
-    scanDeviceType *scan_device;
-#endif
-    GList *unavail_files;
+    struct {
+        GMutex lock;
+        GList *active; /* of scan_progress_t, one per category, see scan_worker_progress_begin */
+        unsigned timer;
+    } progress;
+    GHashTable *unavail_files; /* path -> GINT_TO_POINTER(playng) */
+    unsigned play_ng_timer; /* coalesces SetPlayNG bursts */
+    struct {
+        unsigned timer; /* see scanner_idle_vacuum */
+        gint64 last_busy; /* monotonic time the database was last in use */
+        gboolean running;
+    } vacuum;
     struct {
         GIOChannel *channel;
         unsigned watch;
@@ -169,6 +200,11 @@ typedef struct scanner {
         GList *pending;
     } mounts;
     guint64 update_id;
+    gint throttle_state; /* lms_throttle_state_t, written by scanner thread */
+    struct {
+        GMutex lock;
+        GList *workers; /* of scan_worker_t, see scan_worker_init */
+    } current;
     struct {
         unsigned idler; /* not a flag, but g_source tag */
         unsigned is_scanning : 1;
@@ -176,11 +212,28 @@ typedef struct scanner {
         unsigned update_id : 1;
         unsigned categories: 1;
         unsigned scanner_status: 1; //hkchoi
+        unsigned throttle_state: 1;
     } changed_props;
 } scanner_t;
 
+/* State of one thread scanning, see scan_job_run() */
+typedef struct scan_worker {
+    scanner_t *scanner;
+    scan_progress_t *scan_progress; /* of the category being scanned */
+#ifdef PATCH_LGE
+    scanDeviceType *scan_device;
+#endif
+    /* guarded by scanner->current.lock */
+    lms_t *lms; /* instance the worker is running, or NULL */
+    const char *path; /* path it is working on, owned by the worker */
+} scan_worker_t;
+
+G_LOCK_DEFINE_STATIC(pending_device);
+
 #ifdef PATCH_LGE
-static void update_db_play_ng_file(gpointer data, gpointer user_data);
+static void flush_play_ng_files(scanner_t *scanner);
+static guint64 get_device_path_id(sqlite3 *db, char *device_path);
+static gboolean check_write_locked(const scanner_t *scanner);
 
 static pthread_mutex_t  *mtx;
 static pthread_mutexattr_t mtxattr;
@@ -232,38 +285,180 @@ static int shared_lock_init(void) {
             return -1;
         }
 
+        /* slaves may be killed holding it, see lms_mutex_lock() */
+        ret = pthread_mutexattr_setrobust(&mtxattr, PTHREAD_MUTEX_ROBUST);
+        if (ret) {
+            log_warning("pthread_mutexattr_setrobust() failed.(errno=%d)\n", ret);
+            return -1;
+        }
+
         pthread_mutex_init(mtx, &mtxattr);
     }
     return ret;
 }
 
-static int delete_deleted_files(sqlite3 *db, const char *device_path) {
-    sqlite3_stmt *stmt;
-    int ret;
-    const char sql[] = "DELETE FROM files WHERE (dtime>0 AND path LIKE ? AND EXISTS (SELECT * FROM files WHERE path  LIKE ? AND dtime=0))";
-    char path[PATH_MAX] = {'\0',};
-    size_t len = 0;
+/*
+ * Worst case time this daemon held 'mtx' through db_lock(), in
+ * microseconds, exposed as MaxLockHoldTime. The holds of the lms scan
+ * code (slaves, presence batches, ScanFiles) are not counted. Clients
+ * read it on demand, no PropertiesChanged is emitted when it grows.
+ */
+static gint lock_hold_max_us = 0;
 
-    len = strlen(device_path);
-    if ((UINT_MAX - sizeof("/%")) < len) {
-        log_error("ERROR: len may wrap");
-        return -1;
-    } else {
-        if ((len + sizeof("/%")) >= PATH_MAX) {
-            log_error("ERROR: path is too long: \"%s\" + /%%", device_path);
-            return -1;
-            }
+static gint64
+db_lock(void)
+{
+    lms_mutex_lock(mtx);
+    return g_get_monotonic_time();
+}
+
+static void
+db_unlock(gint64 locked_at, const char *what)
+{
+    gint64 held = g_get_monotonic_time() - locked_at;
+
+    /* still under 'mtx', so updates of the maximum don't race */
+    if (held > INT_MAX)
+        held = INT_MAX;
+    if (held > g_atomic_int_get(&lock_hold_max_us)) {
+        g_atomic_int_set(&lock_hold_max_us, (gint)held);
+        log_info("longest database lock hold so far: %" G_GINT64_FORMAT
+                 " us (%s)", held, what);
     }
 
-    memcpy(path, device_path, len);
-    if ((len > 0) && (path[len - 1] != '/')) {
-        path[len] = '/';
-        len++;
+    pthread_mutex_unlock(mtx);
+}
+
+#define CLEANUP_CHUNK_ROWS 1000
+#define CLEANUP_YIELD_US 1000 /* let the browser take the lock */
+
+typedef int (*cleanup_bind_cb)(sqlite3_stmt *stmt, void *data);
+
+/*
+ * Deletes the files matching 'where' in chunks of at most
+ * CLEANUP_CHUNK_ROWS rows, walking the rowid upwards: each chunk looks up
+ * the id range of its next rows after the previous one and deletes that
+ * range, so no row is scanned twice (unlike LIMIT/OFFSET). 'mtx' is only
+ * held for one chunk at a time. 'bind' binds the positional parameters
+ * of 'where' on both statements.
+ *
+ * @return number of deleted rows or a negative value on error.
+ */
+static gint64
+delete_files_chunked(sqlite3 *db, const char *where, cleanup_bind_cb bind,
+                     void *data, const char *what)
+{
+    char *sql_next, *sql_delete;
+    sqlite3_stmt *next = NULL, *delete = NULL;
+    sqlite3_int64 last = 0, upto;
+    gint64 total = 0, locked_at;
+    gboolean done = FALSE;
+    int r;
+
+    /* 'where' comes first so its ?N are numbered before the named ones */
+    sql_next = g_strdup_printf("SELECT max(id) FROM (SELECT id FROM files "
+                               "WHERE (%s) AND id > :last "
+                               "ORDER BY id LIMIT :chunk)", where);
+    sql_delete = g_strdup_printf("DELETE FROM files WHERE (%s) "
+                                 "AND id > :last AND id <= :upto", where);
+
+    if (sqlite3_prepare_v2(db, sql_next, -1, &next, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, sql_delete, -1, &delete, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare %s cleanup: %s", what, sqlite3_errmsg(db));
+        total = -1;
+        goto end;
     }
-    path[len] = '%';
-    len++;
 
-    path[len] = '\0';
+    if (bind(next, data) != 0 || bind(delete, data) != 0 ||
+        sqlite3_bind_int(next, sqlite3_bind_parameter_index(next, ":chunk"),
+                         CLEANUP_CHUNK_ROWS) != SQLITE_OK) {
+        log_warning("Couldn't bind %s cleanup: %s", what, sqlite3_errmsg(db));
+        total = -1;
+        goto end;
+    }
+
+    while (!done) {
+        locked_at = db_lock();
+
+        sqlite3_bind_int64(next, sqlite3_bind_parameter_index(next, ":last"),
+                           last);
+        r = sqlite3_step(next);
+        if (r != SQLITE_ROW || sqlite3_column_type(next, 0) == SQLITE_NULL) {
+            if (r != SQLITE_ROW)
+                log_warning("Couldn't find next %s chunk, ret=%d: %s",
+                            what, r, sqlite3_errmsg(db));
+            done = TRUE;
+        } else {
+            upto = sqlite3_column_int64(next, 0);
+
+            sqlite3_bind_int64(delete,
+                               sqlite3_bind_parameter_index(delete, ":last"),
+                               last);
+            sqlite3_bind_int64(delete,
+                               sqlite3_bind_parameter_index(delete, ":upto"),
+                               upto);
+            r = sqlite3_step(delete);
+            if (r != SQLITE_DONE) {
+                log_warning("Couldn't delete %s chunk, ret=%d: %s",
+                            what, r, sqlite3_errmsg(db));
+                done = TRUE;
+            } else
+                total += sqlite3_changes(db);
+            sqlite3_reset(delete);
+            last = upto;
+        }
+        sqlite3_reset(next);
+
+        db_unlock(locked_at, what);
+
+        if (!done)
+            g_usleep(CLEANUP_YIELD_US);
+    }
+
+    log_debug("%s cleanup deleted %" G_GINT64_FORMAT " files", what, total);
+
+end:
+    sqlite3_finalize(next);
+    sqlite3_finalize(delete);
+    g_free(sql_next);
+    g_free(sql_delete);
+    return total;
+}
+
+/*
+ * Prefix queries on files.path are written as the half-open range
+ * "path >= ? AND path < ?", which can use the index on path while
+ * "path LIKE 'dir/%'" is a full table scan. lower must end with '/' and
+ * be len bytes long, upper gets the same bytes with that '/' replaced by
+ * the next one, '0'. path is a blob column so both bounds must be bound
+ * with sqlite3_bind_blob(): a text value never compares inside it.
+ */
+static void path_range_upper(const char *lower, size_t len, char *upper)
+{
+    memcpy(upper, lower, len);
+    upper[len - 1] = '/' + 1;
+    upper[len] = '\0';
+}
+
+static int bind_path_range(sqlite3_stmt *stmt, int idx, const char *lower, size_t len, char *upper)
+{
+    if (len == 0 || len > INT_MAX)
+        return -1;
+
+    path_range_upper(lower, len, upper);
+
+    if (sqlite3_bind_blob(stmt, idx, lower, (int)len, SQLITE_STATIC) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_blob(stmt, idx + 1, upper, (int)len, SQLITE_STATIC) != SQLITE_OK)
+        return -1;
+
+    return 0;
+}
+
+static int delete_deleted_files(sqlite3 *db, guint64 device_id) {
+    sqlite3_stmt *stmt;
+    int ret;
+    const char sql[] = "DELETE FROM files WHERE (device_id = ?1 AND dtime>0 AND EXISTS (SELECT 1 FROM files WHERE device_id = ?1 AND dtime=0))";
 
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
         log_warning("Couldn't prepare select : %s", sqlite3_errmsg(db));
@@ -271,14 +466,8 @@ static int delete_deleted_files(sqlite3 *db, const char *device_path) {
         goto end;
     }
 
-    if (sqlite3_bind_text(stmt, 1, path, len, SQLITE_STATIC) != SQLITE_OK) {
-        log_warning("Couldn't bind device path :%s path: %s error: %s", path, db_path, sqlite3_errmsg(db));
-        ret =-1;
-        goto cleanup;
-    }
-
-    if (sqlite3_bind_text(stmt, 2, path, len, SQLITE_STATIC) != SQLITE_OK) {
-        log_warning("Couldn't bind device path :%s path: %s error: %s", path, db_path, sqlite3_errmsg(db));
+    if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64)device_id) != SQLITE_OK) {
+        log_warning("Couldn't bind device id :%llu path: %s error: %s", (unsigned long long)device_id, db_path, sqlite3_errmsg(db));
         ret =-1;
         goto cleanup;
     }
@@ -301,10 +490,109 @@ static int delete_deleted_files(sqlite3 *db, const char *device_path) {
     return ret;
 }
 
-static int delete_over_scanned_files(sqlite3 *db, const char *device, int limit) {
+typedef struct over_scan {
+    guint64 device_id; /* 0: not a known device, use the path range */
+    const char *path;
+    size_t len;
+    char upper[PATH_MAX + 1];
+    gboolean cutoff_known;
+    sqlite3_int64 cutoff_itime;
+    sqlite3_int64 cutoff_id;
+} over_scan_t;
+
+static int
+over_scan_bind(sqlite3_stmt *stmt, void *data)
+{
+    over_scan_t *o = data;
+    int idx;
+
+    if (o->device_id > 0) {
+        if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64)o->device_id) != SQLITE_OK)
+            return -1;
+        idx = 2;
+    } else {
+        if (bind_path_range(stmt, 1, o->path, o->len, o->upper) != 0)
+            return -1;
+        idx = 3;
+    }
+
+    if (!o->cutoff_known)
+        return 0;
+
+    if (sqlite3_bind_int64(stmt, idx, o->cutoff_itime) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, idx + 1, o->cutoff_id) != SQLITE_OK)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Keeps the 'limit' most recently inserted files of the device at
+ * 'usb_path'. The first file past the limit, in "itime DESC, id DESC"
+ * order, is looked up once and everything at or after it is deleted in
+ * chunks.
+ */
+static int
+delete_over_scanned_dir(sqlite3 *db, const char *usb_path, size_t len, int limit)
+{
+    const char sql_cutoff_device[] = "SELECT itime, id FROM files WHERE device_id = ?1 AND dtime = 0 ORDER BY itime DESC, id DESC LIMIT 1 OFFSET :offset";
+    const char sql_cutoff_path[] = "SELECT itime, id FROM files WHERE path >= ?1 AND path < ?2 AND dtime = 0 ORDER BY itime DESC, id DESC LIMIT 1 OFFSET :offset";
+    const char where_device[] = "device_id = ?1 AND dtime = 0 AND (itime < ?2 OR (itime = ?2 AND id <= ?3))";
+    const char where_path[] = "path >= ?1 AND path < ?2 AND dtime = 0 AND (itime < ?3 OR (itime = ?3 AND id <= ?4))";
+    over_scan_t o = {0,};
     sqlite3_stmt *stmt = NULL;
+    gint64 locked_at;
+    gint64 deleted;
+    int ret;
+
+    o.path = usb_path;
+    o.len = len;
+
+    locked_at = db_lock();
+
+    /* directories that never were a known device keep the path range */
+    o.device_id = get_device_path_id(db, (char *)usb_path);
+    if (sqlite3_prepare_v2(db, o.device_id > 0 ? sql_cutoff_device : sql_cutoff_path, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare select : %s", sqlite3_errmsg(db));
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (over_scan_bind(stmt, &o) != 0 ||
+        sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":offset"), limit) != SQLITE_OK) {
+        log_warning("Couldn't bind device path: %s error: %s", usb_path, sqlite3_errmsg(db));
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = sqlite3_step(stmt);
+    if (ret == SQLITE_ROW) {
+        o.cutoff_itime = sqlite3_column_int64(stmt, 0);
+        o.cutoff_id = sqlite3_column_int64(stmt, 1);
+        o.cutoff_known = TRUE;
+    }
+    else if (ret != SQLITE_DONE)
+        log_warning("Couldn't run SQL to find over scanned files, path=%s, ret=%d: %s",
+                usb_path, ret, sqlite3_errmsg(db));
+
+cleanup:
+    sqlite3_finalize(stmt);
+    db_unlock(locked_at, "over scan cutoff");
+
+    if (!o.cutoff_known)
+        return ret == SQLITE_DONE ? 0 : -1;
+
+    deleted = delete_files_chunked(db, o.device_id > 0 ? where_device : where_path,
+                                   over_scan_bind, &o, "over scan");
+    if (deleted < 0)
+        return -1;
+
+    log_info("Delete from DB %" G_GINT64_FORMAT " over scanned files in mounted devices path=%s \n", deleted, usb_path);
+    return 0;
+}
+
+static int delete_over_scanned_files(sqlite3 *db, const char *device, int limit) {
     int ret = -1;
-    const char sql[] = "DELETE FROM files WHERE id IN (SELECT id FROM (SELECT id FROM files WHERE dtime = 0 AND path LIKE ? ORDER BY itime DESC LIMIT 10000 offset ?))";
     char path[PATH_MAX];
     size_t len_1 = 0;
     size_t len_2 = 0;
@@ -331,7 +619,7 @@ static int delete_over_scanned_files(sqlite3 *db, const char *device, int limit)
     if(pdir == NULL)
     {
         log_warning("couldn't open path :%s", path);
-        goto end;
+        return -1;
     }
 
     while ((pent = readdir(pdir)) != NULL)
@@ -344,7 +632,7 @@ static int delete_over_scanned_files(sqlite3 *db, const char *device, int limit)
         if (len_1 > (PATH_MAX -1) ) {
             log_error("ERROR: length_1 may wraup");
             ret = -1;
-            goto cleanup;
+            continue;
         }
 
         memcpy(usb_path , path , len_1);
@@ -354,7 +642,7 @@ static int delete_over_scanned_files(sqlite3 *db, const char *device, int limit)
         if (len_2 > (PATH_MAX - len_1 - 2) ) {
             log_error("ERROR: length_2 may wraup");
             ret = -1;
-            goto cleanup;
+            continue;
         }
         memcpy(usb_path+len_1+1 , pent->d_name , len_2);
         usb_path[len_1+len_2+2] = '\0';
@@ -368,88 +656,26 @@ static int delete_over_scanned_files(sqlite3 *db, const char *device, int limit)
         {
             usb_path[sizeof(usb_path) - 1] = '\0';
             len_1 = strlen(usb_path);
-            if ((len_1 > 0) && (UINT_MAX > (len_1 - 1)) && (len_1 < (PATH_MAX - 1)) && (path[len_1 - 1] != '/')) {
+            if ((len_1 > 0) && (UINT_MAX > (len_1 - 1)) && (len_1 < (PATH_MAX - 1)) && (usb_path[len_1 - 1] != '/')) {
                 usb_path[len_1] = '/';
                 len_1++;
             }
-            if ((UINT_MAX > (len_1 - 2)) && (len_1 < (PATH_MAX - 2))) {
-                usb_path[len_1] = '%';
-                len_1++;
-                usb_path[len_1] = '\0';
-            }
-            if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-                log_warning("Couldn't prepare select : %s", sqlite3_errmsg(db));
-                ret = -1;
-                goto cleanup;
-            }
-
-            if (sqlite3_bind_text(stmt, 1, usb_path, len_1, SQLITE_STATIC) != SQLITE_OK) {
-                log_warning("Couldn't bind device path: %s error: %s", usb_path, sqlite3_errmsg(db));
-                ret = -1;
-                goto cleanup;
-            }
-
-            if (sqlite3_bind_int(stmt, 2, limit) != SQLITE_OK) {
-                log_warning("Couldn't bind int %s", sqlite3_errmsg(db));
-                goto cleanup;
-            }
+            usb_path[len_1] = '\0';
 
-
-            ret = sqlite3_step(stmt);
-
-            if (ret ==  SQLITE_DONE) {
-                log_info("Delete from DB over deleted files in mounted devices path=%s \n", usb_path);
-            }
-            else {
-                log_warning("Couldn't run SQL to delete over scanned files, path=%s, ret=%d: %s",
-                        usb_path, ret, sqlite3_errmsg(db));
-            }
-
-cleanup:
-            sqlite3_reset(stmt);
-            sqlite3_finalize(stmt);
+            ret = delete_over_scanned_dir(db, usb_path, len_1, limit);
         }
     }
 
-end:
     closedir(pdir);
     return ret;
 }
 
-static int update_recent_device_files(sqlite3 *db, const char *device_path) {
+static int update_recent_device_files(sqlite3 *db, guint64 device_id) {
     sqlite3_stmt *stmt;
     int ret = -1;
-    const char sql[] = "UPDATE files SET dtime = ? WHERE (dtime>0 AND dtime < ? AND path LIKE ? )";
-    char path[PATH_MAX] = {'\0',};
-    size_t len = 0;
+    const char sql[] = "UPDATE files SET dtime = ? WHERE (device_id = ? AND dtime>0 AND dtime < ?1)";
     gint64 dtime;
 
-    if(NULL == device_path) {
-        log_error("dereferencing NULL pointer");
-    } else {
-        len = strlen(device_path);
-        if ((UINT_MAX  - sizeof("/%")) < len) {
-            log_error("ERROR: len may wrap");
-            ret =-1;
-            goto end;
-        } else {
-            if ((len + sizeof("/%")) >= PATH_MAX) {
-                log_error("ERROR: path is too long: \"%s\" + /%%", device_path);
-                ret =-1;
-                goto end;
-            }
-        }
-    }
-
-    memcpy(path, device_path, len);
-    if ((len > 0) && (path[len - 1] != '/')) {
-        path[len] = '/';
-        len++;
-    }
-    path[len] = '%';
-    len++;
-    path[len] = '\0';
-
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
         log_warning("Couldn't prepare select : %s", sqlite3_errmsg(db));
         ret =-1;
@@ -474,14 +700,8 @@ static int update_recent_device_files(sqlite3 *db, const char *device_path) {
         }
     }
 
-    if (sqlite3_bind_int(stmt, 2, dtime) != SQLITE_OK) {
-        log_warning("Couldn't bind dtime :%lld path: %s error: %s", dtime, db_path, sqlite3_errmsg(db));
-        ret =-1;
-        goto cleanup;
-    }
-
-    if (sqlite3_bind_text(stmt, 3, path, len, SQLITE_STATIC) != SQLITE_OK) {
-        log_warning("Couldn't bind device path :%s path: %s error: %s", path, db_path, sqlite3_errmsg(db));
+    if (sqlite3_bind_int64(stmt, 2, (sqlite3_int64)device_id) != SQLITE_OK) {
+        log_warning("Couldn't bind device id :%llu path: %s error: %s", (unsigned long long)device_id, db_path, sqlite3_errmsg(db));
         ret =-1;
         goto cleanup;
     }
@@ -644,8 +864,9 @@ get_update_id(void)
     sqlite3_stmt *stmt;
     int ret;
     guint64 update_id = 0;
+    gint64 locked_at;
 
-    pthread_mutex_lock(mtx);
+    locked_at = db_lock();
     log_info("+ lock [pid:%d]", getpid());
     ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL);
     if (ret != SQLITE_OK) {
@@ -680,57 +901,44 @@ get_update_id(void)
 end:
     sqlite3_close(db);
     log_info("- unlock [pid:%d] update id: %llu", getpid(), (unsigned long long)update_id);
-    pthread_mutex_unlock(mtx);
+    db_unlock(locked_at, "update id");
     return update_id;
 }
 
-static void
-do_delete_old(void)
+/*
+ * Pick up the update_id published by the last scan commit (see
+ * lms_update_id_publish()), the database is only read if the shared
+ * mirror is unavailable. Returns TRUE if scanner->update_id changed.
+ */
+static gboolean
+scanner_sync_update_id(scanner_t *scanner)
 {
-    const char sql[] = "DELETE FROM files WHERE dtime > 0 and dtime <= ?";
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-    gint64 dtime;
-    int ret;
-
-    ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
-    if (ret != SQLITE_OK) {
-        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
-        goto end;
-    }
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        log_warning("Couldn't prepare delete old from %s: %s",
-                  db_path, sqlite3_errmsg(db));
-        goto end;
-    }
+    unsigned int shared;
+    guint64 update_id = 0;
 
-    dtime = (gint64)time(NULL) - delete_older_than * (24 * 60 * 60);
-    if (sqlite3_bind_int64(stmt, 1, dtime) != SQLITE_OK) {
-        log_warning("Couldn't bind delete old dtime '%"G_GINT64_FORMAT
-                  "'from %s: %s", dtime, db_path, sqlite3_errmsg(db));
-        goto cleanup;
-    }
+    if (lms_update_id_get_shared(db_path, &shared) == 0)
+        update_id = shared;
+    else if (!check_write_locked(scanner))
+        update_id = get_update_id();
 
-    ret = sqlite3_step(stmt);
-    if (ret != SQLITE_DONE)
-        log_warning("Couldn't run SQL delete old dtime '%"G_GINT64_FORMAT
-                  "', ret=%d: %s", dtime, ret, sqlite3_errmsg(db));
+    if (update_id == 0 || update_id == scanner->update_id)
+        return FALSE;
 
-cleanup:
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    scanner->update_id = update_id;
+    return TRUE;
+}
 
-end:
-    sqlite3_close(db);
+static int
+delete_old_bind(sqlite3_stmt *stmt, void *data)
+{
+    return sqlite3_bind_int64(stmt, 1, *(gint64 *)data) == SQLITE_OK ? 0 : -1;
 }
 
 static void
-do_vacuum(void)
+do_delete_old(void)
 {
-    const char sql[] = "VACUUM";
     sqlite3 *db;
-    sqlite3_stmt *stmt;
+    gint64 dtime;
     int ret;
 
     ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
@@ -739,19 +947,11 @@ do_vacuum(void)
         goto end;
     }
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        log_warning("Couldn't vacuum from %s: %s",
-                  db_path, sqlite3_errmsg(db));
-        goto end;
-    }
-
-    ret = sqlite3_step(stmt);
-    if (ret != SQLITE_DONE)
-        log_warning("Couldn't run SQL VACUUM, ret=%d: %s",
-                  ret, sqlite3_errmsg(db));
-
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    dtime = (gint64)time(NULL) - delete_older_than * (24 * 60 * 60);
+    if (delete_files_chunked(db, "dtime > 0 AND dtime <= ?1", delete_old_bind,
+                             &dtime, "old files") < 0)
+        log_warning("Couldn't delete old dtime '%"G_GINT64_FORMAT"' from %s",
+                  dtime, db_path);
 
 end:
     sqlite3_close(db);
@@ -1000,35 +1200,11 @@ end:
 
 
 static int
-force_enable_recent_device_files(sqlite3 *db, char *device_path)
+force_enable_recent_device_files(sqlite3 *db, guint64 device_id)
 {
     sqlite3_stmt *stmt;
     int ret;
-    const char sql[] = "UPDATE files SET dtime = 0 WHERE path LIKE ?";
-    char path[PATH_MAX] = {'\0',};
-    size_t len = 0;
-
-    len = strlen(device_path);
-    if ((UINT_MAX - sizeof("/%")) < len) {
-        log_error("ERROR: len may wrap");
-        ret =-1;
-        goto end;
-    } else {
-        if ((len + sizeof("/%")) >= PATH_MAX) {
-            log_error("ERROR: path is too long: \"%s\" + /%%", device_path);
-            ret =-1;
-            goto end;
-        }
-    }
-
-    memcpy(path, device_path, len);
-    if (len > 0 && path[len - 1] != '/') {
-        path[len] = '/';
-        len++;
-    }
-    path[len] = '%';
-    len++;
-    path[len] = '\0';
+    const char sql[] = "UPDATE files SET dtime = 0 WHERE device_id = ? AND dtime <> 0";
 
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
         log_warning("Couldn't prepare select : %s", sqlite3_errmsg(db));
@@ -1036,8 +1212,8 @@ force_enable_recent_device_files(sqlite3 *db, char *device_path)
         goto end;
     }
 
-    if (sqlite3_bind_text(stmt, 1, path, len, SQLITE_STATIC) != SQLITE_OK) {
-        log_warning("Couldn't bind device path :%s path: %s error: %s", path, db_path, sqlite3_errmsg(db));
+    if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64)device_id) != SQLITE_OK) {
+        log_warning("Couldn't bind device id :%llu path: %s error: %s", (unsigned long long)device_id, db_path, sqlite3_errmsg(db));
         ret =-1;
         goto cleanup;
     }
@@ -1060,15 +1236,370 @@ force_enable_recent_device_files(sqlite3 *db, char *device_path)
     return ret;
 }
 
-
+/*
+ * Files under 'device_path' that were inserted before the device got
+ * its current row (it was forgotten by delete_old_device_path() or the
+ * database predates files.device_id) are moved to 'device_id'. Only
+ * rows that differ are written, so a regular reattach costs one index
+ * range read.
+ */
+static int
+assign_device_files(sqlite3 *db, guint64 device_id, const char *device_path)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+    const char sql[] = "UPDATE files SET device_id = ?1 WHERE path >= ?2 AND path < ?3 AND device_id IS NOT ?1";
+    char path[PATH_MAX] = {'\0',};
+    char upper[PATH_MAX] = {'\0',};
+    size_t len = 0;
+
+    len = strlen(device_path);
+    if ((len + sizeof("/")) >= PATH_MAX) {
+        log_error("ERROR: path is too long: \"%s\" + /", device_path);
+        return -1;
+    }
+
+    memcpy(path, device_path, len);
+    if (len > 0 && path[len - 1] != '/') {
+        path[len] = '/';
+        len++;
+    }
+    path[len] = '\0';
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare assign device files : %s", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64)device_id) != SQLITE_OK ||
+        bind_path_range(stmt, 2, path, len, upper) != 0) {
+        log_warning("Couldn't bind device path :%s path: %s error: %s", path, db_path, sqlite3_errmsg(db));
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = sqlite3_step(stmt);
+    if (ret != SQLITE_DONE)
+        log_warning("Couldn't run SQL to assign device files, ret=%d: %s",
+                 ret, sqlite3_errmsg(db));
+    else
+        log_debug("Assigned %d files to device %llu", sqlite3_changes(db),
+                  (unsigned long long)device_id);
+
+  cleanup:
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * Adds files.device_id, filled by a trigger from the longest devices.path
+ * prefix of each inserted file, and the (device_id, dtime) index used by
+ * the per device cleanups. Existing rows are backfilled once when the
+ * column is added. Returns 0 when the column is usable.
+ */
+static int
+files_device_upgrade(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    gboolean found = FALSE;
+    char *errmsg = NULL;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA table_info(files)", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        log_warning("Couldn't get files table info: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *col = (const char *)sqlite3_column_text(stmt, 1);
+        found = col && strcmp(col, "device_id") == 0;
+    }
+    sqlite3_finalize(stmt);
+
+    if (!found) {
+        if (sqlite3_exec(db, "ALTER TABLE files ADD COLUMN device_id INTEGER",
+                         NULL, NULL, &errmsg) != SQLITE_OK) {
+            log_warning("Couldn't add files.device_id: %s", errmsg);
+            sqlite3_free(errmsg);
+            return -1;
+        }
+
+        /* same '/' boundary as assign_device_files(): "/media/usb/sda1"
+         * must not own the files of "/media/usb/sda10" */
+        db_execute_stmt(db,
+            "UPDATE files SET device_id = (SELECT devices.id FROM devices "
+            "WHERE substr(CAST(files.path AS TEXT), 1, "
+            "length(rtrim(devices.path, '/')) + 1) "
+            "= rtrim(devices.path, '/') || '/' "
+            "ORDER BY length(devices.path) DESC LIMIT 1)");
+        log_info("files table upgraded with column 'device_id'");
+    }
+
+    db_execute_stmt(db, "CREATE INDEX IF NOT EXISTS files_device_dtime_idx "
+                    "ON files (device_id, dtime)");
+    db_execute_stmt(db,
+        "CREATE TRIGGER IF NOT EXISTS files_device_dir_on_insert "
+        "AFTER INSERT ON files WHEN NEW.device_id IS NULL BEGIN "
+        "UPDATE files SET device_id = (SELECT devices.id FROM devices "
+        "WHERE substr(CAST(NEW.path AS TEXT), 1, "
+        "length(rtrim(devices.path, '/')) + 1) "
+        "= rtrim(devices.path, '/') || '/' "
+        "ORDER BY length(devices.path) DESC LIMIT 1) "
+        "WHERE id = NEW.id; "
+        "END");
+
+    return 0;
+}
+
+/*
+ * Bring the daemon's own schema additions up to date, once at startup
+ * with the database lock held, so device attach and refresh don't check
+ * them on every call.
+ */
+static void
+database_upgrade(void)
+{
+    sqlite3 *db;
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+
+    db_execute_stmt(db, "BEGIN TRANSACTION");
+    files_device_upgrade(db);
+    db_execute_stmt(db, "COMMIT");
+
+    sqlite3_close(db);
+}
+
+
+/*
+ * Filesystem UUID of the volume holding 'mount_st', found by matching
+ * its st_dev against the block devices under /dev/disk/by-uuid.
+ * Returns NULL for volumes without one (MTP, network, tmpfs...).
+ */
+static char *
+device_fs_uuid(const struct stat *mount_st)
+{
+    const char by_uuid[] = "/dev/disk/by-uuid";
+    const char *name;
+    char *uuid = NULL;
+    GDir *dir;
+
+    dir = g_dir_open(by_uuid, 0, NULL);
+    if (!dir)
+        return NULL;
+
+    while (!uuid && (name = g_dir_read_name(dir))) {
+        char *dev = g_build_filename(by_uuid, name, NULL);
+        struct stat st;
+
+        if (stat(dev, &st) == 0 && S_ISBLK(st.st_mode) &&
+            st.st_rdev == mount_st->st_dev)
+            uuid = g_strdup(name);
+        g_free(dev);
+    }
+
+    g_dir_close(dir);
+    return uuid;
+}
+
+/*
+ * Fingerprint of the volume mounted at 'device_path': its filesystem
+ * UUID plus a hash of the root listing (name, mtime and size of every
+ * entry) and the free block/inode counts. Any write to the volume moves
+ * the free counts, so an equal fingerprint means the device comes back
+ * as it was left.
+ *
+ * @param device_path mount point of the device.
+ * @return newly allocated "uuid:hash" string or NULL if the volume can't
+ *         be identified.
+ */
+static char *
+device_fingerprint(const char *device_path)
+{
+    struct dirent **entries = NULL;
+    struct statvfs vfs;
+    struct stat st;
+    GChecksum *sum;
+    char *uuid, *fingerprint = NULL;
+    int i, n;
+
+    if (stat(device_path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    uuid = device_fs_uuid(&st);
+    if (!uuid)
+        return NULL;
+
+    if (statvfs(device_path, &vfs) != 0)
+        goto end;
+
+    n = scandir(device_path, &entries, NULL, alphasort);
+    if (n < 0)
+        goto end;
+
+    sum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(sum, (const guchar *)&vfs.f_bfree, sizeof(vfs.f_bfree));
+    g_checksum_update(sum, (const guchar *)&vfs.f_ffree, sizeof(vfs.f_ffree));
+
+    for (i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        char *child;
+
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            g_checksum_update(sum, (const guchar *)name, strlen(name) + 1);
+
+            child = g_build_filename(device_path, name, NULL);
+            if (lstat(child, &st) == 0) {
+                gint64 mtime = st.st_mtime, size = st.st_size;
+
+                g_checksum_update(sum, (const guchar *)&mtime, sizeof(mtime));
+                g_checksum_update(sum, (const guchar *)&size, sizeof(size));
+            }
+            g_free(child);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    fingerprint = g_strdup_printf("%s:%s", uuid, g_checksum_get_string(sum));
+    g_checksum_free(sum);
+
+end:
+    g_free(uuid);
+    return fingerprint;
+}
+
+static void
+devices_table_upgrade(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    gboolean found = FALSE;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA table_info(devices)", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        log_warning("Couldn't get devices table info: %s", sqlite3_errmsg(db));
+        return;
+    }
+
+    while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *col = (const char *)sqlite3_column_text(stmt, 1);
+        found = col && strcmp(col, "fingerprint") == 0;
+    }
+    sqlite3_finalize(stmt);
+
+    if (!found)
+        db_execute_stmt(db, "ALTER TABLE devices ADD COLUMN fingerprint TEXT");
+}
+
+static char *
+get_device_fingerprint(sqlite3 *db, guint64 device_id)
+{
+    const char sql[] = "SELECT fingerprint FROM devices WHERE id = ?";
+    sqlite3_stmt *stmt;
+    char *fingerprint = NULL;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare device fingerprint from %s: %s",
+                  db_path, sqlite3_errmsg(db));
+        return NULL;
+    }
+
+    if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64)device_id) != SQLITE_OK) {
+        log_warning("Couldn't bind device id :%llu path: %s error: %s",
+                    (unsigned long long)device_id, db_path, sqlite3_errmsg(db));
+        goto cleanup;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *col = (const char *)sqlite3_column_text(stmt, 0);
+        fingerprint = g_strdup(col);
+    }
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return fingerprint;
+}
+
+/*
+ * @param fingerprint value to store, NULL forgets the stored one so the
+ *        next attach scans the device again.
+ */
+static int
+set_device_fingerprint(sqlite3 *db, const char *device_path,
+                       const char *fingerprint)
+{
+    const char sql[] = "UPDATE devices SET fingerprint = ? WHERE path = ?";
+    sqlite3_stmt *stmt;
+    char path[PATH_MAX];
+    size_t len;
+    int ret;
+
+    len = strlen(device_path);
+    if (len + 2 > PATH_MAX) {
+        log_error("ERROR: path is too long: \"%s\" ", device_path);
+        return -1;
+    }
+
+    memcpy(path, device_path, len);
+    if (len > 0 && path[len - 1] != '/')
+        path[len++] = '/';
+    path[len] = '\0';
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare device fingerprint update %s: %s",
+                  db_path, sqlite3_errmsg(db));
+        return -1;
+    }
+
+    if (fingerprint)
+        ret = sqlite3_bind_text(stmt, 1, fingerprint, -1, SQLITE_STATIC);
+    else
+        ret = sqlite3_bind_null(stmt, 1);
+    if (ret != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 2, path, len, SQLITE_STATIC) != SQLITE_OK) {
+        log_warning("Couldn't bind device fingerprint path: %s error: %s",
+                    path, sqlite3_errmsg(db));
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = sqlite3_step(stmt);
+    if (ret != SQLITE_DONE)
+        log_warning("Couldn't run SQL to set device fingerprint, ret=%d: %s",
+                  ret, sqlite3_errmsg(db));
+
+cleanup:
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * Filled by set_device_path() when fast reattach is enabled: devices
+ * whose fingerprint matches the stored one were restored as they are and
+ * need no scan in any category, the others get their new fingerprint
+ * stored once every category covering them scanned them without being
+ * stopped.
+ */
+typedef struct device_reattach {
+    GHashTable *unchanged; /* device path (with trailing '/') set */
+    GHashTable *fingerprints; /* device path -> fingerprint to store */
+} device_reattach_t;
+
 static int
 set_device_path(gpointer data, gpointer user_data)
 {
     char* device_path = (char*)data;
+    device_reattach_t *reattach = user_data;
     sqlite3 *db;
     int ret = SQLITE_OK;
     guint64 device_id = 0;
     time_t mtime;
+    char *fingerprint = NULL;
+    gint64 locked_at;
 
     log_info("set_device_path in");
 
@@ -1081,7 +1612,11 @@ set_device_path(gpointer data, gpointer user_data)
     if (mtime == (time_t)-1)
       log_error("ERROR: mtime is failed ");
 
-    pthread_mutex_lock(mtx);
+    /* reads the device root, do it before taking the database lock */
+    if (reattach)
+        fingerprint = device_fingerprint(device_path);
+
+    locked_at = db_lock();
     log_info("+ lock [ pid:%d ] , bus_name = %s", getpid() , bus_name);
 
     ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
@@ -1092,14 +1627,42 @@ set_device_path(gpointer data, gpointer user_data)
 
     db_execute_stmt(db, "BEGIN TRANSACTION");
 
+    if (reattach)
+        devices_table_upgrade(db);
+
     device_id = get_device_path_id(db, device_path);
     if (device_id > 0) {
         ret = update_device_path(db, device_id, mtime);
         if (ret == SQLITE_DONE)
-            ret = force_enable_recent_device_files(db, device_path);
+            ret = assign_device_files(db, device_id, device_path);
+        if (ret == SQLITE_DONE)
+            ret = force_enable_recent_device_files(db, device_id);
+
+        if (ret == SQLITE_DONE && fingerprint) {
+            char *stored = get_device_fingerprint(db, device_id);
+
+            if (stored && strcmp(stored, fingerprint) == 0) {
+                log_info("device %s unchanged since last scan, skip it",
+                         device_path);
+                g_hash_table_add(reattach->unchanged,
+                                 g_str_has_suffix(device_path, "/") ?
+                                 g_strdup(device_path) :
+                                 g_strconcat(device_path, "/", NULL));
+                g_free(fingerprint);
+                fingerprint = NULL;
+            }
+            else if (stored) {
+                /* only valid again after a complete scan */
+                set_device_fingerprint(db, device_path, NULL);
+            }
+            g_free(stored);
+        }
     }
     else {
         ret = insert_device_path(db, device_path, mtime);
+        if (ret == SQLITE_DONE)
+            ret = assign_device_files(db, sqlite3_last_insert_rowid(db),
+                                      device_path);
     }
     delete_old_device_path(db);
 
@@ -1108,18 +1671,148 @@ set_device_path(gpointer data, gpointer user_data)
 end:
     sqlite3_close(db);
     log_info("- unlock [ pid:%d ] , bus_name = %s", getpid() , bus_name);
-    pthread_mutex_unlock(mtx);
+    db_unlock(locked_at, "device path");
+
+    if (fingerprint)
+        g_hash_table_insert(reattach->fingerprints,
+                            g_strdup(device_path), fingerprint);
     return ret;
 }
 
+static gboolean scanner_category_allows_path(const GArray *restrictions, const char *path);
+
+static gboolean
+device_reattach_is_unchanged(const device_reattach_t *reattach,
+                             const char *path)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    if (!reattach)
+        return FALSE;
+
+    g_hash_table_iter_init(&iter, reattach->unchanged);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const char *device = key;
+        size_t len = strlen(device);
+
+        /* the device itself, with or without trailing '/', or below it */
+        if (strncmp(path, device, len - 1) == 0 &&
+            (path[len - 1] == '\0' || path[len - 1] == '/'))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Called after 'path' was fully checked and processed for 'category':
+ * devices at or below it are up to date in that category, which is
+ * added to their set in 'scanned' (device path -> category set).
+ */
+static void
+device_reattach_scanned(device_reattach_t *reattach, GHashTable *scanned,
+                        const char *category, const char *path)
+{
+    GHashTableIter iter;
+    gpointer key;
+    size_t len;
+
+    if (!reattach)
+        return;
+
+    len = strlen(path);
+    if (len > 0 && path[len - 1] == '/')
+        len--;
+
+    g_hash_table_iter_init(&iter, reattach->fingerprints);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const char *device = key;
+        GHashTable *done;
+
+        if (strncmp(device, path, len) != 0 ||
+            (device[len] != '\0' && device[len] != '/'))
+            continue;
+
+        done = g_hash_table_lookup(scanned, device);
+        if (!done) {
+            done = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+            g_hash_table_insert(scanned, g_strdup(device), done);
+        }
+        g_hash_table_add(done, g_strdup(category));
+    }
+}
+
+/*
+ * The fingerprint lets the next attach skip the device in every
+ * category, so it is only valid if all the categories covering the
+ * device scanned it.
+ */
+static gboolean
+device_scanned_by_all_categories(const char *device, GHashTable *done)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, categories);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        const scanner_category_t *sc = value;
+
+        if (scanner_category_allows_path(sc->dirs, device) &&
+            !g_hash_table_contains(done, sc->category))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+store_device_fingerprints(const device_reattach_t *reattach, GHashTable *scanned)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    sqlite3 *db;
+    gint64 locked_at;
+
+    g_hash_table_iter_init(&iter, scanned);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!device_scanned_by_all_categories(key, value)) {
+            log_info("device %s not scanned in every category, keep it "
+                     "unfingerprinted", (const char *)key);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    if (g_hash_table_size(scanned) == 0)
+        return;
+
+    locked_at = db_lock();
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
+        goto end;
+    }
+
+    db_execute_stmt(db, "BEGIN TRANSACTION");
+    g_hash_table_iter_init(&iter, scanned);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        set_device_fingerprint(db, key,
+                               g_hash_table_lookup(reattach->fingerprints, key));
+    db_execute_stmt(db, "COMMIT");
+
+end:
+    sqlite3_close(db);
+    db_unlock(locked_at, "device fingerprints");
+}
+
 static void
 do_update_recent_device_files(void)
 {
-    const char sql[] = "SELECT path FROM devices WHERE mtime IN (SELECT mtime FROM devices ORDER BY mtime DESC LIMIT ?)";
+    const char sql[] = "SELECT id FROM devices WHERE mtime IN (SELECT mtime FROM devices ORDER BY mtime DESC LIMIT ?)";
     sqlite3 *db;
     sqlite3_stmt *stmt;
     int ret;
-    const char *path = NULL;
+    guint64 device_id;
 
     ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
     if (ret != SQLITE_OK) {
@@ -1140,14 +1833,9 @@ do_update_recent_device_files(void)
     }
 
     while( sqlite3_step(stmt) == SQLITE_ROW ) {
-        path = (const char *)sqlite3_column_text(stmt, 0);
-        if (!path) {
-            log_error("ERROR: path is null");
-            goto cleanup;
-        } else {
-            log_debug("run SQL to update recent devices, path=%s", path);
-            update_recent_device_files(db, path);
-        }
+        device_id = (guint64)sqlite3_column_int64(stmt, 0);
+        log_debug("run SQL to update recent devices, id=%llu", (unsigned long long)device_id);
+        update_recent_device_files(db, device_id);
     }
 
 cleanup:
@@ -1162,11 +1850,12 @@ end:
 static void
 do_delete_deleted_files(void)
 {
-    const char sql[] = "SELECT path FROM devices";
+    const char sql[] = "SELECT id FROM devices";
     sqlite3 *db;
     sqlite3_stmt *stmt;
     int ret = 0;
-    const unsigned char *device_path = NULL;
+    guint64 device_id;
+    gint64 locked_at;
 
     // delete not exists albums & album cover art images
     ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
@@ -1175,25 +1864,27 @@ do_delete_deleted_files(void)
         goto end;
     }
 
+    locked_at = db_lock();
+
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
         log_warning("Couldn't prepare delete files from %s: %s",
                   db_path, sqlite3_errmsg(db));
+        db_unlock(locked_at, "deleted files");
         goto end;
     }
 
     while( sqlite3_step(stmt) == SQLITE_ROW ) {
-        device_path = sqlite3_column_text(stmt, 0);
-        if (device_path == NULL) {
-            log_error("ERROR: device_path is null");
-            goto end;
-        } else {
-            log_debug("run SQL to delete files, id=%s",device_path);
-            if(device_path == NULL)
-                log_error("device path is null");
-            else
-                delete_deleted_files(db, (const char*)device_path);
-        }
+        device_id = (guint64)sqlite3_column_int64(stmt, 0);
+        log_debug("run SQL to delete files, id=%llu", (unsigned long long)device_id);
+        delete_deleted_files(db, device_id);
     }
+
+    sqlite3_reset(stmt);
+    sqlite3_finalize(stmt);
+
+    db_unlock(locked_at, "deleted files");
+
+    /* takes the lock per chunk */
     #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
     if (lmsTarget == LMS_TARGET_REAR)
         delete_over_scanned_files(db, "rear", maxFileScanCount);
@@ -1201,29 +1892,102 @@ do_delete_deleted_files(void)
         delete_over_scanned_files(db, "front", maxFileScanCount);
     #endif
 
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
-
 end:
     sqlite3_close(db);
 }
 
 
+/*
+ * Ids of albums, artists and genres that lost an audios row since the
+ * last cleanup. Filled by triggers on audios, so orphan removal only
+ * looks at those instead of sweeping the whole tables.
+ *
+ * kind is 0 for audio_albums, 1 for audio_artists, 2 for audio_genres.
+ */
+static gboolean
+audio_orphans_installed(sqlite3 *db)
+{
+    const char sql[] = "SELECT 1 FROM sqlite_master "
+        "WHERE type = 'trigger' AND name = 'audio_orphans_on_replace'";
+    sqlite3_stmt *stmt;
+    gboolean found;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare orphans lookup: %s", sqlite3_errmsg(db));
+        return FALSE;
+    }
+
+    found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return found;
+}
+
 static void
-do_delete_not_exists_indexes(void)
+audio_orphans_install(sqlite3 *db)
+{
+    db_execute_stmt(db,
+        "CREATE TABLE IF NOT EXISTS audio_orphans ("
+        "kind INTEGER NOT NULL, "
+        "id INTEGER NOT NULL, "
+        "PRIMARY KEY (kind, id)) WITHOUT ROWID");
+
+    /* the per-id NOT EXISTS checks below need these */
+    db_execute_stmt(db, "CREATE INDEX IF NOT EXISTS audios_album_idx "
+                    "ON audios (album_id)");
+    db_execute_stmt(db, "CREATE INDEX IF NOT EXISTS audios_artist_idx "
+                    "ON audios (artist_id)");
+    db_execute_stmt(db, "CREATE INDEX IF NOT EXISTS audios_genre_idx "
+                    "ON audios (genre_id)");
+
+    db_execute_stmt(db,
+        "CREATE TRIGGER IF NOT EXISTS audio_orphans_on_delete "
+        "AFTER DELETE ON audios BEGIN "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 0, OLD.album_id WHERE OLD.album_id IS NOT NULL; "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 1, OLD.artist_id WHERE OLD.artist_id IS NOT NULL; "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 2, OLD.genre_id WHERE OLD.genre_id IS NOT NULL; "
+        "END");
+
+    db_execute_stmt(db,
+        "CREATE TRIGGER IF NOT EXISTS audio_orphans_on_update "
+        "AFTER UPDATE OF album_id, artist_id, genre_id ON audios BEGIN "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 0, OLD.album_id WHERE OLD.album_id IS NOT NULL; "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 1, OLD.artist_id WHERE OLD.artist_id IS NOT NULL; "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 2, OLD.genre_id WHERE OLD.genre_id IS NOT NULL; "
+        "END");
+
+    /* INSERT OR REPLACE on reparse does not fire the delete trigger */
+    db_execute_stmt(db,
+        "CREATE TRIGGER IF NOT EXISTS audio_orphans_on_replace "
+        "BEFORE INSERT ON audios BEGIN "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 0, album_id FROM audios "
+        "WHERE id = NEW.id AND album_id IS NOT NULL; "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 1, artist_id FROM audios "
+        "WHERE id = NEW.id AND artist_id IS NOT NULL; "
+        "INSERT OR IGNORE INTO audio_orphans (kind, id) "
+        "SELECT 2, genre_id FROM audios "
+        "WHERE id = NEW.id AND genre_id IS NOT NULL; "
+        "END");
+}
+
+/*
+ * Full sweep, used once on databases created before audio_orphans
+ * existed; afterwards the triggers keep track of candidates.
+ */
+static void
+delete_not_exists_indexes_sweep(sqlite3 *db)
 {
     const char sql[] = "SELECT id FROM audio_albums WHERE NOT EXISTS ( SELECT album_id FROM audios WHERE audio_albums.id=audios.album_id)";
-    sqlite3 *db;
     sqlite3_stmt *stmt;
-    int ret;
     int album_id = 0;
 
-    ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
-    if (ret != SQLITE_OK) {
-        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
-        goto end;
-    }
-
     // delete not exists genres & artists
     db_execute_stmt(db, "DELETE FROM audio_genres WHERE NOT EXISTS ( SELECT genre_id  FROM audios WHERE audio_genres.id=audios.genre_id)");
     db_execute_stmt(db, "DELETE FROM audio_artists WHERE NOT EXISTS ( SELECT artist_id  FROM audios WHERE audio_artists.id=audios.artist_id)");
@@ -1232,7 +1996,7 @@ do_delete_not_exists_indexes(void)
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
         log_warning("Couldn't prepare delete kinds from %s: %s",
                   db_path, sqlite3_errmsg(db));
-        goto end;
+        return;
     }
 
     while( sqlite3_step(stmt) == SQLITE_ROW ) {
@@ -1243,46 +2007,394 @@ do_delete_not_exists_indexes(void)
 
     sqlite3_reset(stmt);
     sqlite3_finalize(stmt);
+}
+
+static void
+delete_not_exists_indexes_orphans(sqlite3 *db)
+{
+    const char sql[] = "SELECT o.id FROM audio_orphans o "
+        "JOIN audio_albums ON audio_albums.id = o.id "
+        "WHERE o.kind = 0 AND NOT EXISTS "
+        "(SELECT 1 FROM audios WHERE audios.album_id = o.id)";
+    GArray *albums;
+    sqlite3_stmt *stmt;
+    guint i;
+
+    db_execute_stmt(db, "DELETE FROM audio_genres WHERE id IN "
+                    "(SELECT id FROM audio_orphans WHERE kind = 2) "
+                    "AND NOT EXISTS (SELECT 1 FROM audios "
+                    "WHERE audios.genre_id = audio_genres.id)");
+    db_execute_stmt(db, "DELETE FROM audio_artists WHERE id IN "
+                    "(SELECT id FROM audio_orphans WHERE kind = 1) "
+                    "AND NOT EXISTS (SELECT 1 FROM audios "
+                    "WHERE audios.artist_id = audio_artists.id)");
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare orphan albums from %s: %s",
+                  db_path, sqlite3_errmsg(db));
+        return;
+    }
+
+    /* collect first, delete_audio_album() writes to audio_albums */
+    albums = g_array_new(FALSE, FALSE, sizeof(gint64));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        gint64 album_id = sqlite3_column_int64(stmt, 0);
+        g_array_append_val(albums, album_id);
+    }
+    sqlite3_finalize(stmt);
+
+    for (i = 0; i < albums->len; i++) {
+        gint64 album_id = g_array_index(albums, gint64, i);
+        log_debug("run SQL to delete kinds, id=%lld", (long long)album_id);
+        delete_audio_album(db, album_id);
+    }
+    g_array_free(albums, TRUE);
+
+    db_execute_stmt(db, "DELETE FROM audio_orphans");
+}
+
+static void
+do_delete_not_exists_indexes(void)
+{
+    sqlite3 *db;
+    int ret;
+
+    ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
+    if (ret != SQLITE_OK) {
+        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
+        goto end;
+    }
+
+    db_execute_stmt(db, "BEGIN TRANSACTION");
+    if (audio_orphans_installed(db))
+        delete_not_exists_indexes_orphans(db);
+    else {
+        delete_not_exists_indexes_sweep(db);
+        audio_orphans_install(db);
+    }
+    db_execute_stmt(db, "COMMIT");
 
 end:
     sqlite3_close(db);
 }
 
 static void refresh_database(void) {
-
-    pthread_mutex_lock(mtx);
-
-    log_info("+ lock [ pid : %d ] , bus_name = %s", getpid() , bus_name);
+    gint64 locked_at;
 
     if (delete_older_than >= 0) {
+        locked_at = db_lock();
+        log_info("+ lock [ pid : %d ] , bus_name = %s", getpid() , bus_name);
         log_debug("Update dtime from DB files to keep recent %d devices.",
                 keep_recent_device);
         do_update_recent_device_files();
+        log_info("- unlock [pid:%d]", getpid());
+        db_unlock(locked_at, "recent devices");
+
+        /* the deletes below take the lock per chunk */
         log_debug("Delete from DB files with dtime older than %d days.",
                 delete_older_than);
         do_delete_old();
     }
 
     do_delete_deleted_files();
+
+    locked_at = db_lock();
+    log_info("+ lock [ pid : %d ] , bus_name = %s", getpid() , bus_name);
+
+    /* free pages are reclaimed later, see scanner_idle_vacuum() */
     do_delete_not_exists_indexes();
 
-    if (vacuum) {
+    log_info("- unlock [pid:%d]", getpid());
+    db_unlock(locked_at, "orphans");
+
+    log_info("longest database lock hold: %d us",
+             g_atomic_int_get(&lock_hold_max_us));
+}
+
+/*
+ * With --vacuum, free pages are given back while nobody uses the
+ * database instead of running a full VACUUM after every scan. The
+ * database is switched to auto_vacuum=INCREMENTAL once (this needs one
+ * full VACUUM), then slices of VACUUM_SLICE_PAGES pages are released
+ * while the free list is above VACUUM_START_PERCENT of the file, until
+ * it drops under VACUUM_STOP_PERCENT.
+ */
+#define VACUUM_CHECK_INTERVAL 5 /* in seconds */
+#define VACUUM_IDLE_TIMEOUT 60 /* in seconds without scans nor lock waits */
+#define VACUUM_SLICE_PAGES 256
+#define VACUUM_START_PERCENT 10
+#define VACUUM_STOP_PERCENT 2
+
+static gint64
+db_pragma_int(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    gint64 value = -1;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare \"%s\": %s", sql, sqlite3_errmsg(db));
+        return -1;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    return value;
+}
+
+static void
+idle_vacuum_slice(scanner_t *scanner, sqlite3 *db)
+{
+    gint64 free_pages, pages, percent;
+    char *errmsg = NULL;
+    char *sql;
+
+    if (db_pragma_int(db, "PRAGMA auto_vacuum") != 2) {
         GTimer *timer = g_timer_new();
 
-        log_debug("Starting SQL VACUUM...");
-        g_timer_start(timer);
-        do_vacuum();
-        g_timer_stop(timer);
+        log_info("Converting %s to incremental auto vacuum", db_path);
+        if (sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM",
+                         NULL, NULL, &errmsg) != SQLITE_OK) {
+            log_warning("Couldn't enable incremental vacuum: %s", errmsg);
+            sqlite3_free(errmsg);
+        }
         log_debug("Finished VACUUM in %0.3f seconds.",
-                g_timer_elapsed(timer, NULL));
+                  g_timer_elapsed(timer, NULL));
         g_timer_destroy(timer);
+        return;
     }
 
-    log_info("- unlock [pid:%d]", getpid());
-    pthread_mutex_unlock(mtx);
+    free_pages = db_pragma_int(db, "PRAGMA freelist_count");
+    pages = db_pragma_int(db, "PRAGMA page_count");
+    if (free_pages < 0 || pages <= 0)
+        return;
+
+    percent = free_pages * 100 / pages;
+    if (!scanner->vacuum.running && percent >= VACUUM_START_PERCENT) {
+        log_debug("%" G_GINT64_FORMAT " of %" G_GINT64_FORMAT
+                  " pages free, start incremental vacuum", free_pages, pages);
+        scanner->vacuum.running = TRUE;
+    }
+    else if (scanner->vacuum.running && percent < VACUUM_STOP_PERCENT) {
+        log_debug("%" G_GINT64_FORMAT " of %" G_GINT64_FORMAT
+                  " pages free, stop incremental vacuum", free_pages, pages);
+        scanner->vacuum.running = FALSE;
+    }
+
+    if (!scanner->vacuum.running)
+        return;
+
+    sql = g_strdup_printf("PRAGMA incremental_vacuum(%d)", VACUUM_SLICE_PAGES);
+    if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        log_warning("Couldn't run incremental vacuum: %s", errmsg);
+        sqlite3_free(errmsg);
+        scanner->vacuum.running = FALSE;
+    }
+    g_free(sql);
+}
+
+static gboolean
+scanner_idle_vacuum(gpointer data)
+{
+    scanner_t *scanner = data;
+    gint64 now = g_get_monotonic_time();
+    gint64 locked_at;
+    sqlite3 *db;
+
+    if (check_write_locked(scanner)) {
+        scanner->vacuum.last_busy = now;
+        return TRUE;
+    }
+
+    if (now - scanner->vacuum.last_busy < VACUUM_IDLE_TIMEOUT * G_USEC_PER_SEC)
+        return TRUE;
+
+    /* never wait: a held lock means the browser is busy */
+    if (lms_mutex_trylock(mtx) != 0) {
+        scanner->vacuum.last_busy = now;
+        return TRUE;
+    }
+    locked_at = g_get_monotonic_time();
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
+    else
+        idle_vacuum_slice(scanner, db);
+    sqlite3_close(db);
+
+    db_unlock(locked_at, "incremental vacuum");
+    return TRUE;
 }
 #endif
 
+/*
+ * Writers only run an automatic checkpoint as a last resort (see
+ * lms_db_writer_setup()), WAL frames are copied back by this thread
+ * instead. It uses its own connection and no busy handler, so it never
+ * waits on the scan slave: while commits come in, a PASSIVE checkpoint
+ * runs when the WAL grew past CHECKPOINT_WAL_BYTES or CHECKPOINT_MAX_AGE
+ * passed since the last one. After a whole interval without commits it
+ * escalates to TRUNCATE, which also gives the WAL disk space back. That
+ * one locks writers out while it runs, so it is only tried when 'mtx'
+ * is free and skipped otherwise.
+ */
+#define CHECKPOINT_INTERVAL 2 /* in seconds */
+#define CHECKPOINT_MAX_AGE 30 /* in seconds */
+#define CHECKPOINT_WAL_BYTES (4 * 1024 * 1024)
+
+static struct {
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    gboolean stop;
+} checkpointer;
+
+static gint64
+checkpoint_wal_size(const char *wal_path)
+{
+    struct stat st;
+
+    if (stat(wal_path, &st) != 0)
+        return 0;
+    return (gint64)st.st_size;
+}
+
+/* changes whenever another connection committed */
+static gint64
+checkpoint_data_version(sqlite3_stmt *stmt)
+{
+    gint64 version = -1;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+    return version;
+}
+
+static int
+checkpoint_run(sqlite3 *db, int mode, const char *name)
+{
+    int wal_frames = 0, copied = 0;
+    int r;
+
+    r = sqlite3_wal_checkpoint_v2(db, NULL, mode, &wal_frames, &copied);
+    if (r == SQLITE_BUSY) {
+        log_debug("%s checkpoint busy, %d of %d frames copied",
+                  name, copied, wal_frames);
+        return 1;
+    }
+    if (r != SQLITE_OK) {
+        log_warning("Couldn't run %s checkpoint: %s", name, sqlite3_errmsg(db));
+        return -1;
+    }
+
+    log_debug("%s checkpoint copied %d of %d frames", name, copied, wal_frames);
+    return copied == wal_frames ? 0 : 1;
+}
+
+static gpointer
+checkpointer_work(gpointer data)
+{
+    char *wal_path = g_strdup_printf("%s-wal", db_path);
+    sqlite3 *db = NULL;
+    sqlite3_stmt *version_stmt = NULL;
+    gint64 last_checkpoint = g_get_monotonic_time();
+    gint64 last_version, version, now;
+    gboolean pending = TRUE, truncated = FALSE;
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &version_stmt,
+                           NULL) != SQLITE_OK) {
+        log_warning("Couldn't open '%s' for checkpoints: %s", db_path,
+                    sqlite3_errmsg(db));
+        goto end;
+    }
+    last_version = checkpoint_data_version(version_stmt);
+
+    g_mutex_lock(&checkpointer.lock);
+    while (!checkpointer.stop) {
+        g_cond_wait_until(&checkpointer.cond, &checkpointer.lock,
+                          g_get_monotonic_time() +
+                          CHECKPOINT_INTERVAL * G_TIME_SPAN_SECOND);
+        if (checkpointer.stop)
+            break;
+        g_mutex_unlock(&checkpointer.lock);
+
+        now = g_get_monotonic_time();
+        version = checkpoint_data_version(version_stmt);
+
+        if (version != last_version) {
+            pending = TRUE;
+            truncated = FALSE;
+            last_version = version;
+
+            if (checkpoint_wal_size(wal_path) >= CHECKPOINT_WAL_BYTES ||
+                now - last_checkpoint >= CHECKPOINT_MAX_AGE * G_TIME_SPAN_SECOND) {
+                if (checkpoint_run(db, SQLITE_CHECKPOINT_PASSIVE, "passive") == 0)
+                    pending = FALSE;
+                last_checkpoint = now;
+            }
+        }
+        else if (!truncated) {
+            int r = 1;
+
+            /* nothing committed for a whole interval, but a writer may be
+             * about to: TRUNCATE blocks them, so only under 'mtx' */
+            if (lms_mutex_trylock(mtx) == 0) {
+                gint64 locked_at = g_get_monotonic_time();
+
+                r = checkpoint_run(db, SQLITE_CHECKPOINT_TRUNCATE, "truncate");
+                db_unlock(locked_at, "truncate checkpoint");
+            }
+
+            if (r == 0) {
+                pending = FALSE;
+                truncated = TRUE;
+                last_checkpoint = now;
+            }
+            else if (pending &&
+                     checkpoint_run(db, SQLITE_CHECKPOINT_PASSIVE, "passive") == 0)
+                pending = FALSE;
+        }
+
+        g_mutex_lock(&checkpointer.lock);
+    }
+    g_mutex_unlock(&checkpointer.lock);
+
+end:
+    sqlite3_finalize(version_stmt);
+    sqlite3_close(db);
+    g_free(wal_path);
+    return NULL;
+}
+
+static void
+checkpointer_start(void)
+{
+    g_mutex_init(&checkpointer.lock);
+    g_cond_init(&checkpointer.cond);
+    checkpointer.stop = FALSE;
+    checkpointer.thread = g_thread_new("checkpointer", checkpointer_work, NULL);
+}
+
+static void
+checkpointer_stop(void)
+{
+    if (!checkpointer.thread)
+        return;
+
+    g_mutex_lock(&checkpointer.lock);
+    checkpointer.stop = TRUE;
+    g_cond_signal(&checkpointer.cond);
+    g_mutex_unlock(&checkpointer.lock);
+
+    g_thread_join(checkpointer.thread);
+    checkpointer.thread = NULL;
+    g_cond_clear(&checkpointer.cond);
+    g_mutex_clear(&checkpointer.lock);
+}
+
 static gboolean
 check_write_locked(const scanner_t *scanner)
 {
@@ -1391,14 +2503,9 @@ scanner_dbus_props_changed(gpointer data)
     GVariantBuilder *builder;
     GError *error = NULL;
     scanner_t *scanner = data;
-    guint64 update_id = 0;
 
-    if (!check_write_locked(scanner))
-        update_id = get_update_id();
-    if (update_id > 0 && update_id != scanner->update_id) {
+    if (scanner_sync_update_id(scanner))
         scanner->changed_props.update_id = TRUE;
-        scanner->update_id = update_id;
-    }
 
     builder = g_variant_builder_new(G_VARIANT_TYPE_ARRAY);
 
@@ -1423,6 +2530,11 @@ scanner_dbus_props_changed(gpointer data)
         g_variant_builder_add(builder, "{sv}", "Categories",
                               categories_get_variant());
     }
+    if (scanner->changed_props.throttle_state) {
+        scanner->changed_props.throttle_state = FALSE;
+        g_variant_builder_add(builder, "{sv}", "ThrottleState",
+                              g_variant_new_uint32(g_atomic_int_get(&scanner->throttle_state)));
+    }
 #ifdef PATCH_LGE
     if (scanner->changed_props.scanner_status) {
         scanner->changed_props.scanner_status = FALSE;
@@ -1750,44 +2862,79 @@ report_scan_device(gpointer data)
 
 #endif
 
+static void
+report_scan_progress(scan_progress_t *sp, const char *path)
+{
+    GError *error = NULL;
+    guint64 uptodate = __atomic_load_n(&sp->uptodate, __ATOMIC_RELAXED);
+    guint64 processed = __atomic_load_n(&sp->processed, __ATOMIC_RELAXED);
+    guint64 deleted = __atomic_load_n(&sp->deleted, __ATOMIC_RELAXED);
+    guint64 skipped = __atomic_load_n(&sp->skipped, __ATOMIC_RELAXED);
+    guint64 errors = __atomic_load_n(&sp->errors, __ATOMIC_RELAXED);
+    guint64 sum = uptodate + processed + deleted + skipped + errors;
+
+    if (sum == sp->reported)
+        return;
+    sp->reported = sum;
+
+    g_dbus_connection_emit_signal(sp->conn,
+                                  NULL,
+                                  object_path,
+                                  BUS_IFACE,
+                                  "ScanProgress",
+                                  g_variant_new("(ssttttt)",
+                                                sp->category,
+                                                path,
+                                                uptodate,
+                                                processed,
+                                                deleted,
+                                                skipped,
+                                                errors),
+                                  &error);
+    g_assert_no_error(error);
+}
+
+static gboolean
+report_scan_progress_tick(gpointer data)
+{
+    scanner_t *scanner = data;
+    GList *l;
+
+    /* records are only freed by scanner_thread_cleanup(), on this thread */
+    g_mutex_lock(&scanner->progress.lock);
+    for (l = scanner->progress.active; l != NULL; l = l->next) {
+        scan_progress_t *sp = l->data;
+        report_scan_progress(sp, sp->path);
+    }
+    g_mutex_unlock(&scanner->progress.lock);
+
+    return TRUE;
+}
+
+typedef struct scan_progress_flush {
+    scan_progress_t *sp;
+    gchar *path;
+} scan_progress_flush_t;
+
 static gboolean
-report_scan_progress(gpointer data)
+report_scan_progress_flush(gpointer data)
 {
-    scan_progress_t *sp = data;
-    GError *error = NULL;
+    scan_progress_flush_t *flush = data;
 
-    g_dbus_connection_emit_signal(sp->conn,
-                                  NULL,
-                                  object_path,
-                                  BUS_IFACE,
-                                  "ScanProgress",
-                                  g_variant_new("(ssttttt)",
-                                                sp->category,
-                                                sp->path,
-                                                sp->uptodate,
-                                                sp->processed,
-                                                sp->deleted,
-                                                sp->skipped,
-                                                sp->errors),
-                                  &error);
-    g_assert_no_error(error);
+    report_scan_progress(flush->sp, flush->path);
 
+    g_free(flush->path);
+    g_free(flush);
     return FALSE;
 }
 
-static gboolean
-report_scan_progress_and_free(gpointer data)
+static void
+scan_progress_free(scan_progress_t *sp)
 {
-    scan_progress_t *sp = data;
-
-    if (sp->updated)
-        report_scan_progress(sp);
-
     g_object_unref(sp->conn);
     g_free(sp->category);
     g_free(sp->path);
     g_free(sp);
-    return FALSE;
 }
 
 #ifdef PATCH_LGE
@@ -1807,8 +2954,10 @@ report_scan_device_and_free(gpointer data)
 static void
 scan_progress_cb(lms_t *lms, const char *path, int pathlen, lms_progress_status_t status, void *data)
 {
-    const scanner_t *scanner = data;
-    scan_progress_t *scan_progress = scanner->scan_progress;
+    scan_worker_t *worker = data;
+    const scanner_t *scanner = worker->scanner;
+    scan_progress_t *scan_progress = worker->scan_progress;
+    guint64 *counter;
 
     if (scanner->pending_stop)
         lms_stop_processing(lms);
@@ -1818,89 +2967,41 @@ scan_progress_cb(lms_t *lms, const char *path, int pathlen, lms_progress_status_
 
     switch (status) {
         case LMS_PROGRESS_STATUS_UP_TO_DATE:
-            if (ULONG_MAX - scan_progress->uptodate < 1) {
-                log_error("ERROR:unsigned integer opeartion");
-            }
-            else {
-                scan_progress->uptodate++;
-            }
+            counter = &scan_progress->uptodate;
             break;
         case LMS_PROGRESS_STATUS_PROCESSED:
-            if (ULONG_MAX - scan_progress->processed < 1) {
-                log_error("ERROR:unsigned integer opeartion may wrap");
-            }
-            else {
-                scan_progress->processed++;
-            }
+            counter = &scan_progress->processed;
             break;
         case LMS_PROGRESS_STATUS_DELETED:
-            if (ULONG_MAX - scan_progress->deleted < 1) {
-                log_error("ERROR:unsigned integer opeartion");
-            }
-            else {
-                scan_progress->deleted++;
-            }
+            counter = &scan_progress->deleted;
             break;
         case LMS_PROGRESS_STATUS_UNKNOWN:
         case LMS_PROGRESS_STATUS_KILLED:
         case LMS_PROGRESS_STATUS_ERROR_PARSE:
         case LMS_PROGRESS_STATUS_ERROR_COMM:
-            if (ULONG_MAX - scan_progress->errors < 1) {
-                log_error("ERROR:unsigned integer opeartion may wrap");
-            }
-            else {
-                scan_progress->errors++;
-            }
+            counter = &scan_progress->errors;
             break;
         case LMS_PROGRESS_STATUS_SKIPPED:
-            if (ULONG_MAX - scan_progress->skipped < 1) {
-                log_error("ERROR: unsigned integer operation may wrap");
-            }
-            else {
-                scan_progress->skipped++;
-            }
+            counter = &scan_progress->skipped;
             break;
         default :
             log_error("ERROR: invalid status");
+            return;
     }
 
-    if (scan_progress->updated < 0)
-    {
-      log_error("ERROR:scan_progress->updated may result in lost or misinterpreted data");
-    }
-    else {
-      if ((UINT_MAX - (unsigned int)scan_progress->updated) < 1)
-      {
-        log_error("ERROR:unsigned integer opeartion may wrap");
-      }
-      else
-      {
-        scan_progress->updated++;
-      }
-    }
-    if (scan_progress->updated > SCAN_PROGRESS_UPDATE_COUNT) {
-        time_t now = time(NULL);
-        time_t temp;
-        if (__builtin_saddl_overflow(scan_progress->last_report_time,SCAN_PROGRESS_UPDATE_TIMEOUT, &temp))
-        {
-           log_error("ERROR:signed integer operation may overflow");
-        }
-        else {
-            if (temp < now){
-              scan_progress->last_report_time = now;
-              scan_progress->updated = 0;
-              g_idle_add(report_scan_progress, scan_progress);
-            }
-        }
-    }
+    /* workers of the category add, the main loop reads in report_scan_progress() */
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
 }
 
 #ifdef PATCH_LGE
 static void
 scan_device_cb(lms_t *lms, const char *path, int pathlen, lms_progress_status_t status, void *data)
 {
-    const scanner_t *scanner = data;
-    scanDeviceType *sd = scanner->scan_device;
+    scan_worker_t *worker = data;
+    scanDeviceType *sd = worker->scan_device;
+
+    if (!sd)
+        return;
     sd->status = status;
 
     report_scan_device(sd);
@@ -1908,9 +3009,35 @@ scan_device_cb(lms_t *lms, const char *path, int pathlen, lms_progress_status_t
 }
 #endif
 
+static gboolean
+scanner_throttle_state_changed(gpointer data)
+{
+    scanner_t *scanner = data;
+
+    log_info("scanner_dbus_props_changed(...) Called.");
+
+    if (scanner->changed_props.idler == 0)
+        scanner->changed_props.idler = g_idle_add(scanner_dbus_props_changed,
+                                                  scanner);
+
+    scanner->changed_props.throttle_state = TRUE;
+
+    return FALSE;
+}
+
+static void
+scan_throttle_cb(lms_t *lms, lms_throttle_state_t state, void *data)
+{
+    scanner_t *scanner = data;
+
+    g_atomic_int_set(&scanner->throttle_state, state);
+    g_idle_add(scanner_throttle_state_changed, scanner);
+}
+
 static lms_t *
-setup_lms(const char *category, const scanner_t *scanner)
+setup_lms(const char *category, scan_worker_t *worker)
 {
+    const scanner_t *scanner = worker->scanner;
     scanner_category_t *sc;
     char **itr;
     lms_t *lms;
@@ -1952,6 +3079,15 @@ setup_lms(const char *category, const scanner_t *scanner)
     lms_set_chardet_level(lms, charset_detect_level);
     lms_set_lms_target(lms, lmsTarget);
 
+    if (storage_order) {
+        if (strcmp(storage_order, "inode") == 0)
+            lms_set_storage_order(lms, LMS_STORAGE_ORDER_INODE);
+        else if (strcmp(storage_order, "block") == 0)
+            lms_set_storage_order(lms, LMS_STORAGE_ORDER_BLOCK);
+        else if (strcmp(storage_order, "name") != 0)
+            log_warning("Unknown storage order '%s', using name order", storage_order);
+    }
+
     #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
         lms_set_maxFileScanCount(lms, maxFileScanCount);
         lms_set_currentFileScanCount(lms, currentFileCount);
@@ -1995,6 +3131,7 @@ setup_lms(const char *category, const scanner_t *scanner)
 
     lms_clear_device_scan_path(lms);
 
+    G_LOCK(pending_device);
     for (n = scanner->pending_device_scan; n != NULL; n = n->next) {
         pending = n->data;
         if (strcmp(pending->category, category) == 0){
@@ -2004,17 +3141,22 @@ setup_lms(const char *category, const scanner_t *scanner)
             }
         }
     }
+    G_UNLOCK(pending_device);
 
     lms_clear_completed_scan_path(lms);
     for(itr = (char**)sc->skip_dirs->data; *itr != NULL; itr++) {
         lms_set_completed_scan_path(lms, g_strdup(*itr));
     }
 
-    lms_set_progress_callback(lms, scan_progress_cb, scanner, NULL);
+    lms_set_progress_callback(lms, scan_progress_cb, worker, NULL);
 #ifdef PATCH_LGE
-    lms_set_progress_device_callback(lms, scan_device_cb, scanner, NULL);
+    lms_set_progress_device_callback(lms, scan_device_cb, worker, NULL);
 #endif
 
+    lms_set_pressure_thresholds(lms, pressure_slow_threshold,
+                                pressure_pause_threshold);
+    lms_set_throttle_callback(lms, scan_throttle_cb, (void *)scanner);
+
     return lms;
 }
 
@@ -2034,6 +3176,20 @@ scanner_thread_cleanup(gpointer data)
     scanner->thread = NULL;
     scanner->cleanup_thread_idler = 0;
 
+    /* final counters were flushed by idlers queued before this one */
+    if (scanner->progress.timer) {
+        g_source_remove(scanner->progress.timer);
+        scanner->progress.timer = 0;
+    }
+
+    g_mutex_lock(&scanner->progress.lock);
+    g_list_free_full(scanner->progress.active, (GDestroyNotify)scan_progress_free);
+    scanner->progress.active = NULL;
+    g_mutex_unlock(&scanner->progress.lock);
+#ifdef PATCH_LGE
+    scanner->vacuum.last_busy = g_get_monotonic_time();
+#endif
+
     if (scanner->pending_stop) {
         g_dbus_method_invocation_return_value(scanner->pending_stop, NULL);
         g_object_unref(scanner->pending_stop);
@@ -2044,6 +3200,12 @@ scanner_thread_cleanup(gpointer data)
                      (GDestroyNotify)scanner_pending_free);
     scanner->pending_scan = NULL;
 
+#ifdef PATCH_LGE
+    /* play state changes deferred while scanning */
+    if (!scanner->play_ng_timer)
+        flush_play_ng_files(scanner);
+#endif
+
     if (scanner->mounts.pending && !scanner->mounts.timer)
         scan_mountpoints(scanner);
     else {
@@ -2076,145 +3238,626 @@ scanner_thread_cleanup(gpointer data)
  * this is also done without a lock as there is no need for such thing
  * given above. The stop is also voluntary and it can happen on a
  * second iteration of work.
+ *
+ * The exceptions are 'scanner->current', which the main thread reads
+ * to cancel the running lms_check()/lms_process() from
+ * scanner_cancel_current(), so it's guarded by 'scanner->current.lock',
+ * and 'scanner->progress', guarded by 'scanner->progress.lock'. The
+ * worker thread may run several scan workers at once, see scan_job_run().
+ */
+static void
+scan_worker_init(scan_worker_t *worker, scanner_t *scanner)
+{
+    memset(worker, 0, sizeof(*worker));
+    worker->scanner = scanner;
+
+    g_mutex_lock(&scanner->current.lock);
+    scanner->current.workers = g_list_prepend(scanner->current.workers, worker);
+    g_mutex_unlock(&scanner->current.lock);
+}
+
+static void
+scan_worker_clear(scan_worker_t *worker)
+{
+    scanner_t *scanner = worker->scanner;
+
+    g_mutex_lock(&scanner->current.lock);
+    scanner->current.workers = g_list_remove(scanner->current.workers, worker);
+    g_mutex_unlock(&scanner->current.lock);
+}
+
+static void
+scan_worker_set_current(scan_worker_t *worker, lms_t *lms, const char *path)
+{
+    g_mutex_lock(&worker->scanner->current.lock);
+    worker->lms = lms;
+    worker->path = path;
+    g_mutex_unlock(&worker->scanner->current.lock);
+}
+
+/* the record of the category is created by its first path and kept
+ * until the scan ends, so its counters add up all of its paths */
+static void
+scan_worker_progress_begin(scan_worker_t *worker, const char *category, const char *path)
+{
+    scanner_t *scanner = worker->scanner;
+    scan_progress_t *sp = NULL;
+    GList *l;
+
+    g_mutex_lock(&scanner->progress.lock);
+    for (l = scanner->progress.active; l != NULL; l = l->next) {
+        scan_progress_t *itr = l->data;
+        if (strcmp(itr->category, category) == 0) {
+            sp = itr;
+            break;
+        }
+    }
+
+    if (!sp) {
+        sp = g_new0(scan_progress_t, 1);
+        sp->conn = g_object_ref(scanner->conn);
+        sp->category = g_strdup(category);
+        scanner->progress.active = g_list_append(scanner->progress.active, sp);
+    }
+
+    g_free(sp->path);
+    sp->path = g_strdup(path);
+    g_mutex_unlock(&scanner->progress.lock);
+
+    worker->scan_progress = sp;
+}
+
+/* has the main loop flush the counters of the category for this path */
+static void
+scan_worker_progress_end(scan_worker_t *worker, const char *path)
+{
+    scan_progress_flush_t *flush;
+
+    if (!worker->scan_progress)
+        return;
+
+    flush = g_new0(scan_progress_flush_t, 1);
+    flush->sp = worker->scan_progress;
+    flush->path = g_strdup(path);
+
+    worker->scan_progress = NULL;
+    g_idle_add(report_scan_progress_flush, flush);
+}
+
+/*
+ * With --max-concurrent-devices above 1, the pending paths are split
+ * into one job per device (paths on the same st_dev) and the jobs run
+ * on a pool of that many threads, each with its own lms_t, thus its own
+ * slave and connection. Writes still go through WAL and the shared
+ * mutex per commit, so jobs only overlap in parsing and file system
+ * access. Jobs are started internal storage first, then USB, then MTP,
+ * so a slow phone doesn't delay faster media.
+ */
+#define SCAN_PRIORITY_INTERNAL 0
+#define SCAN_PRIORITY_USB 1
+#define SCAN_PRIORITY_MTP 2
+
+typedef struct scan_job {
+    int priority;
+    GList *pending; /* of scanner_pending_t, in request order */
+} scan_job_t;
+
+typedef struct scan_ctx {
+    scanner_t *scanner;
+    device_reattach_t *reattach;
+    GHashTable *scanned; /* device -> scanned categories, guarded by 'lock' */
+    GMutex lock;
+} scan_ctx_t;
+
+static void
+scan_ctx_scanned(scan_ctx_t *ctx, const char *category, const char *path)
+{
+    g_mutex_lock(&ctx->lock);
+    device_reattach_scanned(ctx->reattach, ctx->scanned, category, path);
+    g_mutex_unlock(&ctx->lock);
+}
+
+static int
+scan_path_priority(const char *path)
+{
+    if (strstr(path, "/mtp/"))
+        return SCAN_PRIORITY_MTP;
+    if (strstr(path, "/usb/"))
+        return SCAN_PRIORITY_USB;
+    return SCAN_PRIORITY_INTERNAL;
+}
+
+static gint
+scan_job_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const scan_job_t *ja = a, *jb = b;
+
+    return ja->priority - jb->priority;
+}
+
+static void
+scan_job_add(scan_job_t *job, const char *category, char *path)
+{
+    scanner_pending_t *pending = NULL;
+    GList *last = g_list_last(job->pending);
+    int priority = scan_path_priority(path);
+
+    if (last)
+        pending = last->data;
+    if (!pending || strcmp(pending->category, category) != 0) {
+        pending = g_new0(scanner_pending_t, 1);
+        pending->category = g_strdup(category);
+        job->pending = g_list_append(job->pending, pending);
+    }
+    pending->paths = g_list_append(pending->paths, path);
+
+    /* a job is as urgent as its most urgent path */
+    if (priority < job->priority)
+        job->priority = priority;
+}
+
+/*
+ * Splits 'lst' (consumed) into jobs; with one job per device when
+ * 'per_device' is set, otherwise everything goes to a single job that
+ * runs as the serial scan always did.
  */
+static GList *
+scan_jobs_build(GList *lst, gboolean per_device)
+{
+    GHashTable *by_dev = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               g_free, NULL);
+    GList *jobs = NULL;
+
+    while (lst) {
+        scanner_pending_t *pending = lst->data;
+        lst = g_list_delete_link(lst, lst);
+
+        while (pending->paths) {
+            char *path = pending->paths->data;
+            struct stat st;
+            gint64 *key = g_new0(gint64, 1);
+            scan_job_t *job;
+
+            pending->paths = g_list_delete_link(pending->paths, pending->paths);
+
+            /* missing paths still need lms_check(), they share job 0 */
+            if (per_device && stat(path, &st) == 0)
+                *key = (gint64)st.st_dev;
+
+            job = g_hash_table_lookup(by_dev, key);
+            if (!job) {
+                job = g_new0(scan_job_t, 1);
+                job->priority = SCAN_PRIORITY_MTP;
+                g_hash_table_insert(by_dev, key, job);
+                jobs = g_list_append(jobs, job);
+            } else
+                g_free(key);
+
+            scan_job_add(job, pending->category, path);
+        }
+
+        scanner_pending_free(pending);
+    }
+
+    g_hash_table_destroy(by_dev);
+
+    return g_list_sort_with_data(jobs, scan_job_compare, NULL);
+}
+
+static void
+scan_job_run(gpointer data, gpointer user_data)
+{
+    scan_job_t *job = data;
+    scan_ctx_t *ctx = user_data;
+    scanner_t *scanner = ctx->scanner;
+    scanner_pending_t *device_pending;
+    GList *deep_paths = NULL;
+    scan_worker_t worker;
+
+    /* only this thread, the main loop keeps serving D-Bus with its normal
+     * priority */
+    lms_set_idle_io_priority();
+
+    scan_worker_init(&worker, scanner);
+
+    while (job->pending) {
+        scanner_pending_t *pending;
+        lms_t *lms = NULL;
+
+        if (scanner->pending_stop)
+            break;
+
+        pending = job->pending->data;
+        job->pending = g_list_delete_link(job->pending, job->pending);
+
+        log_info("scan category: %s , bus_name = %s", pending->category , bus_name);
+
+        lms = setup_lms(pending->category, &worker);
+
+        if (lms) {
+
+            lms_set_mutex(lms, mtx);
+
+            while (pending->paths) {
+
+                char *path;
+
+                if (scanner->pending_stop)
+                    break;
+
+                path = pending->paths->data;
+                pending->paths = g_list_delete_link(pending->paths,
+                                                    pending->paths);
+
+                g_info("scan category = %s , path = %s , bus_name = %s", pending->category, path , bus_name);
+
+                if(strcmp(path,"/media/")!=0 &&
+                   strcmp(path,"/media/usb/")!=0 &&
+                   strcmp(path,"/media/mtp/")!=0 ) {
+                    G_LOCK(pending_device);
+                    device_pending = scanner_pending_device_get_or_add(scanner, pending->category);
+                    scanner_pending_add(device_pending, NULL, path);
+                    G_UNLOCK(pending_device);
+                    lms_set_device_scan_path(lms, path);
+                    log_info("device scan path : %s, %s , bus_name = %s", pending->category, path , bus_name);
+                }
+
+                if (!omit_scan_progress) {
+                    scan_worker_progress_begin(&worker, pending->category, path);
+
+#ifdef PATCH_LGE
+                    worker.scan_device = g_new0(scanDeviceType, 1);
+                    worker.scan_device->conn = g_object_ref(scanner->conn);
+                    worker.scan_device->category = g_strdup(pending->category);
+                    worker.scan_device->path = g_strdup(path);
+#endif
+                }
+
+                scan_worker_set_current(&worker, lms, path);
+
+                /* a missing path still needs lms_check() to mark its
+                 * files as deleted */
+                if (device_reattach_is_unchanged(ctx->reattach, path)) {
+
+                    log_info("skip unchanged device path = %s , bus_name = %s", path , bus_name);
+                }
+                else if (single_pass_scan && !two_phase_scan &&
+                    g_file_test(path, G_FILE_TEST_IS_DIR)) {
+
+                    if (!scanner->pending_stop) {
+
+                        log_info("lms_sync [ pid : %d ] , path = %s , bus_name = %s", getpid() , path , bus_name);
+
+                        lms_sync(lms, path);
+                    }
+                }
+                else {
+
+                    if (!scanner->pending_stop) {
+
+                        log_info("lms_check [ pid : %d ] , bus_name = %s", getpid() , bus_name);
+
+                        lms_check(lms, path);
+                    }
+
+                    if (!scanner->pending_stop && g_file_test(path, G_FILE_TEST_EXISTS)) {
+
+                        if (two_phase_scan) {
+
+                            log_info("lms_process_presence [ pid : %d ] , path = %s , bus_name = %s", getpid() , path , bus_name);
+
+                            lms_process_presence(lms, path);
+                            deep_paths = g_list_append(deep_paths, g_strdup(path));
+                        }
+                        else {
+
+                            log_info("lms_process [ pid : %d ] , path = %s , bus_name = %s", getpid() , path , bus_name);
+
+                            lms_process(lms, path);
+                        }
+                    }
+                }
+
+                /* two-phase scans do it in their second phase */
+                if (reparse_outdated && !two_phase_scan &&
+                    !scanner->pending_stop && g_file_test(path, G_FILE_TEST_EXISTS)) {
+
+                    log_info("lms_check_outdated [ pid : %d ] , path = %s , bus_name = %s", getpid() , path , bus_name);
+
+                    lms_check_outdated(lms, path);
+                }
+
+                if (!scanner->pending_stop && !two_phase_scan)
+                    scan_ctx_scanned(ctx, pending->category, path);
+
+                scan_worker_progress_end(&worker, path);
+
+#ifdef PATCH_LGE
+                if (worker.scan_device) {
+                    g_idle_add(report_scan_device_and_free, worker.scan_device);
+                    worker.scan_device = NULL;
+                }
+#endif
+
+                scan_worker_set_current(&worker, NULL, NULL);
+                g_free(path);
+            }
+
+            /* Second phase: every path of this category is already
+             * browsable, now fill in tags, duration and artwork. */
+            while (deep_paths) {
+
+                char *path;
+
+                path = deep_paths->data;
+                deep_paths = g_list_delete_link(deep_paths, deep_paths);
+
+                if (!scanner->pending_stop) {
+
+                    if (!omit_scan_progress)
+                        scan_worker_progress_begin(&worker, pending->category, path);
+
+                    log_info("lms_check_unparsed [ pid : %d ] , path = %s , bus_name = %s", getpid() , path , bus_name);
+
+                    scan_worker_set_current(&worker, lms, path);
+                    if (reparse_outdated)
+                        lms_check_outdated(lms, path);
+                    else
+                        lms_check_unparsed(lms, path);
+                    scan_worker_set_current(&worker, NULL, NULL);
+
+                    if (!scanner->pending_stop)
+                        scan_ctx_scanned(ctx, pending->category, path);
+                }
+
+                scan_worker_progress_end(&worker, path);
+
+                g_free(path);
+            }
+
+            lms_free(lms);
+        }
+
+        scanner_pending_free(pending);
+    }
+
+    g_list_free_full(job->pending, (GDestroyNotify)scanner_pending_free);
+    g_free(job);
+
+    scan_worker_clear(&worker);
+}
+
 static gpointer
 scanner_thread_work(gpointer data)
 {
-    GList *lst;
+    GList *jobs;
     scanner_t *scanner = data;
-    scanner_pending_t *device_pending;
     GTimer *timer_scanner = NULL;
+    scan_ctx_t ctx = {0,};
 
     log_info("started scanner thread , [ pid : %d ] , bus_name = %s" , getpid() , bus_name);
 
     timer_scanner = g_timer_new();
 
-    g_list_foreach(scanner->mounts.paths, (GFunc)set_device_path, (gpointer)NULL);
+    ctx.scanner = scanner;
+    g_mutex_init(&ctx.lock);
+
+    if (fast_reattach) {
+        ctx.reattach = g_new0(device_reattach_t, 1);
+        ctx.reattach->unchanged = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                        g_free, NULL);
+        ctx.reattach->fingerprints = g_hash_table_new_full(g_str_hash,
+                                                           g_str_equal,
+                                                           g_free, g_free);
+        ctx.scanned = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify)g_hash_table_destroy);
+    }
+
+    g_list_foreach(scanner->mounts.paths, (GFunc)set_device_path, ctx.reattach);
 
-    lst = scanner->pending_scan;
+    jobs = scan_jobs_build(scanner->pending_scan, max_concurrent_devices > 1);
     scanner->pending_scan = NULL;
 
-    while (lst) {
-        scanner_pending_t *pending;
-        lms_t *lms = NULL;
+    if (g_list_length(jobs) <= 1 || max_concurrent_devices <= 1) {
+        /* serial: run in this thread, in priority order */
+        while (jobs) {
+            scan_job_t *job = jobs->data;
+            jobs = g_list_delete_link(jobs, jobs);
+            scan_job_run(job, &ctx);
+        }
+    }
+    else {
+        GError *error = NULL;
+        GThreadPool *pool;
+
+        log_info("scanning %u devices, at most %d at once",
+                 g_list_length(jobs), max_concurrent_devices);
+
+        pool = g_thread_pool_new(scan_job_run, &ctx, max_concurrent_devices,
+                                 TRUE, &error);
+        if (!pool) {
+            log_warning("Couldn't create scan pool: %s, scanning serially",
+                        error->message);
+            g_error_free(error);
+        }
+        else
+            g_thread_pool_set_sort_function(pool, scan_job_compare, NULL);
 
-        if (scanner->pending_stop)
-            break;
+        while (jobs) {
+            scan_job_t *job = jobs->data;
+            jobs = g_list_delete_link(jobs, jobs);
+            if (!pool || !g_thread_pool_push(pool, job, NULL))
+                scan_job_run(job, &ctx);
+        }
 
-        pending = lst->data;
-        lst = g_list_delete_link(lst, lst);
+        /* waits for the queued jobs too */
+        if (pool)
+            g_thread_pool_free(pool, FALSE, TRUE);
+    }
 
-        log_info("scan category: %s , bus_name = %s", pending->category , bus_name);
+    log_info("finished scanner thread , bus_name = %s" , bus_name);
 
-        lms = setup_lms(pending->category, scanner);
+    if (ctx.reattach) {
+        if (!scanner->pending_stop)
+            store_device_fingerprints(ctx.reattach, ctx.scanned);
+        g_hash_table_destroy(ctx.scanned);
+        g_hash_table_destroy(ctx.reattach->fingerprints);
+        g_hash_table_destroy(ctx.reattach->unchanged);
+        g_free(ctx.reattach);
+    }
+    g_mutex_clear(&ctx.lock);
 
-        if (lms) {
+    if (g_atomic_int_get(&scanner->throttle_state) != LMS_THROTTLE_STATE_NONE) {
+        g_atomic_int_set(&scanner->throttle_state, LMS_THROTTLE_STATE_NONE);
+        g_idle_add(scanner_throttle_state_changed, scanner);
+    }
 
-            lms_set_mutex(lms, mtx);
+    refresh_database();
 
-            while (pending->paths) {
+    scanner->cleanup_thread_idler = g_idle_add(scanner_thread_cleanup, scanner);
 
-                char *path;
-                scan_progress_t *scan_progress = NULL;
-#ifdef PATCH_LGE
-                scanDeviceType *scan_device = NULL;
-#endif
+    log_info("Finished scanner thread , Elapsed time: %0.3f seconds [ pid : %d ] [ bus_name : %s ]\n" , g_timer_elapsed(timer_scanner, NULL), getpid(), bus_name);
 
-                if (scanner->pending_stop)
-                    break;
+    g_timer_destroy (timer_scanner);
 
-                path = pending->paths->data;
-                pending->paths = g_list_delete_link(pending->paths,
-                                                    pending->paths);
+    return scanner;
+}
 
-                g_info("scan category = %s , path = %s , bus_name = %s", pending->category, path , bus_name);
+static void
+do_scan(scanner_t *scanner)
+{
+    log_info("[ pid : %d ] , bus_name = %s" , getpid() , bus_name);
 
-                if(strcmp(path,"/media/")!=0 &&
-                   strcmp(path,"/media/usb/")!=0 &&
-                   strcmp(path,"/media/mtp/")!=0 ) {
-                    device_pending = scanner_pending_device_get_or_add(scanner, pending->category);
-                    scanner_pending_add(device_pending, NULL, path);
-                    lms_set_device_scan_path(lms, path);
-                    log_info("device scan path : %s, %s , bus_name = %s", pending->category, path , bus_name);
-                }
+    scanner->thread = g_thread_new("scanner", scanner_thread_work, scanner);
 
-                if (!omit_scan_progress) {
-                    scan_progress = g_new0(scan_progress_t, 1);
-                    scan_progress->conn = g_object_ref(scanner->conn);
-                    scan_progress->category = g_strdup(pending->category);
-                    scan_progress->path = g_strdup(path);
-                    scanner->scan_progress = scan_progress;
+    if (!omit_scan_progress && scan_progress_rate > 0 && !scanner->progress.timer)
+        scanner->progress.timer = g_timeout_add(1000 / scan_progress_rate,
+                                                     report_scan_progress_tick,
+                                                     scanner);
 
+    scanner_is_scanning_changed(scanner);
+    scanner_write_lock_changed(scanner);
 #ifdef PATCH_LGE
-                    scan_device = g_new0(scanDeviceType, 1);
-                    scan_device->conn = g_object_ref(scanner->conn);
-                    scan_device->category = g_strdup(pending->category);
-                    scan_device->path = g_strdup(path);
-                    scanner->scan_device = scan_device;
+    scanner_status_changed(scanner);
 #endif
-                }
-
-                if (!scanner->pending_stop) {
-
-                    log_info("lms_check [ pid : %d ] , bus_name = %s", getpid() , bus_name);
-
-                    lms_check(lms, path);
-                }
-
-                if (!scanner->pending_stop && g_file_test(path, G_FILE_TEST_EXISTS)) {
+}
 
-                    log_info("lms_process [ pid : %d ] , path = %s , bus_name = %s", getpid() , path , bus_name);
+/*
+ * Worker of ScanFiles: every category gets the paths below its
+ * directories, with the same parsers a Scan would use, but no directory
+ * is walked and no cleanup is done afterwards. Same thread rules as
+ * scanner_thread_work().
+ */
+static gpointer
+scanner_files_thread_work(gpointer data)
+{
+    scanner_t *scanner = data;
+    GPtrArray *files = scanner->pending_files;
+    GHashTableIter iter;
+    gpointer value;
+    scan_worker_t worker;
+
+    log_info("started scan files thread , %u paths , bus_name = %s" , files->len , bus_name);
+
+    scanner->pending_files = NULL;
+    scan_worker_init(&worker, scanner);
+
+    g_hash_table_iter_init(&iter, categories);
+    while (g_hash_table_iter_next(&iter, NULL, &value) && !scanner->pending_stop) {
+        scanner_category_t *sc = value;
+        GPtrArray *paths = g_ptr_array_new();
+        lms_t *lms;
+        guint i;
+
+        for (i = 0; i < files->len; i++) {
+            const char *path = g_ptr_array_index(files, i);
+            if (scanner_category_allows_path(sc->dirs, path))
+                g_ptr_array_add(paths, (gpointer)path);
+        }
 
-                    lms_process(lms, path);
-                }
+        if (paths->len > 0 && (lms = setup_lms(sc->category, &worker)) != NULL) {
+            lms_set_mutex(lms, mtx);
+            scan_worker_set_current(&worker, lms, NULL);
 
-                if (scan_progress)
-                    g_idle_add(report_scan_progress_and_free, scan_progress);
+            log_info("lms_process_files category = %s , %u paths", sc->category, paths->len);
 
-#ifdef PATCH_LGE
-                if (scan_device)
-                    g_idle_add(report_scan_device_and_free, scan_device);
-#endif
+            lms_process_files(lms, (const char * const *)paths->pdata, (int)paths->len);
 
-                g_free(path);
-            }
+            scan_worker_set_current(&worker, NULL, NULL);
             lms_free(lms);
         }
 
-        scanner_pending_free(pending);
+        g_ptr_array_free(paths, TRUE);
     }
 
-    log_info("finished scanner thread , bus_name = %s" , bus_name);
-
-    refresh_database();
-
-    if (scanner->unavail_files){
-        g_list_foreach(scanner->unavail_files, update_db_play_ng_file, NULL);
-        g_list_free(scanner->unavail_files);
-        scanner->unavail_files = NULL;
-    }
+    g_ptr_array_free(files, TRUE);
+    scan_worker_clear(&worker);
 
     scanner->cleanup_thread_idler = g_idle_add(scanner_thread_cleanup, scanner);
 
-    log_info("Finished scanner thread , Elapsed time: %0.3f seconds [ pid : %d ] [ bus_name : %s ]\n" , g_timer_elapsed(timer_scanner, NULL), getpid(), bus_name);
-
-    g_timer_destroy (timer_scanner);
-
     return scanner;
 }
 
+/*
+ * ScanFiles(as paths): update exactly these files, no directory is
+ * walked. Relative paths and paths outside every category are ignored.
+ * Returns once the scan thread is started, completion is reported like
+ * Scan, through IsScanning. The update is not atomic: each category is
+ * processed by its own lms_process_files(), which commits in batches
+ * and marks the gone files in a separate transaction (see there).
+ */
 static void
-do_scan(scanner_t *scanner)
+dbus_scanner_scan_files(GDBusMethodInvocation *inv, scanner_t *scanner, GVariant *params)
 {
-    log_info("[ pid : %d ] , bus_name = %s" , getpid() , bus_name);
+    GVariantIter *itr;
+    GPtrArray *files;
+    char *path;
 
-    scanner->thread = g_thread_new("scanner", scanner_thread_work, scanner);
+    log_info("bus_name = %s" , bus_name);
+
+    if (scanner->thread) {
+        g_dbus_method_invocation_return_dbus_error(
+            inv, "org.lightmediascanner.AlreadyScanning",
+            "Scanner was already scanning.");
+        return;
+    }
+
+    if (scanner->write_lock) {
+        g_dbus_method_invocation_return_dbus_error(
+            inv, "org.lightmediascanner.WriteLocked",
+            "Data Base has a write lock for another process.");
+        return;
+    }
+
+    files = g_ptr_array_new_with_free_func(g_free);
+
+    g_variant_get(params, "(as)", &itr);
+    while (g_variant_iter_loop(itr, "s", &path)) {
+        if (path[0] != '/') {
+            log_warning("ScanFiles: path is not absolute: %s, skipped.", path);
+            continue;
+        }
+        g_ptr_array_add(files, g_strdup(path));
+    }
+    g_variant_iter_free(itr);
+
+    if (files->len == 0) {
+        g_ptr_array_free(files, TRUE);
+        g_dbus_method_invocation_return_value(inv, NULL);
+        return;
+    }
+
+    scanner->pending_files = files;
+    scanner->thread = g_thread_new("scan-files", scanner_files_thread_work, scanner);
 
     scanner_is_scanning_changed(scanner);
     scanner_write_lock_changed(scanner);
 #ifdef PATCH_LGE
     scanner_status_changed(scanner);
 #endif
+
+    g_dbus_method_invocation_return_value(inv, NULL);
 }
 
 static void
@@ -2252,6 +3895,44 @@ dbus_scanner_scan(GDBusMethodInvocation *inv, scanner_t *scanner, GVariant *para
     g_dbus_method_invocation_return_value(inv, NULL);
 }
 
+/* whether path is dir itself or something inside it, "/media/usb10" is
+ * not inside "/media/usb1" */
+static gboolean
+path_is_below(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    if (strncmp(path, dir, len) != 0)
+        return FALSE;
+
+    return len == 0 || dir[len - 1] == '/' ||
+        path[len] == '\0' || path[len] == '/';
+}
+
+/*
+ * Stop the running lms_check()/lms_process() right away instead of
+ * waiting for the next progress callback. If mount is given only stop it
+ * when it's scanning something below that mount point.
+ */
+static void
+scanner_cancel_current(scanner_t *scanner, const char *mount)
+{
+    GList *n;
+
+    g_mutex_lock(&scanner->current.lock);
+    for (n = scanner->current.workers; n != NULL; n = n->next) {
+        scan_worker_t *worker = n->data;
+
+        if (worker->lms &&
+            (!mount || (worker->path &&
+                        path_is_below(worker->path, mount)))) {
+            log_info("cancel scan of %s", worker->path ? worker->path : "(null)");
+            lms_stop_processing(worker->lms);
+        }
+    }
+    g_mutex_unlock(&scanner->current.lock);
+}
+
 static void
 dbus_scanner_stop(GDBusMethodInvocation *inv, scanner_t *scanner)
 {
@@ -2271,6 +3952,7 @@ dbus_scanner_stop(GDBusMethodInvocation *inv, scanner_t *scanner)
     }
 
     scanner->pending_stop = g_object_ref(inv);
+    scanner_cancel_current(scanner, NULL);
 #ifdef PATCH_LGE
     scanner_status_changed(scanner);
 #endif
@@ -2312,71 +3994,211 @@ dbus_scanner_release_write_lock(GDBusMethodInvocation *inv, scanner_t *scanner,
 }
 
 #ifdef PATCH_LGE
-static void update_db_play_ng_file(gpointer data, gpointer user_data)
+#define PLAY_NG_COALESCE_MS 100
+
+static sqlite3 *play_ng_db = NULL;
+static sqlite3_stmt *play_ng_stmt = NULL;
+
+static void
+play_ng_db_close(void)
 {
-    const char sql_path[] = "UPDATE files SET playng = ? WHERE path LIKE ?";
+    if (play_ng_stmt) {
+        sqlite3_finalize(play_ng_stmt);
+        play_ng_stmt = NULL;
+    }
+    if (play_ng_db) {
+        sqlite3_close(play_ng_db);
+        play_ng_db = NULL;
+    }
+}
 
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
+/*
+ * The connection and its statement are kept open across calls, only
+ * the main thread touches them. They are dropped on any error so the
+ * next flush reopens the database (it may have been recreated).
+ */
+static int
+play_ng_db_open(void)
+{
+    const char sql_path[] = "UPDATE files SET playng = ? WHERE path = ?";
     int ret;
-    char *path = (char *)data;
-    size_t path_len = 0;
 
-    ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
+    if (play_ng_stmt)
+        return 0;
+
+    ret = sqlite3_open_v2(db_path, &play_ng_db, SQLITE_OPEN_READWRITE, NULL);
     if (ret != SQLITE_OK) {
-        log_warning("Couldn't open '%s': %s", db_path, sqlite3_errmsg(db));
-        goto end;
+        log_warning("Couldn't open '%s': %s", db_path,
+                    sqlite3_errmsg(play_ng_db));
+        play_ng_db_close();
+        return -1;
     }
 
-    if (sqlite3_prepare_v2(db, sql_path, -1, &stmt, NULL) != SQLITE_OK) {
-        log_warning("Couldn't prepare select : %s", sqlite3_errmsg(db));
-        goto cleanup;
+    if (sqlite3_prepare_v2(play_ng_db, sql_path, -1, &play_ng_stmt,
+                           NULL) != SQLITE_OK) {
+        log_warning("Couldn't prepare update playng: %s",
+                    sqlite3_errmsg(play_ng_db));
+        play_ng_db_close();
+        return -1;
     }
 
+    return 0;
+}
+
+static int
+update_db_play_ng_file(const char *path, int playng)
+{
+    size_t path_len;
+    int ret;
+
     path_len = strlen(path);
     if (path_len > INT_MAX) {
         log_error("ERROR: path_len may overflow");
-        goto cleanup;
+        return 0;
     }
-    else {
-      if (sqlite3_bind_text(stmt, 2, path, (int)path_len ,SQLITE_STATIC) != SQLITE_OK) {
-        log_warning("Couldn't bind find path :%s error: %s", path, sqlite3_errmsg(db));
-        goto cleanup;
-      }
+
+    /* a single file: plain equality on the blob uses the path index */
+    if (sqlite3_bind_blob(play_ng_stmt, 2, path, (int)path_len,
+                          SQLITE_STATIC) != SQLITE_OK) {
+        log_warning("Couldn't bind find path :%s error: %s", path,
+                    sqlite3_errmsg(play_ng_db));
+        ret = -1;
+        goto end;
     }
 
-    if (sqlite3_bind_int(stmt, 1, 1) != SQLITE_OK) {
-        log_warning("Couldn't bind int %s", sqlite3_errmsg(db));
-        goto cleanup;
+    if (sqlite3_bind_int(play_ng_stmt, 1, playng) != SQLITE_OK) {
+        log_warning("Couldn't bind int %s", sqlite3_errmsg(play_ng_db));
+        ret = -1;
+        goto end;
     }
 
-    ret = sqlite3_step(stmt);
-    if (ret !=  SQLITE_DONE){
+    ret = sqlite3_step(play_ng_stmt);
+    if (ret != SQLITE_DONE) {
         log_warning("Couldn't run SQL to update files playng, ret=%d: %s",
-                  ret, sqlite3_errmsg(db));
+                    ret, sqlite3_errmsg(play_ng_db));
+        ret = -1;
+    } else
+        ret = 0;
+
+end:
+    sqlite3_reset(play_ng_stmt);
+    sqlite3_clear_bindings(play_ng_stmt);
+    return ret;
+}
+
+/*
+ * Write all queued play state changes in a single transaction, holding
+ * the shared database lock once for the whole batch.
+ */
+static void
+flush_play_ng_files(scanner_t *scanner)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    unsigned count = 0;
+    gint64 locked_at;
+    int r = 0;
+
+    if (g_hash_table_size(scanner->unavail_files) == 0)
+        return;
+
+    locked_at = db_lock();
+
+    if (play_ng_db_open() != 0)
+        goto end;
+
+    if (sqlite3_exec(play_ng_db, "BEGIN TRANSACTION", NULL, NULL,
+                     NULL) != SQLITE_OK) {
+        log_warning("Couldn't begin playng transaction: %s",
+                    sqlite3_errmsg(play_ng_db));
+        play_ng_db_close();
+        goto end;
     }
 
-cleanup:
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    g_hash_table_iter_init(&iter, scanner->unavail_files);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        r = update_db_play_ng_file(key, GPOINTER_TO_INT(value));
+        if (r != 0)
+            break;
+        count++;
+    }
+
+    if (r != 0) {
+        sqlite3_exec(play_ng_db, "ROLLBACK", NULL, NULL, NULL);
+        play_ng_db_close();
+        goto end;
+    }
+
+    if (sqlite3_exec(play_ng_db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        log_warning("Couldn't commit playng transaction: %s",
+                    sqlite3_errmsg(play_ng_db));
+        sqlite3_exec(play_ng_db, "ROLLBACK", NULL, NULL, NULL);
+        play_ng_db_close();
+        goto end;
+    }
+
+    log_info("updated playng of %u files", count);
 
 end:
-    sqlite3_close(db);
+    db_unlock(locked_at, "playng");
+    g_hash_table_remove_all(scanner->unavail_files);
+}
+
+static gboolean
+play_ng_timeout(gpointer data)
+{
+    scanner_t *scanner = data;
+
+    scanner->play_ng_timer = 0;
+
+    /* scanner_thread_cleanup() flushes once the scan is over */
+    if (scanner->thread == NULL)
+        flush_play_ng_files(scanner);
+
+    return FALSE;
+}
+
+static void
+queue_play_ng_file(scanner_t *scanner, const char *path, gboolean playng)
+{
+    g_hash_table_insert(scanner->unavail_files, g_strdup(path),
+                        GINT_TO_POINTER(playng ? 1 : 0));
 }
 
 static void dbus_scanner_set_playNG(GDBusMethodInvocation *inv, scanner_t *scanner, GVariant *params)
 {
-    char *path = NULL;
+    const char *path = NULL;
+
+    g_variant_get(params, "(&s)", &path);
+    queue_play_ng_file(scanner, path, TRUE);
+
+    /* bursts of single calls end up in the same transaction */
+    if (!scanner->play_ng_timer)
+        scanner->play_ng_timer = g_timeout_add(PLAY_NG_COALESCE_MS,
+                                               play_ng_timeout, scanner);
+
+    g_dbus_method_invocation_return_value(inv, NULL);
+}
+
+static void dbus_scanner_set_playNGs(GDBusMethodInvocation *inv, scanner_t *scanner, GVariant *params)
+{
+    GVariantIter *itr;
+    const char *path;
+    gboolean playng;
 
-    g_variant_get(params, "(s)", &path);
-    scanner->unavail_files = g_list_append(scanner->unavail_files, path);
+    g_variant_get(params, "(a(sb))", &itr);
+    while (g_variant_iter_loop(itr, "(&sb)", &path, &playng))
+        queue_play_ng_file(scanner, path, playng);
+    g_variant_iter_free(itr);
 
-    if (scanner->thread == NULL){
-        g_list_foreach(scanner->unavail_files, update_db_play_ng_file, NULL);
-        g_list_free(scanner->unavail_files);
-        scanner->unavail_files = NULL;
+    if (scanner->play_ng_timer) {
+        g_source_remove(scanner->play_ng_timer);
+        scanner->play_ng_timer = 0;
     }
 
+    if (scanner->thread == NULL)
+        flush_play_ng_files(scanner);
+
     g_dbus_method_invocation_return_value(inv, NULL);
 }
 #endif
@@ -2388,8 +4210,14 @@ scanner_method_call(GDBusConnection *conn, const char *sender, const char *opath
 
     log_info("bus_name = %s , method = [[[[[[[[[[ %s ]]]]]]]]]]]" , bus_name , method);
 
+#ifdef PATCH_LGE
+    scanner->vacuum.last_busy = g_get_monotonic_time();
+#endif
+
     if (strcmp(method, "Scan") == 0)
         dbus_scanner_scan(inv, scanner, params);
+    else if (strcmp(method, "ScanFiles") == 0)
+        dbus_scanner_scan_files(inv, scanner, params);
     else if (strcmp(method, "Stop") == 0)
         dbus_scanner_stop(inv, scanner);
     else if (strcmp(method, "RequestWriteLock") == 0)
@@ -2399,6 +4227,8 @@ scanner_method_call(GDBusConnection *conn, const char *sender, const char *opath
 #ifdef PATCH_LGE
     else if (strcmp(method, "SetPlayNG") == 0)
         dbus_scanner_set_playNG(inv, scanner, params);
+    else if (strcmp(method, "SetPlayNGs") == 0)
+        dbus_scanner_set_playNGs(inv, scanner, params);
 #endif
 }
 
@@ -2441,18 +4271,16 @@ scanner_get_prop(GDBusConnection *conn, const char *sender, const char *opath, c
     else if (strcmp(prop, "WriteLocked") == 0)
         ret = g_variant_new_boolean(check_write_locked(scanner));
     else if (strcmp(prop, "UpdateID") == 0) {
-        guint64 update_id = 0;
-
-        if (!check_write_locked(scanner))
-            update_id = get_update_id();
-        if (update_id > 0 && update_id != scanner->update_id) {
-            scanner->update_id = update_id;
+        if (scanner_sync_update_id(scanner))
             scanner_update_id_changed(scanner);
-        }
         ret = g_variant_new_uint64(scanner->update_id);
     } else if (strcmp(prop, "Categories") == 0)
         ret = categories_get_variant();
+    else if (strcmp(prop, "ThrottleState") == 0)
+        ret = g_variant_new_uint32(g_atomic_int_get(&scanner->throttle_state));
 #ifdef PATCH_LGE
+    else if (strcmp(prop, "MaxLockHoldTime") == 0)
+        ret = g_variant_new_uint32(g_atomic_int_get(&lock_hold_max_us));
     else if(strcmp(prop, "ScannerStatus"))
     {
         lms_scanner_status_t status = LMS_SCANNER_STATUS_IDLE;
@@ -2640,6 +4468,7 @@ on_mounts_changed(GIOChannel *source, GIOCondition cond, gpointer data)
             o = o->next;
             n = n->next;
         } else if (r < 0) { /* removed */
+            scanner_cancel_current(scanner, o->data);
             scanner_mount_pending_add_or_delete(scanner, o->data);
             o = o->next;
         } else { /* added (goes to both pending and current) */
@@ -2649,8 +4478,10 @@ on_mounts_changed(GIOChannel *source, GIOCondition cond, gpointer data)
         }
     }
 
-    for (; o != NULL; o = o->next)
+    for (; o != NULL; o = o->next) {
+        scanner_cancel_current(scanner, o->data);
         scanner_mount_pending_add_or_delete(scanner, o->data);
+    }
     for (; n != NULL; n = n->next) {
         current = g_list_prepend(current, g_strdup(n->data));
         scanner_mount_pending_add_or_delete(scanner, n->data);
@@ -2710,6 +4541,18 @@ scanner_destroyed(gpointer data)
         scanner_dbus_props_changed(scanner);
     }
 
+#ifdef PATCH_LGE
+    if (scanner->vacuum.timer)
+        g_source_remove(scanner->vacuum.timer);
+    if (scanner->play_ng_timer) {
+        g_source_remove(scanner->play_ng_timer);
+        scanner->play_ng_timer = 0;
+    }
+    flush_play_ng_files(scanner);
+    play_ng_db_close();
+    g_hash_table_destroy(scanner->unavail_files);
+#endif
+
     g_assert(scanner->thread == NULL);
     g_assert(scanner->pending_scan == NULL);
     g_assert(scanner->pending_device_scan == NULL);
@@ -2717,6 +4560,8 @@ scanner_destroyed(gpointer data)
     g_assert(scanner->pending_stop == NULL);
     g_assert(scanner->changed_props.idler == 0);
 
+    g_mutex_clear(&scanner->current.lock);
+    g_mutex_clear(&scanner->progress.lock);
     g_free(scanner);
 }
 
@@ -2736,11 +4581,24 @@ on_name_acquired(GDBusConnection *conn, const gchar *name, gpointer data)
 
     scanner = g_new0(scanner_t, 1);
     g_assert(scanner != NULL);
+    g_mutex_init(&scanner->current.lock);
+    g_mutex_init(&scanner->progress.lock);
     scanner->conn = conn;
     scanner->pending_scan = NULL;
     scanner->pending_device_scan = NULL;
+    /* the shared mirror may be stale or missing after a reboot, the
+     * database is the reference once at startup */
     scanner->update_id = get_update_id();
-    scanner->unavail_files = NULL;
+    lms_update_id_reset(db_path, (unsigned int)scanner->update_id);
+#ifdef PATCH_LGE
+    scanner->unavail_files = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, NULL);
+    scanner->vacuum.last_busy = g_get_monotonic_time();
+    if (vacuum)
+        scanner->vacuum.timer = g_timeout_add_seconds(VACUUM_CHECK_INTERVAL,
+                                                      scanner_idle_vacuum,
+                                                      scanner);
+#endif
     scanner->thread = NULL;
 
     iface = g_dbus_node_info_lookup_interface(introspection_data, BUS_IFACE);
@@ -2779,6 +4637,7 @@ on_name_acquired(GDBusConnection *conn, const gchar *name, gpointer data)
     scanner_write_lock_changed(scanner);
     scanner_is_scanning_changed(scanner);
     scanner_categories_changed(scanner);
+    scanner_throttle_state_changed(scanner);
 #ifdef PATCH_LGE
     scanner_status_changed(scanner);
 #endif
@@ -3193,7 +5052,8 @@ main(int argc, char *argv[])
          "Defaults to 30.",
          "DAYS"},
         {"vacuum", 'V', 0, G_OPTION_ARG_NONE, &vacuum,
-         "Execute SQL VACUUM after every scan.", NULL},
+         "Reclaim free database pages with incremental vacuum while the "
+         "scanner and the browser are idle.", NULL},
         {"startup-scan", 'S', 0, G_OPTION_ARG_NONE, &startup_scan,
          "Execute full scan on startup.", NULL},
         {"omit-scan-progress", 0, 0, G_OPTION_ARG_NONE, &omit_scan_progress,
@@ -3202,6 +5062,56 @@ main(int argc, char *argv[])
          "performance, but will make the listener user-interfaces less "
          "responsive as they won't be able to tell the user what is happening.",
          NULL},
+        {"max-concurrent-devices", 0, 0, G_OPTION_ARG_INT,
+         &max_concurrent_devices,
+         "Scan up to this many devices (distinct file systems) at the same "
+         "time, each with its own slave process. Internal storage is "
+         "started first, then USB, then MTP. Defaults to 1, scanning "
+         "everything in order.",
+         "N"},
+        {"scan-progress-rate", 0, 0, G_OPTION_ARG_INT, &scan_progress_rate,
+         "How many times per second at most the ScanProgress signal of a "
+         "category is emitted while scanning, between 1 and 1000. Defaults "
+         "to 4.",
+         "HZ"},
+        {"two-phase-scan", 0, 0, G_OPTION_ARG_NONE, &two_phase_scan,
+         "Register all files of a path first, without parsing them, so they "
+         "can be browsed by folder right away, then parse them in a second "
+         "pass. The second pass may be stopped without losing the files "
+         "registered by the first one.",
+         NULL},
+        {"single-pass-scan", 0, 0, G_OPTION_ARG_NONE, &single_pass_scan,
+         "Check and process each path in a single walk that compares every "
+         "directory with its rows in the database, instead of a check pass "
+         "over the database followed by a process pass over the disk. "
+         "Ignored with --two-phase-scan.",
+         NULL},
+        {"fast-reattach", 0, 0, G_OPTION_ARG_NONE, &fast_reattach,
+         "Fingerprint devices (filesystem UUID, root listing and free "
+         "space) and skip scanning a known device that comes back with the "
+         "fingerprint stored after its last complete scan.",
+         NULL},
+        {"reparse-outdated", 0, 0, G_OPTION_ARG_NONE, &reparse_outdated,
+         "After scanning a path, parse again its files whose metadata came "
+         "from an older (or newer) version of a loaded parser.",
+         NULL},
+        {"storage-order", 0, 0, G_OPTION_ARG_STRING, &storage_order,
+         "Order in which the files of a directory are parsed: 'name' "
+         "(default), 'inode' or 'block' (first physical block, through "
+         "FIEMAP). The last two reduce seeks on rotating and slow flash "
+         "media.",
+         "ORDER"},
+        {"pressure-slow-threshold", 0, 0, G_OPTION_ARG_DOUBLE,
+         &pressure_slow_threshold,
+         "CPU or I/O pressure (/proc/pressure 'some avg10' percentage) at "
+         "which the scan dispatch is slowed down, ie: 10. Defaults to 0, "
+         "no throttling.",
+         "PERCENT"},
+        {"pressure-pause-threshold", 0, 0, G_OPTION_ARG_DOUBLE,
+         &pressure_pause_threshold,
+         "CPU or I/O pressure at which the scan dispatch pauses until the "
+         "pressure drops below the slow threshold again. Defaults to 40.",
+         "PERCENT"},
         {"charset", 'C', 0, G_OPTION_ARG_STRING_ARRAY, &charsets,
          "Extra charset to use. (Multiple use)", "CHARSET"},
         {"parser", 'P', 0, G_OPTION_ARG_STRING_ARRAY, &parsers,
@@ -3353,6 +5263,12 @@ main(int argc, char *argv[])
 
     g_option_context_free(opt_ctx);
 
+    if (scan_progress_rate < 1 || scan_progress_rate > 1000) {
+        log_warning("scan progress rate %d out of range, using 4",
+                    scan_progress_rate);
+        scan_progress_rate = 4;
+    }
+
     categories = g_hash_table_new_full(
         g_str_hash, g_str_equal, NULL,
         (GDestroyNotify)scanner_category_destroy);
@@ -3391,7 +5307,7 @@ main(int argc, char *argv[])
 
     log_info("+ create database [ pid : %d ] , bus_name = %s", getpid() , bus_name);
 
-    pthread_mutex_lock(mtx);
+    lms_mutex_lock(mtx);
     if (lms_create_database(db_path) != 0) {
 
         log_error("[[[ ERROR ]]] lms_create_database(...) FAILED!!!!! [ pid : %d ] , bus_name = %s" , getpid() , bus_name);
@@ -3399,10 +5315,15 @@ main(int argc, char *argv[])
 
         return EXIT_FAILURE;
     }
+#ifdef PATCH_LGE
+    database_upgrade();
+#endif
     pthread_mutex_unlock(mtx);
 
     log_info("- create database [ pid : %d ] , bus_name = %s" , getpid() , bus_name);
 
+    checkpointer_start();
+
     if (!parsers)
         lms_parsers_list(populate_categories, (void *)1L);
     else {
@@ -3482,6 +5403,12 @@ main(int argc, char *argv[])
     log_info("slave-timeout = %d seconds , delete_older_than = %d days , charset_detect_level = %d", slave_timeout , delete_older_than , charset_detect_level);
 
     log_info("startup_scan: %d", startup_scan);
+    log_info("two_phase_scan: %d", two_phase_scan);
+    log_info("single_pass_scan: %d", single_pass_scan);
+    log_info("fast_reattach: %d", fast_reattach);
+    log_info("reparse_outdated: %d", reparse_outdated);
+    log_info("storage_order: %s", storage_order ? storage_order : "name");
+    log_info("pressure thresholds: slow %0.1f%% , pause %0.1f%%", pressure_slow_threshold, pressure_pause_threshold);
     #if defined(ENABLE_FRONT_REAR_SEPARATE_STARTUP_SCAN_OPTION)
         log_info("startup_scan_rear: %d", startup_scan_rear);
     #endif
@@ -3533,6 +5460,7 @@ main(int argc, char *argv[])
     log_info("main loop is finished , bus_name = %s" , bus_name);
 
     g_bus_unown_name(id);
+    checkpointer_stop();
     g_main_loop_unref(loop);
     g_dbus_node_info_unref(introspection_data);
 
@@ -3540,6 +5468,7 @@ end_options:
     g_free(db_path);
     g_free(bus_name);
     g_free(object_path);
+    g_free(storage_order);
     g_strfreev(charsets);
     g_strfreev(parsers);
     g_strfreev(dirs);
@@ -22,19 +22,25 @@
 
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <glib.h>
 
 #include "lightmediascanner.h"
 #include "lightmediascanner_private.h"
 #include "lightmediascanner_db_private.h"
 #include "lightmediascanner_logger.h"
+#include "lightmediascanner_platform_conf.h"
 
 struct master_db {
     sqlite3 *handle;
@@ -47,6 +53,19 @@ struct slave_db {
     sqlite3_stmt *transaction_commit;
     sqlite3_stmt *delete_file_info;
     sqlite3_stmt *update_file_info;
+    sqlite3_stmt *insert_file_info;
+    sqlite3_stmt *set_file_parsed;
+    sqlite3_stmt *match_fingerprint;
+    sqlite3_stmt *set_fingerprint;
+    sqlite3_stmt *bulk_insert;
+    sqlite3_stmt *bulk_apply;
+    sqlite3_stmt *bulk_clear;
+};
+
+struct sync_db {
+    sqlite3 *handle;
+    sqlite3_stmt *get_dir_files;
+    sqlite3_stmt *get_files;
 };
 
 struct single_process_db {
@@ -56,8 +75,60 @@ struct single_process_db {
     sqlite3_stmt *transaction_commit;
     sqlite3_stmt *delete_file_info;
     sqlite3_stmt *update_file_info;
+    sqlite3_stmt *set_file_parsed;
+    sqlite3_stmt *match_fingerprint;
+    sqlite3_stmt *set_fingerprint;
 };
 
+/* Rows below a path, bound by _db_get_files_range(). A LIKE prefix match
+ * can't use the index on files.path, this half-open range can. */
+static const char _get_files_sql[] =
+    "SELECT id, path, mtime, dtime, itime, ctime, size FROM files "
+    "WHERE path >= ? AND path < ?";
+
+/* Same columns as _get_files_sql plus 'parsed', used by
+ * lms_check_unparsed() to feed the rows left by lms_process_presence().
+ * Newest files come first, they are the ones a user is most likely to
+ * look for right after copying them; files_unparsed_mtime_idx gives
+ * this order without sorting. */
+static const char _get_unparsed_files_sql[] =
+    "SELECT id, path, mtime, dtime, itime, ctime, size, parsed FROM files "
+    "WHERE parsed = 0 AND dtime = 0 AND path >= ? AND path < ? "
+    "ORDER BY mtime DESC, id";
+
+/*
+ * Bind [path, upper) to the first two parameters of stmt. For a directory
+ * path must end with '/' and upper is path with that '/' turned into '0',
+ * the next byte. For a file upper is path followed by a NUL byte, so only
+ * path itself is in the range. path is a blob column, so are the bounds.
+ */
+static int
+_db_get_files_range(sqlite3_stmt *stmt, const char *path, int len, int is_file)
+{
+    char upper[PATH_SIZE + 2];
+    int upper_len = len;
+
+    if (len <= 0 || len > PATH_SIZE) {
+        log_error("ERROR: invalid path length %d", len);
+        return -1;
+    }
+
+    memcpy(upper, path, len);
+    if (is_file)
+        upper[upper_len++] = '\0';
+    else
+        upper[len - 1] = '/' + 1;
+
+    if (sqlite3_bind_blob(stmt, 1, path, len, SQLITE_TRANSIENT) != SQLITE_OK ||
+        sqlite3_bind_blob(stmt, 2, upper, upper_len, SQLITE_TRANSIENT) != SQLITE_OK) {
+        log_error("ERROR: could not bind path range of \"%s\"", path);
+        lms_db_reset_stmt(stmt);
+        return -2;
+    }
+
+    return 0;
+}
+
 /***********************************************************************
  * Master-Slave communication.
  ***********************************************************************/
@@ -73,8 +144,44 @@ struct comm_finfo {
     size_t size;
     unsigned int flags;
 #define COMM_FINFO_FLAG_OUTDATED 1
+#define COMM_FINFO_FLAG_NEW 2
+/* path_len bytes of struct comm_bulk_entry follow instead of a path, all
+ * of them get dtime and update_id set at once */
+#define COMM_FINFO_FLAG_BULK 4
+};
+
+struct comm_bulk_entry {
+    int64_t id;
+    time_t ctime;
 };
 
+/* Rows fetched, stat()'ed and flushed together by the batched check. */
+#define CHECK_BATCH_SIZE 256
+#define CHECK_STAT_THREADS 4
+
+static int
+_master_send_bulk(const struct fds *master, const struct comm_bulk_entry *entries, int n, time_t dtime)
+{
+    struct comm_finfo ci = {};
+
+    ci.path_len = n * (int)sizeof(*entries);
+    ci.id = -1;
+    ci.dtime = dtime;
+    ci.flags = COMM_FINFO_FLAG_BULK;
+
+    if (write(master->w, &ci, sizeof(ci)) < 0) {
+        perror("write");
+        return -1;
+    }
+
+    if (write(master->w, entries, ci.path_len) < 0) {
+        perror("write");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 _master_send_file(const struct fds *master, const struct lms_file_info finfo, unsigned int flags)
 {
@@ -127,19 +234,21 @@ _master_send_finish(const struct fds *master)
     return 0;
 }
 
+/*
+ * Return:
+ *  0: reply received
+ *  1: slave took longer than timeout
+ *  2: processing was cancelled while waiting
+ *  < 0 on error
+ */
 static int
-_master_recv_reply(const struct fds *master, struct pollfd *pfd, int *reply, int timeout)
+_master_recv_reply(const struct fds *master, struct pollfd *pfd, int *reply, int timeout, const lms_t *lms)
 {
     int r;
 
-    r = poll(pfd, 1, timeout);
-    if (r < 0) {
-        perror("poll");
-        return -1;
-    }
-
-    if (r == 0)
-        return 1;
+    r = lms_slave_poll(pfd, timeout, lms);
+    if (r != 0)
+        return r;
 
     ssize_t read_return = read(master->r, reply, sizeof(*reply));
     if (read_return < 0) {
@@ -170,6 +279,7 @@ _slave_recv_file(const struct fds *slave, struct lms_file_info *finfo, unsigned
 {
     struct comm_finfo ci;
     static char path[PATH_SIZE + 1];
+    static struct comm_bulk_entry bulk[CHECK_BATCH_SIZE];
     long r = 0;
     unsigned long size_ci = sizeof(ci);
 
@@ -202,6 +312,24 @@ _slave_recv_file(const struct fds *slave, struct lms_file_info *finfo, unsigned
     if (ci.path_len == -1)
         return 0;
 
+    if (ci.flags & COMM_FINFO_FLAG_BULK) {
+        if (ci.path_len <= 0 || ci.path_len > (int)sizeof(bulk) ||
+            ci.path_len % sizeof(bulk[0])) {
+            log_error("ERROR: invalid bulk size (%d)", ci.path_len);
+            return -2;
+        }
+
+        r = read(slave->r, bulk, ci.path_len);
+        if (r != (long)ci.path_len) {
+            log_error("ERROR: could not read whole bulk %ld/%d",
+                    r, ci.path_len);
+            return -3;
+        }
+
+        finfo->path = (const char *)bulk;
+        return 0;
+    }
+
     if (ci.path_len > PATH_SIZE || ci.path_len < 0) {
         log_error("ERROR: invalid path size (%d) (min: 0, max: %d)",
                 ci.path_len, PATH_SIZE);
@@ -248,6 +376,49 @@ _slave_db_compile_all_stmts(struct slave_db *db)
     if (!db->update_file_info)
         return -4;
 
+    db->set_file_parsed = lms_db_compile_stmt_set_file_parsed(handle);
+    if (!db->set_file_parsed)
+        return -5;
+
+    db->match_fingerprint = lms_db_compile_stmt_match_fingerprint(handle);
+    if (!db->match_fingerprint)
+        return -5;
+
+    db->set_fingerprint = lms_db_compile_stmt_set_fingerprint(handle);
+    if (!db->set_fingerprint)
+        return -5;
+
+    db->insert_file_info = lms_db_compile_stmt_insert_file_info(handle);
+    if (!db->insert_file_info)
+        return -6;
+
+    /* rows of a COMM_FINFO_FLAG_BULK message, applied with a single
+     * UPDATE instead of one per row */
+    if (sqlite3_exec(handle,
+                     "CREATE TEMP TABLE IF NOT EXISTS check_bulk "
+                     "(id INTEGER PRIMARY KEY, ctime INTEGER)",
+                     NULL, NULL, NULL) != SQLITE_OK) {
+        log_error("ERROR: could not create check_bulk: %s",
+                sqlite3_errmsg(handle));
+        return -7;
+    }
+
+    db->bulk_insert = lms_db_compile_stmt(handle,
+        "INSERT OR REPLACE INTO check_bulk (id, ctime) VALUES (?, ?)");
+    if (!db->bulk_insert)
+        return -8;
+
+    db->bulk_apply = lms_db_compile_stmt(handle,
+        "UPDATE files SET dtime = ?, update_id = ?, "
+        "ctime = (SELECT b.ctime FROM check_bulk b WHERE b.id = files.id) "
+        "WHERE id IN (SELECT id FROM check_bulk)");
+    if (!db->bulk_apply)
+        return -9;
+
+    db->bulk_clear = lms_db_compile_stmt(handle, "DELETE FROM check_bulk");
+    if (!db->bulk_clear)
+        return -10;
+
     return 0;
 }
 
@@ -270,6 +441,8 @@ _slave_db_open(const char *db_path)
         goto error;
     }
 
+    lms_db_writer_setup(db->handle);
+
     return db;
 
   error:
@@ -293,6 +466,25 @@ _slave_db_close(struct slave_db *db)
     if (db->update_file_info)
         lms_db_finalize_stmt(db->update_file_info, "update_file_info");
 
+    if (db->insert_file_info)
+        lms_db_finalize_stmt(db->insert_file_info, "insert_file_info");
+
+    if (db->set_file_parsed)
+        lms_db_finalize_stmt(db->set_file_parsed, "set_file_parsed");
+    if (db->match_fingerprint)
+        lms_db_finalize_stmt(db->match_fingerprint, "match_fingerprint");
+    if (db->set_fingerprint)
+        lms_db_finalize_stmt(db->set_fingerprint, "set_fingerprint");
+
+    if (db->bulk_insert)
+        lms_db_finalize_stmt(db->bulk_insert, "bulk_insert");
+
+    if (db->bulk_apply)
+        lms_db_finalize_stmt(db->bulk_apply, "bulk_apply");
+
+    if (db->bulk_clear)
+        lms_db_finalize_stmt(db->bulk_clear, "bulk_clear");
+
     if (sqlite3_close(db->handle) != SQLITE_OK) {
         log_error("ERROR: clould not close DB (slave): %s",
                 sqlite3_errmsg(db->handle));
@@ -304,13 +496,16 @@ _slave_db_close(struct slave_db *db)
 }
 
 static int
-_single_process_db_compile_all_stmts(struct single_process_db *db)
+_single_process_db_compile_all_stmts(struct single_process_db *db, int unparsed)
 {
     sqlite3 *handle;
 
     handle = db->handle;
 
-    db->get_files = lms_db_compile_stmt_get_files(handle);
+    if (unparsed)
+        db->get_files = lms_db_compile_stmt(handle, _get_unparsed_files_sql);
+    else
+        db->get_files = lms_db_compile_stmt(handle, _get_files_sql);
     if (!db->get_files)
         return -1;
 
@@ -330,11 +525,23 @@ _single_process_db_compile_all_stmts(struct single_process_db *db)
     if (!db->update_file_info)
         return -5;
 
+    db->set_file_parsed = lms_db_compile_stmt_set_file_parsed(handle);
+    if (!db->set_file_parsed)
+        return -6;
+
+    db->match_fingerprint = lms_db_compile_stmt_match_fingerprint(handle);
+    if (!db->match_fingerprint)
+        return -6;
+
+    db->set_fingerprint = lms_db_compile_stmt_set_fingerprint(handle);
+    if (!db->set_fingerprint)
+        return -6;
+
     return 0;
 }
 
 static struct single_process_db *
-_single_process_db_open(const char *db_path)
+_single_process_db_open(const char *db_path, int unparsed)
 {
     struct single_process_db *db;
 
@@ -355,7 +562,14 @@ _single_process_db_open(const char *db_path)
         goto error;
     }
 
-    if (_single_process_db_compile_all_stmts(db) != 0) {
+    if (lms_db_files_upgrade(db->handle) != 0) {
+        log_error("ERROR: could not upgrade files table.");
+        goto error;
+    }
+
+    lms_db_writer_setup(db->handle);
+
+    if (_single_process_db_compile_all_stmts(db, unparsed) != 0) {
         log_error("ERROR: could not compile statements.");
         goto error;
     }
@@ -386,6 +600,13 @@ _single_process_db_close(struct single_process_db *db)
     if (db->update_file_info)
         lms_db_finalize_stmt(db->update_file_info, "update_file_info");
 
+    if (db->set_file_parsed)
+        lms_db_finalize_stmt(db->set_file_parsed, "set_file_parsed");
+    if (db->match_fingerprint)
+        lms_db_finalize_stmt(db->match_fingerprint, "match_fingerprint");
+    if (db->set_fingerprint)
+        lms_db_finalize_stmt(db->set_fingerprint, "set_fingerprint");
+
     if (sqlite3_close(db->handle) != SQLITE_OK) {
         log_error("ERROR: clould not close DB (slave): %s",
                 sqlite3_errmsg(db->handle));
@@ -402,6 +623,58 @@ _init_sync_send(struct fds *fds)
     return _slave_send_reply(fds, 0);
 }
 
+/*
+ * Set dtime of every row in entries with one UPDATE, return the number of
+ * rows changed or < 0 on error.
+ */
+static int
+_slave_apply_bulk(struct slave_db *db, const struct comm_bulk_entry *entries,
+                  int n, time_t dtime, unsigned int update_id)
+{
+    int i, r;
+
+    for (i = 0; i < n; i++) {
+        if (sqlite3_bind_int64(db->bulk_insert, 1, entries[i].id) != SQLITE_OK ||
+            sqlite3_bind_int64(db->bulk_insert, 2, entries[i].ctime) != SQLITE_OK) {
+            log_error("ERROR: could not bind bulk entry");
+            lms_db_reset_stmt(db->bulk_insert);
+            r = -1;
+            goto end;
+        }
+        r = sqlite3_step(db->bulk_insert);
+        lms_db_reset_stmt(db->bulk_insert);
+        if (r != SQLITE_DONE) {
+            log_error("ERROR: could not add bulk entry: %s",
+                    sqlite3_errmsg(db->handle));
+            r = -2;
+            goto end;
+        }
+    }
+
+    if (sqlite3_bind_int64(db->bulk_apply, 1, dtime) != SQLITE_OK ||
+        sqlite3_bind_int(db->bulk_apply, 2, update_id) != SQLITE_OK) {
+        log_error("ERROR: could not bind bulk update");
+        lms_db_reset_stmt(db->bulk_apply);
+        r = -3;
+        goto end;
+    }
+    r = sqlite3_step(db->bulk_apply);
+    lms_db_reset_stmt(db->bulk_apply);
+    if (r != SQLITE_DONE) {
+        log_error("ERROR: could not apply bulk update: %s",
+                sqlite3_errmsg(db->handle));
+        r = -4;
+        goto end;
+    }
+    r = sqlite3_changes(db->handle);
+
+  end:
+    sqlite3_step(db->bulk_clear);
+    lms_db_reset_stmt(db->bulk_clear);
+
+    return r;
+}
+
 static int
 _slave_work_int(lms_t *lms, struct fds *fds, struct slave_db *db,
                 unsigned int update_id)
@@ -409,7 +682,7 @@ _slave_work_int(lms_t *lms, struct fds *fds, struct slave_db *db,
     struct lms_file_info finfo;
     void **parser_match;
     unsigned int counter, flags, total_committed;
-    int r;
+    int r, locked;
 
 
     if (lms->n_parsers <= 0) {
@@ -423,30 +696,84 @@ _slave_work_int(lms_t *lms, struct fds *fds, struct slave_db *db,
          return -6;
        }
     }
-    _init_sync_send(fds);
 
     counter = 0;
     total_committed = 0;
     lms_db_begin_transaction(db->transaction_begin);
 
-    while (((r = _slave_recv_file(fds, &finfo, &flags)) == 0) &&
-           finfo.path_len > 0) {
-        r = lms_db_update_file_info(db->update_file_info, &finfo, update_id);
+    /* lms->mtx is held from here, the master may kill us any time
+     * after this, the next locker recovers it, see lms_mutex_lock() */
+    locked = 1;
+    _init_sync_send(fds);
+
+    for (;;) {
+        if (locked && lms_slave_idle(fds)) {
+            /* the master is walking, let the other writers in meanwhile */
+            if (counter && !total_committed) {
+                total_committed += counter;
+                lms_db_update_id_set(db->handle, update_id);
+            }
+            lms_db_end_transaction(db->transaction_commit);
+            if (total_committed)
+                lms_update_id_publish(lms->db_path, update_id);
+            counter = 0;
+
+            pthread_mutex_unlock(lms->mtx);
+            locked = 0;
+        }
+
+        r = _slave_recv_file(fds, &finfo, &flags);
+        if (r != 0 || finfo.path_len <= 0)
+            break;
+
+        if (!locked) {
+            lms_mutex_lock(lms->mtx);
+            locked = 1;
+            lms_db_begin_transaction(db->transaction_begin);
+        }
+
+        if (flags & COMM_FINFO_FLAG_BULK) {
+            int n = finfo.path_len / (int)sizeof(struct comm_bulk_entry);
+
+            r = _slave_apply_bulk(db, (const struct comm_bulk_entry *)finfo.path,
+                                  n, finfo.dtime, update_id);
+            _slave_send_reply(fds, r);
+            if (r > 0)
+                counter += r;
+            continue;
+        }
+
+        if (flags & COMM_FINFO_FLAG_NEW) {
+            /* from lms_sync(), only worth a row if some parser wants it */
+            if (!lms_parsers_check_using(lms, parser_match, &finfo)) {
+                _slave_send_reply(fds, LMS_PROGRESS_STATUS_SKIPPED);
+                continue;
+            }
+            r = lms_db_insert_file_info(db->insert_file_info, &finfo,
+                                        update_id);
+        } else
+            r = lms_db_update_file_info(db->update_file_info, &finfo,
+                                        update_id);
         if (r < 0)
             log_error("ERROR: could not update path in DB");
         else if (flags & COMM_FINFO_FLAG_OUTDATED) {
             int used;
 
             used = lms_parsers_check_using(lms, parser_match, &finfo);
-            if (!used)
+            if (!used) {
+                /* nothing to parse, don't pick it up again */
+                lms_db_set_file_parsed(db->set_file_parsed, finfo.id, 1, NULL);
                 r = 0;
-            else {
-                r = lms_parsers_run(lms, db->handle, parser_match, &finfo);
-                if (r < 0) {
-                    log_warning("ERROR: pid=%d failed to parse \"%s\".",
-                            getpid(), finfo.path);
-                    lms_db_delete_file_info(db->delete_file_info, &finfo);
-                }
+            } else {
+                r = lms_db_parse_file(lms, parser_match, &finfo,
+                                      !(flags & COMM_FINFO_FLAG_NEW),
+                                      db->set_file_parsed,
+                                      db->match_fingerprint,
+                                      db->set_fingerprint,
+                                      db->delete_file_info);
+                /* partly parsed, leave it to lms_check_unparsed() */
+                if (r == -ECANCELED)
+                    r = LMS_PROGRESS_STATUS_SKIPPED;
             }
         }
 
@@ -459,6 +786,12 @@ _slave_work_int(lms_t *lms, struct fds *fds, struct slave_db *db,
             }
 
             lms_db_end_transaction(db->transaction_commit);
+            lms_update_id_publish(lms->db_path, update_id);
+
+            /* let the browser and the other scans in between commits */
+            pthread_mutex_unlock(lms->mtx);
+            lms_mutex_lock(lms->mtx);
+
             lms_db_begin_transaction(db->transaction_begin);
             counter = 0;
         }
@@ -466,12 +799,20 @@ _slave_work_int(lms_t *lms, struct fds *fds, struct slave_db *db,
 
     free(parser_match);
 
+    /* _slave_work() finishes under lms->mtx */
+    if (!locked) {
+        lms_mutex_lock(lms->mtx);
+        return r;
+    }
+
     if (counter) {
         total_committed += counter;
         lms_db_update_id_set(db->handle, update_id);
     }
 
     lms_db_end_transaction(db->transaction_commit);
+    if (total_committed)
+        lms_update_id_publish(lms->db_path, update_id);
 
     return r;
 }
@@ -484,9 +825,14 @@ _slave_work(struct pinfo *pinfo)
     struct slave_db *db;
     int r;
 
+    /* like the lms_process() slave, lms->mtx is only held while setting up
+     * and for each transaction, see _slave_work_int() */
+    lms_mutex_lock(lms->mtx);
+
     db = _slave_db_open(lms->db_path);
 
     if (!db) {
+        pthread_mutex_unlock(lms->mtx);
         return -1;
     }
 
@@ -518,6 +864,7 @@ _slave_work(struct pinfo *pinfo)
   end:
     lms_parsers_finish(lms, db->handle);
     _slave_db_close(db);
+    pthread_mutex_unlock(lms->mtx);
     _init_sync_send(fds);
 
     return r;
@@ -529,13 +876,16 @@ _slave_work(struct pinfo *pinfo)
  ***********************************************************************/
 
 static int
-_master_db_compile_all_stmts(struct master_db *db)
+_master_db_compile_all_stmts(struct master_db *db, int unparsed)
 {
     sqlite3 *handle;
 
     handle = db->handle;
 
-    db->get_files = lms_db_compile_stmt_get_files(handle);
+    if (unparsed)
+        db->get_files = lms_db_compile_stmt(handle, _get_unparsed_files_sql);
+    else
+        db->get_files = lms_db_compile_stmt(handle, _get_files_sql);
     if (!db->get_files)
         return -1;
 
@@ -543,7 +893,7 @@ _master_db_compile_all_stmts(struct master_db *db)
 }
 
 static struct master_db *
-_master_db_open(const char *db_path)
+_master_db_open(const char *db_path, int unparsed)
 {
     struct master_db *db;
 
@@ -566,7 +916,14 @@ _master_db_open(const char *db_path)
         goto error;
     }
 
-    if (_master_db_compile_all_stmts(db) != 0) {
+    if (lms_db_files_upgrade(db->handle) != 0) {
+        log_error("ERROR: could not upgrade files table.");
+        goto error;
+    }
+
+    lms_db_writer_setup(db->handle);
+
+    if (_master_db_compile_all_stmts(db, unparsed) != 0) {
         log_error("ERROR: could not compile statements.");
         goto error;
     }
@@ -652,12 +1009,26 @@ _finfo_update(void *db_ptr, struct cinfo *info, struct lms_file_info *finfo, uns
 {
     struct master_db *db = db_ptr;
     struct stat st;
+    int r;
 
     _update_finfo_from_stmt(finfo, db->get_files);
 
     *flags = 0;
-    if (stat(finfo->path, &st) == 0) {
-        if (st.st_mtime == finfo->mtime && (int64_t)st.st_size == finfo->size) {
+    r = stat(finfo->path, &st);
+    if (r != 0 && (errno == EIO || errno == ENODEV)) {
+        /* the medium is going away: don't mark its files as deleted */
+        log_warning("I/O error on \"%s\", stopping check.", finfo->path);
+        lms_stop_processing(info->lms);
+        return 0;
+    }
+
+    if (r == 0) {
+        /* only rows from _get_unparsed_files_sql have the 8th column */
+        if (sqlite3_column_count(db->get_files) > 7 &&
+            sqlite3_column_int(db->get_files, 7) == 0) {
+            _update_finfo_from_stat(finfo, &st);
+            *flags |= COMM_FINFO_FLAG_OUTDATED;
+        } else if (st.st_mtime == finfo->mtime && (int64_t)st.st_size == finfo->size) {
             if (finfo->dtime == 0) {
 #ifndef PATCH_LGE
                 _report_progress(info, finfo, LMS_PROGRESS_STATUS_UP_TO_DATE);
@@ -693,26 +1064,25 @@ _finfo_update(void *db_ptr, struct cinfo *info, struct lms_file_info *finfo, uns
 }
 
 static int
-_check_row(void *db_ptr, struct cinfo *info)
+_master_ship_file(struct pinfo *pinfo, struct lms_file_info finfo, unsigned int flags)
 {
-    struct pinfo *pinfo = (struct pinfo *)info;
-    struct master_db *db = db_ptr;
-    struct lms_file_info finfo;
-    unsigned int flags;
+    struct cinfo *info = (struct cinfo *)pinfo;
     int r, reply;
 
-    r = _finfo_update(db, info, &finfo, &flags);
-    if (r == 0)
-        return r;
+    lms_throttle_dispatch(info->lms);
 
     if (_master_send_file(&pinfo->master, finfo, flags) != 0)
         return -1;
 
     r = _master_recv_reply(&pinfo->master, &pinfo->poll, &reply,
-                           pinfo->common.lms->slave_timeout);
+                           pinfo->common.lms->slave_timeout, info->lms);
     if (r < 0) {
         _report_progress(info, &finfo, LMS_PROGRESS_STATUS_ERROR_COMM);
         return -2;
+    } else if (r == 2) {
+        _report_progress(info, &finfo, LMS_PROGRESS_STATUS_KILLED);
+        lms_cancel_slave(pinfo, _master_send_finish);
+        return 1;
     } else if (r == 1) {
         log_error("ERROR: slave took too long, restart %d",
                 pinfo->child);
@@ -727,7 +1097,9 @@ _check_row(void *db_ptr, struct cinfo *info)
             _report_progress(info, &finfo, LMS_PROGRESS_STATUS_ERROR_PARSE);
             return (-reply) << 8;
         } else {
-            if (!finfo.dtime)
+            if (reply == LMS_PROGRESS_STATUS_SKIPPED)
+                _report_progress(info, &finfo, LMS_PROGRESS_STATUS_SKIPPED);
+            else if (!finfo.dtime)
                 _report_progress(info, &finfo, LMS_PROGRESS_STATUS_PROCESSED);
             else
                 _report_progress(info, &finfo, LMS_PROGRESS_STATUS_DELETED);
@@ -760,15 +1132,15 @@ _check_row_single_process(void *db_ptr, struct cinfo *info)
         int used;
 
         used = lms_parsers_check_using(lms, parser_match, &finfo);
-        if (!used)
+        if (!used) {
+            lms_db_set_file_parsed(db->set_file_parsed, finfo.id, 1, NULL);
             r = 0;
-        else {
-            r = lms_parsers_run(lms, db->handle, parser_match, &finfo);
-            if (r < 0) {
-                log_warning("ERROR: pid=%d failed to parse \"%s\".",
-                        getpid(), finfo.path);
-                lms_db_delete_file_info(db->delete_file_info, &finfo);
-            }
+        } else {
+            r = lms_db_parse_file(lms, parser_match, &finfo, 1,
+                                  db->set_file_parsed, db->match_fingerprint,
+                                  db->set_fingerprint, db->delete_file_info);
+            if (r == -ECANCELED)
+                r = 0;
         }
     }
 
@@ -790,6 +1162,7 @@ _check_row_single_process(void *db_ptr, struct cinfo *info)
             }
 
             lms_db_end_transaction(db->transaction_commit);
+            lms_update_id_publish(lms->db_path, sinfo->common.update_id);
             lms_db_begin_transaction(db->transaction_begin);
             sinfo->commit_counter = 0;
         }
@@ -809,10 +1182,14 @@ _init_sync_wait(struct pinfo *pinfo, int restart)
 
     do {
         r = _master_recv_reply(&pinfo->master, &pinfo->poll, &reply,
-                               pinfo->common.lms->slave_timeout);
+                               pinfo->common.lms->slave_timeout,
+                               pinfo->common.lms);
         if (r < 0)
             return -1;
-        else if (r == 1 && restart) {
+        else if (r == 2) {
+            lms_cancel_slave(pinfo, _master_send_finish);
+            return r;
+        } else if (r == 1 && restart) {
             log_error("ERROR: slave took too long, restart %d",
                     pinfo->child);
             if (lms_restart_slave(pinfo, _slave_work) != 0)
@@ -848,110 +1225,376 @@ _db_files_loop(void *db_ptr, struct cinfo *info, check_row_callback_t check_row)
                     sqlite3_errmsg(db->handle));
             return -2;
         }
-    } while (r != SQLITE_DONE && !lms->stop_processing);
+    } while (r != SQLITE_DONE && !lms_is_cancelled(lms));
 
     return 0;
 }
 
-static int
-_is_file(const char *path)
-{
+struct check_batch_entry {
+    struct lms_file_info finfo; /* finfo.path is owned by the entry */
     struct stat st;
-    if (stat(path, &st) != 0)
-        return 0;
-    return S_ISREG(st.st_mode);
-}
-
-static int
-_check(struct pinfo *pinfo, int len, char *path)
-{
-    char query[PATH_SIZE + 3];
-    struct master_db *db;
-    int ret = 0;
+    int stat_errno; /* 0 if stat() succeeded */
+    int unparsed;
+    lms_progress_status_t status; /* to report once its bulk is applied */
+};
 
-    log_info("[ pid : %d ]", getpid());
+struct check_batch {
+    struct check_batch_entry entries[CHECK_BATCH_SIZE];
+    int n;
+    gint next; /* next entry to stat(), shared by the stat threads */
+};
 
-    db = _master_db_open(pinfo->common.lms->db_path);
+static void *
+_batch_stat_worker(void *data)
+{
+    struct check_batch *batch = data;
+    int i;
 
-    if (!db) {
-        return -1;
-    }
+    while ((i = g_atomic_int_add(&batch->next, 1)) < batch->n) {
+        struct check_batch_entry *e = batch->entries + i;
 
-    if (_is_file(path)){
-        if ((len > (PATH_SIZE -1) ) || ((len + 1) < 0)) {
-             log_error("ERROR: (len + 1) value may result in lost or misinterpreted data.");
-             return -1;
-        }
-        memcpy(query, path, (size_t)(len + 1));
-    }
-    else
-    {
-        if(*(path+len-1) == '/'){
-            memcpy(query, path, len);
-            memcpy(query + len, "%", sizeof("%"));
-            len += sizeof("%") - 1;
-        }
+        if (stat(e->finfo.path, &e->st) == 0)
+            e->stat_errno = 0;
         else
-        {
-            memcpy(query, path, len);
-            memcpy(query + len, "/%", sizeof("/%"));
-            len += sizeof("/%") - 1;
-        }
+            e->stat_errno = errno ? errno : ENOENT;
     }
-    ret = lms_db_get_files(db->get_files, query, len);
-    if (ret != 0)
-        goto end;
 
-    ret = lms_db_update_id_get(db->handle);
-    if (ret < 0) {
-        log_error("ERROR: could not get global update id.");
-        goto end;
-    }
+    return NULL;
+}
 
-    pinfo->common.update_id = ret + 1;
+/*
+ * stat() every entry of the batch, with up to CHECK_STAT_THREADS calls in
+ * flight so slow media (USB, MTP fuse) can overlap their latencies.
+ */
+static void
+_batch_stat(struct check_batch *batch)
+{
+    pthread_t threads[CHECK_STAT_THREADS - 1];
+    int i, n_threads = 0;
 
-    if (lms_create_slave(pinfo, _slave_work) != 0) {
-        ret = -2;
-        goto end;
+    batch->next = 0;
+
+    for (i = 0; i < CHECK_STAT_THREADS - 1 && i + 1 < batch->n; i++) {
+        if (pthread_create(threads + n_threads, NULL,
+                           _batch_stat_worker, batch) != 0)
+            break;
+        n_threads++;
     }
 
-    _init_sync_wait(pinfo, 1);
+    _batch_stat_worker(batch);
+
+    for (i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+}
 
-    ret = _db_files_loop(db, (struct cinfo *)pinfo, _check_row);
+static int
+_batch_fetch(struct master_db *db, struct check_batch *batch)
+{
+    int r;
 
-    _master_send_finish(&pinfo->master);
-    _init_sync_wait(pinfo, 0);
-    lms_finish_slave(pinfo, _master_dummy_send_finish);
+    batch->n = 0;
+    while (batch->n < CHECK_BATCH_SIZE) {
+        struct check_batch_entry *e;
+        char *path;
 
-  end:
-    lms_db_reset_stmt(db->get_files);
-    _master_db_close(db);
+        r = sqlite3_step(db->get_files);
+        if (r == SQLITE_DONE)
+            break;
+        if (r != SQLITE_ROW) {
+            log_error("ERROR: could not fetch rows: %s",
+                    sqlite3_errmsg(db->handle));
+            return -1;
+        }
 
-    return ret;
+        e = batch->entries + batch->n;
+        _update_finfo_from_stmt(&e->finfo, db->get_files);
+
+        path = malloc(e->finfo.path_len + 1);
+        if (!path) {
+            perror("malloc");
+            return -2;
+        }
+        memcpy(path, e->finfo.path, e->finfo.path_len);
+        path[e->finfo.path_len] = '\0';
+        e->finfo.path = path;
+        _calc_base(&e->finfo);
+
+        /* only rows from _get_unparsed_files_sql have the 8th column */
+        e->unparsed = sqlite3_column_count(db->get_files) > 7 &&
+            sqlite3_column_int(db->get_files, 7) == 0;
+        e->status = LMS_PROGRESS_STATUS_UP_TO_DATE;
+        batch->n++;
+    }
+
+    return batch->n;
+}
+
+static void
+_batch_free_paths(struct check_batch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->n; i++)
+        free((char *)batch->entries[i].finfo.path);
+    batch->n = 0;
 }
 
+/*
+ * Send one set of rows to have their dtime changed at once. On cancel or
+ * timeout nothing is reported, the rows are left as they are for the
+ * next check.
+ */
 static int
-_check_single_process(struct sinfo *sinfo, int len, char *path)
+_batch_flush(struct pinfo *pinfo, struct check_batch *batch,
+             const struct comm_bulk_entry *bulk, int n, time_t dtime,
+             lms_progress_status_t status)
 {
-    struct single_process_db *db;
-    char query[PATH_SIZE + 2];
-    void **parser_match = NULL;
-    lms_t *lms;
-    int ret;
+    struct cinfo *info = (struct cinfo *)pinfo;
+    int i, r, reply;
 
-    lms = sinfo->common.lms;
-    db = _single_process_db_open(lms->db_path);
+    if (!n || pinfo->child <= 0)
+        return 0;
 
-    if (!db) {
+    if (_master_send_bulk(&pinfo->master, bulk, n, dtime) != 0)
         return -1;
+
+    r = _master_recv_reply(&pinfo->master, &pinfo->poll, &reply,
+                           pinfo->common.lms->slave_timeout, info->lms);
+    if (r < 0)
+        return -2;
+    else if (r == 2) {
+        lms_cancel_slave(pinfo, _master_send_finish);
+        return 0;
+    } else if (r == 1) {
+        log_error("ERROR: slave took too long on bulk update, restart %d",
+                pinfo->child);
+        if (lms_restart_slave(pinfo, _slave_work) != 0)
+            return -3;
+        return 0;
     }
 
-    if (_is_file(path)){
-        if ((len + 1) < 0) {
-          log_error("ERROR: (len + 1) may underflow");
-          return -1;
-        }
-        else
+    if (reply < 0) {
+        log_error("ERROR: slave could not apply bulk update: %d", reply);
+        return 0;
+    }
+
+    for (i = 0; i < batch->n; i++)
+        if (batch->entries[i].status == status)
+            _report_progress(info, &batch->entries[i].finfo, status);
+
+    return 0;
+}
+
+/*
+ * Batched variant of _db_files_loop() + _check_row(): rows are fetched
+ * CHECK_BATCH_SIZE at a time and stat()'ed concurrently. Rows that are
+ * gone or came back only need their dtime changed, so they are sent as
+ * one COMM_FINFO_FLAG_BULK message each, the slave applies it with a
+ * single UPDATE inside its transaction. Only outdated files go through
+ * the parsers one by one.
+ */
+static int
+_db_files_loop_batched(struct master_db *db, struct pinfo *pinfo)
+{
+    lms_t *lms = pinfo->common.lms;
+    struct check_batch *batch;
+    struct comm_bulk_entry *deleted, *restored;
+    int n_deleted, n_restored, i, r = 0;
+    time_t now;
+
+    batch = calloc(1, sizeof(*batch));
+    deleted = malloc(CHECK_BATCH_SIZE * sizeof(*deleted));
+    restored = malloc(CHECK_BATCH_SIZE * sizeof(*restored));
+    if (!batch || !deleted || !restored) {
+        perror("malloc");
+        r = -1;
+        goto end;
+    }
+
+    while (!lms_is_cancelled(lms) && pinfo->child > 0) {
+        r = _batch_fetch(db, batch);
+        if (r <= 0) {
+            _batch_free_paths(batch);
+            break;
+        }
+
+        _batch_stat(batch);
+
+        n_deleted = n_restored = 0;
+        now = time(NULL);
+        r = 0;
+
+        for (i = 0; i < batch->n && r >= 0; i++) {
+            struct check_batch_entry *e = batch->entries + i;
+
+            if (lms_is_cancelled(lms) || pinfo->child <= 0)
+                break;
+
+            if (e->stat_errno == EIO || e->stat_errno == ENODEV) {
+                /* the medium is going away: don't mark its files as deleted */
+                log_warning("I/O error on \"%s\", stopping check.",
+                        e->finfo.path);
+                lms_stop_processing(lms);
+                n_deleted = 0;
+                break;
+            }
+
+            if (e->stat_errno) {
+                if (e->finfo.dtime)
+                    continue;
+                deleted[n_deleted].id = e->finfo.id;
+                deleted[n_deleted].ctime = e->finfo.ctime;
+                n_deleted++;
+                e->finfo.dtime = now;
+                e->status = LMS_PROGRESS_STATUS_DELETED;
+            } else if (!e->unparsed && e->st.st_mtime == e->finfo.mtime &&
+                       (int64_t)e->st.st_size == e->finfo.size) {
+                if (e->finfo.dtime == 0) {
+#ifndef PATCH_LGE
+                    _report_progress((struct cinfo *)pinfo, &e->finfo,
+                                     LMS_PROGRESS_STATUS_UP_TO_DATE);
+#endif
+                    continue;
+                }
+                restored[n_restored].id = e->finfo.id;
+                restored[n_restored].ctime = e->st.st_ctime;
+                n_restored++;
+                e->finfo.dtime = 0;
+                e->status = LMS_PROGRESS_STATUS_PROCESSED;
+            } else {
+                _update_finfo_from_stat(&e->finfo, &e->st);
+                r = _master_ship_file(pinfo, e->finfo, COMM_FINFO_FLAG_OUTDATED);
+            }
+        }
+
+        if (r >= 0)
+            r = _batch_flush(pinfo, batch, deleted, n_deleted, now,
+                             LMS_PROGRESS_STATUS_DELETED);
+        if (r >= 0)
+            r = _batch_flush(pinfo, batch, restored, n_restored, 0,
+                             LMS_PROGRESS_STATUS_PROCESSED);
+
+        _batch_free_paths(batch);
+
+        if (r < 0) {
+            log_error("ERROR: could not check batch.");
+            break;
+        }
+    }
+
+  end:
+    free(restored);
+    free(deleted);
+    free(batch);
+
+    return r < 0 ? r : 0;
+}
+
+static int
+_is_file(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    return S_ISREG(st.st_mode);
+}
+
+static int
+_check(struct pinfo *pinfo, int len, char *path, int unparsed)
+{
+    char query[PATH_SIZE + 3];
+    struct master_db *db;
+    int ret = 0, is_file;
+
+    log_info("[ pid : %d ]", getpid());
+
+    /* the slave takes lms->mtx for each of its transactions, the master
+     * only needs it to set the tables up and read the update id */
+    lms_mutex_lock(pinfo->common.lms->mtx);
+
+    db = _master_db_open(pinfo->common.lms->db_path, unparsed);
+
+    if (!db) {
+        pthread_mutex_unlock(pinfo->common.lms->mtx);
+        return -1;
+    }
+
+    is_file = _is_file(path);
+    if (is_file){
+        if ((len > (PATH_SIZE -1) ) || ((len + 1) < 0)) {
+             log_error("ERROR: (len + 1) value may result in lost or misinterpreted data.");
+             pthread_mutex_unlock(pinfo->common.lms->mtx);
+             return -1;
+        }
+        memcpy(query, path, (size_t)(len + 1));
+    }
+    else
+    {
+        memcpy(query, path, len);
+        if (*(path+len-1) != '/')
+            query[len++] = '/';
+        query[len] = '\0';
+    }
+    ret = lms_db_update_id_get(db->handle);
+    pthread_mutex_unlock(pinfo->common.lms->mtx);
+    if (ret < 0) {
+        log_error("ERROR: could not get global update id.");
+        goto end;
+    }
+
+    pinfo->common.update_id = ret + 1;
+
+    ret = _db_get_files_range(db->get_files, query, len, is_file);
+    if (ret != 0)
+        goto end;
+
+    if (lms_create_slave(pinfo, _slave_work) != 0) {
+        ret = -2;
+        goto end;
+    }
+
+    _init_sync_wait(pinfo, 1);
+
+    if (pinfo->child > 0)
+        ret = _db_files_loop_batched(db, pinfo);
+
+    /* a cancelled slave is already gone, don't write to its pipe */
+    if (pinfo->child > 0) {
+        _master_send_finish(&pinfo->master);
+        _init_sync_wait(pinfo, 0);
+    }
+    lms_finish_slave(pinfo, _master_dummy_send_finish);
+
+  end:
+    lms_db_reset_stmt(db->get_files);
+    _master_db_close(db);
+
+    return ret;
+}
+
+static int
+_check_single_process(struct sinfo *sinfo, int len, char *path, int unparsed)
+{
+    struct single_process_db *db;
+    char query[PATH_SIZE + 2];
+    void **parser_match = NULL;
+    lms_t *lms;
+    int ret, is_file;
+
+    lms = sinfo->common.lms;
+    db = _single_process_db_open(lms->db_path, unparsed);
+
+    if (!db) {
+        return -1;
+    }
+
+    is_file = _is_file(path);
+    if (is_file){
+        if ((len + 1) < 0) {
+          log_error("ERROR: (len + 1) may underflow");
+          return -1;
+        }
+        else
         {
           memcpy(query, path, (size_t)(len + 1));
         }
@@ -965,11 +1608,12 @@ _check_single_process(struct sinfo *sinfo, int len, char *path)
        else
        {
           memcpy(query, path, (size_t)len);
-          memcpy(query + len, "/%", sizeof("/%"));
-          len += sizeof("/%") - 1;
+          if (len > 0 && query[len - 1] != '/')
+              query[len++] = '/';
+          query[len] = '\0';
        }
     }
-    ret = lms_db_get_files(db->get_files, query, len);
+    ret = _db_get_files_range(db->get_files, query, len, is_file);
     if (ret != 0)
         goto end;
 
@@ -1024,6 +1668,8 @@ _check_single_process(struct sinfo *sinfo, int len, char *path)
     }
 
     lms_db_end_transaction(db->transaction_commit);
+    if (sinfo->total_committed)
+        lms_update_id_publish(lms->db_path, sinfo->common.update_id);
 
 end:
     free(parser_match);
@@ -1034,6 +1680,569 @@ end:
     return ret;
 }
 
+/***********************************************************************
+ * Sync: check and process in a single pass.
+ ***********************************************************************/
+
+/* Rows that are direct children of a directory: path starts with "dir/"
+ * and has no other '/' after that. Same columns as
+ * _get_unparsed_files_sql, a row left half parsed is parsed again. */
+static const char _get_dir_files_sql[] =
+    "SELECT id, path, mtime, dtime, itime, ctime, size, parsed FROM files "
+    "WHERE path > ? AND path < ? AND instr(substr(path, ?), X'2F') = 0";
+
+struct sync_row {
+    struct lms_file_info finfo; /* finfo.path is owned by the row */
+    int parsed;
+    int seen; /* matched a directory entry */
+};
+
+struct sync_info {
+    struct pinfo *pinfo;
+    struct sync_db *db;
+    GHashTable *visited; /* directories whose rows were handled, "dir/" */
+    int truncated; /* walk stopped early, don't trust what wasn't seen */
+    int top_len; /* of the synced path, see lms_scan_path_skipped() */
+};
+
+static struct sync_db *
+_sync_db_open(const char *db_path)
+{
+    struct sync_db *db;
+
+    db = calloc(1, sizeof(*db));
+    if (!db) {
+        perror("calloc");
+        return NULL;
+    }
+
+    if (sqlite3_open(db_path, &db->handle) != SQLITE_OK) {
+        log_error("ERROR: could not open DB \"%s\": %s",
+                db_path, sqlite3_errmsg(db->handle));
+        goto error;
+    }
+
+    if (lms_db_create_core_tables_if_required(db->handle) != 0) {
+        log_error("ERROR: could not setup tables and indexes.");
+        goto error;
+    }
+
+    if (lms_db_files_upgrade(db->handle) != 0) {
+        log_error("ERROR: could not upgrade files table.");
+        goto error;
+    }
+
+    lms_db_writer_setup(db->handle);
+
+    db->get_dir_files = lms_db_compile_stmt(db->handle, _get_dir_files_sql);
+    if (!db->get_dir_files)
+        goto error;
+
+    db->get_files = lms_db_compile_stmt(db->handle, _get_files_sql);
+    if (!db->get_files)
+        goto error;
+
+    return db;
+
+  error:
+    if (db->get_dir_files)
+        lms_db_finalize_stmt(db->get_dir_files, "get_dir_files");
+    sqlite3_close(db->handle);
+    free(db);
+    return NULL;
+}
+
+static int
+_sync_db_close(struct sync_db *db)
+{
+    if (db->get_dir_files)
+        lms_db_finalize_stmt(db->get_dir_files, "get_dir_files");
+
+    if (db->get_files)
+        lms_db_finalize_stmt(db->get_files, "get_files");
+
+    if (sqlite3_close(db->handle) != SQLITE_OK) {
+        log_error("ERROR: clould not close DB (sync): %s",
+                sqlite3_errmsg(db->handle));
+        return -1;
+    }
+    free(db);
+
+    return 0;
+}
+
+static void
+_sync_rows_free(struct sync_row *rows, int n_rows)
+{
+    int i;
+
+    for (i = 0; i < n_rows; i++)
+        free((char *)rows[i].finfo.path);
+    free(rows);
+}
+
+/*
+ * Load the rows of the files directly inside path, which must end with
+ * '/' and is len bytes long.
+ */
+static int
+_sync_load_rows(struct sync_db *db, const char *path, int len,
+                struct sync_row **p_rows, int *p_n_rows)
+{
+    sqlite3_stmt *stmt = db->get_dir_files;
+    struct sync_row *rows = NULL;
+    char upper[PATH_SIZE + 1];
+    int n_rows = 0, alloc_rows = 0, r;
+
+    memcpy(upper, path, len);
+    upper[len - 1] = '/' + 1;
+
+    if (sqlite3_bind_blob(stmt, 1, path, len, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_blob(stmt, 2, upper, len, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, 3, len + 1) != SQLITE_OK) {
+        log_error("ERROR: could not bind directory \"%s\": %s",
+                path, sqlite3_errmsg(db->handle));
+        lms_db_reset_stmt(stmt);
+        return -1;
+    }
+
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct lms_file_info *finfo;
+        char *row_path;
+
+        if (n_rows == alloc_rows) {
+            struct sync_row *tmp;
+
+            alloc_rows = alloc_rows ? alloc_rows * 2 : 32;
+            tmp = realloc(rows, alloc_rows * sizeof(*rows));
+            if (!tmp) {
+                perror("realloc");
+                goto error;
+            }
+            rows = tmp;
+        }
+
+        finfo = &rows[n_rows].finfo;
+        _update_finfo_from_stmt(finfo, stmt);
+
+        row_path = malloc(finfo->path_len + 1);
+        if (!row_path) {
+            perror("malloc");
+            goto error;
+        }
+        memcpy(row_path, finfo->path, finfo->path_len);
+        row_path[finfo->path_len] = '\0';
+        finfo->path = row_path;
+        finfo->base = len;
+        rows[n_rows].parsed = sqlite3_column_int(stmt, 7);
+        rows[n_rows].seen = 0;
+        n_rows++;
+    }
+
+    if (r != SQLITE_DONE) {
+        log_error("ERROR: could not list rows of \"%s\": %s",
+                path, sqlite3_errmsg(db->handle));
+        goto error;
+    }
+
+    lms_db_reset_stmt(stmt);
+    *p_rows = rows;
+    *p_n_rows = n_rows;
+    return 0;
+
+  error:
+    lms_db_reset_stmt(stmt);
+    _sync_rows_free(rows, n_rows);
+    return -2;
+}
+
+static int
+_strcat(int base, char *path, const char *name)
+{
+    size_t name_len;
+    int new_len;
+
+    name_len = strlen(name);
+    if (name_len > (size_t)(PATH_SIZE - base - 1)) {
+        path[base] = '\0';
+        log_error("ERROR: path concatenation too long: \"%s\" + \"%s\"",
+                path, name);
+        return -1;
+    }
+
+    new_len = base + (int)name_len;
+    memcpy(path + base, name, name_len + 1);
+
+    return new_len;
+}
+
+/* Row is gone from the disk, mark it as deleted unless it already is. */
+static int
+_sync_deleted(struct sync_info *si, struct lms_file_info finfo)
+{
+    if (finfo.dtime)
+        return 0;
+
+    finfo.dtime = time(NULL);
+    if (finfo.dtime == (time_t)-1) {
+        log_error("ERROR: time error occur");
+        return 0;
+    }
+
+    return _master_ship_file(si->pinfo, finfo, 0);
+}
+
+/*
+ * Entry is both in the directory and in the DB: same decision
+ * _finfo_update() takes, with the stat() the walk already did.
+ */
+static int
+_sync_existing(struct sync_info *si, struct lms_file_info finfo, int parsed,
+               const struct stat *st)
+{
+    unsigned int flags = 0;
+
+    if (!parsed) {
+        _update_finfo_from_stat(&finfo, st);
+        flags |= COMM_FINFO_FLAG_OUTDATED;
+    } else if (st->st_mtime == finfo.mtime && (int64_t)st->st_size == finfo.size) {
+        if (finfo.dtime == 0) {
+#ifndef PATCH_LGE
+            _report_progress((struct cinfo *)si->pinfo, &finfo,
+                             LMS_PROGRESS_STATUS_UP_TO_DATE);
+#endif
+            return 0;
+        }
+        finfo.dtime = 0;
+        finfo.ctime = st->st_ctime;
+    } else {
+        _update_finfo_from_stat(&finfo, st);
+        flags |= COMM_FINFO_FLAG_OUTDATED;
+    }
+
+    return _master_ship_file(si->pinfo, finfo, flags);
+}
+
+static int
+_sync_new(struct sync_info *si, char *path, int path_len, int base,
+          const struct stat *st)
+{
+    struct lms_file_info finfo;
+
+    memset(&finfo, 0, sizeof(finfo));
+    finfo.path = path;
+    finfo.path_len = path_len;
+    finfo.base = base;
+    _update_finfo_from_stat(&finfo, st);
+
+    return _master_ship_file(si->pinfo, finfo,
+                             COMM_FINFO_FLAG_NEW | COMM_FINFO_FLAG_OUTDATED);
+}
+
+/*
+ * Row the walk didn't list: its file may be filtered out by the walk or
+ * live below a directory it didn't enter, so like _finfo_update() only
+ * mark it deleted once stat() says it is gone. A file the walk filters
+ * out is left alone, lms_process() wouldn't parse it either.
+ */
+static int
+_sync_unlisted(struct sync_info *si, struct lms_file_info finfo, int parsed)
+{
+    struct stat st;
+
+    if (stat(finfo.path, &st) == 0) {
+        if (lms_scan_path_skipped(si->pinfo->common.lms, finfo.path,
+                                  si->top_len))
+            return 0;
+        if (S_ISREG(st.st_mode))
+            return _sync_existing(si, finfo, parsed, &st);
+    } else if (errno == EIO || errno == ENODEV) {
+        log_warning("I/O error on \"%s\", stopping sync.", finfo.path);
+        lms_stop_processing(si->pinfo->common.lms);
+        return 0;
+    } else if (errno != ENOENT && errno != ENOTDIR) {
+        return 0;
+    }
+
+    return _sync_deleted(si, finfo);
+}
+
+/*
+ * Walk path (ending with '/', len bytes) with the filters and the order
+ * of lms_process(), see lms_scan_dir_list(), and match its entries
+ * with its rows, so every file is classified as new, changed, unchanged
+ * or deleted with a single stat(). Subdirectories are visited after the
+ * files, like lms_process() does.
+ */
+static int
+_sync_dir(struct sync_info *si, char *path, int len)
+{
+    lms_t *lms = si->pinfo->common.lms;
+    struct dirent **namelist = NULL;
+    struct sync_row *rows = NULL;
+    GHashTable *by_name = NULL;
+    gboolean device = FALSE;
+    int n_names, n_rows = 0, k, r = 0;
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+    int prefetch_next = 0, prefetch_on = 0;
+#endif
+
+    if (lms_is_cancelled(lms))
+        return 0;
+
+    if (lms_scan_dir_skip(lms, path)) {
+        /* lms_process() doesn't enter it either, leave its rows alone */
+        g_hash_table_add(si->visited, g_strndup(path, len));
+        return 0;
+    }
+
+    n_names = lms_scan_dir_list(lms, path, &namelist);
+    if (n_names < 0) {
+        int err = errno;
+
+        log_warning("could not list \"%s\": %s", path, strerror(err));
+        if (err == EIO || err == ENODEV)
+            lms_stop_processing(lms);
+        else if (err != ENOENT && err != ENOTDIR)
+            /* still there but unreadable, keep its rows */
+            g_hash_table_add(si->visited, g_strndup(path, len));
+        return 0;
+    }
+
+    g_hash_table_add(si->visited, g_strndup(path, len));
+    device = lms_scan_device_start((struct cinfo *)si->pinfo, path, len);
+
+    if (_sync_load_rows(si->db, path, len, &rows, &n_rows) != 0) {
+        r = -1;
+        goto end;
+    }
+
+    by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    for (k = 0; k < n_rows; k++)
+        g_hash_table_insert(by_name, (char *)rows[k].finfo.path + len, rows + k);
+
+    for (k = 0; k < n_names && !lms_is_cancelled(lms); k++) {
+        struct dirent *de = namelist[k];
+        struct sync_row *row;
+        struct stat st;
+        int new_len;
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+        int prefetched, outdated;
+        gint64 start;
+#endif
+
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+            continue;
+
+        new_len = _strcat(len, path, de->d_name);
+        if (new_len < 0)
+            continue;
+
+        r = stat(path, &st);
+        path[len] = '\0';
+        if (r != 0) {
+            r = 0;
+            if (errno == EIO || errno == ENODEV) {
+                /* the medium is going away, don't delete anything */
+                log_warning("I/O error on \"%s%s\", stopping sync.",
+                        path, de->d_name);
+                lms_stop_processing(lms);
+                break;
+            }
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+            de->d_type = DT_DIR;
+        if (!S_ISREG(st.st_mode))
+            continue;
+
+        row = g_hash_table_lookup(by_name, de->d_name);
+
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+        if (lms->currentFileCount >= lms->maxFileScanCount) {
+            log_error("Do not scan anymore!, curFileCount = %d , maxCount = %d",
+                    lms->currentFileCount, lms->maxFileScanCount);
+            si->truncated = 1;
+            break;
+        }
+        lms->currentFileCount++;
+
+        /* same prefetch window as _process_dir(), path is "dir/" here */
+        prefetched = (k < prefetch_next);
+        if (!prefetched)
+            prefetch_next = k + 1;
+        if (prefetch_on) {
+            for (; prefetch_next < n_names && prefetch_next <= k + lms->prefetch_depth; prefetch_next++)
+                if (namelist[prefetch_next]->d_type == DT_REG)
+                    lms_prefetch_head(path, namelist[prefetch_next]->d_name);
+        }
+
+        outdated = !row || !row->parsed || st.st_mtime != row->finfo.mtime ||
+            (int64_t)st.st_size != row->finfo.size;
+        start = g_get_monotonic_time();
+#endif
+
+        _strcat(len, path, de->d_name);
+        if (row) {
+            row->seen = 1;
+            r = _sync_existing(si, row->finfo, row->parsed, &st);
+        } else
+            r = _sync_new(si, path, new_len, len, &st);
+        path[len] = '\0';
+
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+        if (outdated && r == 0) {
+            lms_prefetch_update(lms, g_get_monotonic_time() - start, prefetched);
+            prefetch_on = 1;
+        } else if (!outdated)
+            prefetch_on = 0;
+#endif
+
+        if (r < 0)
+            break;
+    }
+
+    if (r < 0 || si->truncated || lms_is_cancelled(lms))
+        goto end;
+
+    for (k = 0; k < n_rows; k++) {
+        if (rows[k].seen)
+            continue;
+
+        r = _sync_unlisted(si, rows[k].finfo, rows[k].parsed);
+        if (r < 0 || lms_is_cancelled(lms))
+            goto end;
+    }
+
+    for (k = 0; k < n_names; k++) {
+        int new_len;
+
+        if (namelist[k]->d_type != DT_DIR)
+            continue;
+
+        new_len = _strcat(len, path, namelist[k]->d_name);
+        if (new_len < 0 || new_len + 1 >= PATH_SIZE)
+            continue;
+
+        path[new_len] = '/';
+        path[new_len + 1] = '\0';
+        r = _sync_dir(si, path, new_len + 1);
+        path[len] = '\0';
+
+        if (r < 0 || si->truncated || lms_is_cancelled(lms))
+            break;
+    }
+
+  end:
+    if (device)
+        lms_scan_device_stop((struct cinfo *)si->pinfo, path, len);
+
+    if (by_name)
+        g_hash_table_destroy(by_name);
+    _sync_rows_free(rows, n_rows);
+    for (k = 0; k < n_names; k++)
+        free(namelist[k]);
+    free(namelist);
+
+    return r < 0 ? r : 0;
+}
+
+/*
+ * Rows below top whose directory was never listed belong to directories
+ * that are gone, filtered out or skipped; see _sync_unlisted().
+ */
+static int
+_sync_vanished_dirs(struct sync_info *si, const char *top, int len)
+{
+    lms_t *lms = si->pinfo->common.lms;
+    sqlite3_stmt *stmt = si->db->get_files;
+    int r;
+
+    r = _db_get_files_range(stmt, top, len, 0);
+    if (r != 0)
+        return r;
+
+    while (!lms_is_cancelled(lms) && (r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct lms_file_info finfo;
+        char *dir;
+
+        _update_finfo_from_stmt(&finfo, stmt);
+        if (finfo.dtime)
+            continue;
+
+        _calc_base(&finfo);
+        dir = g_strndup(finfo.path, finfo.base);
+        if (!g_hash_table_contains(si->visited, dir) &&
+            _sync_unlisted(si, finfo, 1) < 0) {
+            g_free(dir);
+            r = -1;
+            break;
+        }
+        g_free(dir);
+    }
+
+    lms_db_reset_stmt(stmt);
+
+    return r < 0 ? r : 0;
+}
+
+static int
+_sync(struct pinfo *pinfo, int len, char *path)
+{
+    struct sync_info si = {};
+    int ret;
+
+    si.pinfo = pinfo;
+    si.top_len = len;
+
+    /* see _check(), the slave locks for each of its transactions */
+    lms_mutex_lock(pinfo->common.lms->mtx);
+    si.db = _sync_db_open(pinfo->common.lms->db_path);
+    if (!si.db) {
+        pthread_mutex_unlock(pinfo->common.lms->mtx);
+        return -1;
+    }
+
+    si.visited = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    ret = lms_db_update_id_get(si.db->handle);
+    pthread_mutex_unlock(pinfo->common.lms->mtx);
+    if (ret < 0) {
+        log_error("ERROR: could not get global update id.");
+        goto end;
+    }
+
+    pinfo->common.update_id = ret + 1;
+
+    if (lms_create_slave(pinfo, _slave_work) != 0) {
+        ret = -2;
+        goto end;
+    }
+
+    _init_sync_wait(pinfo, 1);
+
+    ret = 0;
+    if (pinfo->child > 0)
+        ret = _sync_dir(&si, path, len);
+
+    if (ret == 0 && pinfo->child > 0 && !si.truncated)
+        ret = _sync_vanished_dirs(&si, path, len);
+
+    /* a cancelled slave is already gone, don't write to its pipe */
+    if (pinfo->child > 0) {
+        _master_send_finish(&pinfo->master);
+        _init_sync_wait(pinfo, 0);
+    }
+    lms_finish_slave(pinfo, _master_dummy_send_finish);
+
+  end:
+    g_hash_table_destroy(si.visited);
+    _sync_db_close(si.db);
+
+    return ret;
+}
+
 static int
 _lms_check_check_valid(lms_t *lms, const char *path)
 {
@@ -1056,36 +2265,19 @@ _lms_check_check_valid(lms_t *lms, const char *path)
     return 0;
 }
 
-/**
- * Check consistency of given directory or file.
- *
- * This will update media in the given directory or its children. If files
- * are missing, they'll be marked as deleted (dtime is set), if they were
- * marked as deleted and are now present, they are unmarked (dtime is unset).
- *
- * @param lms previously allocated Light Media Scanner instance.
- * @param top_path top directory or file to scan.
- *
- * @return On success 0 is returned.
- */
-int
-lms_check(lms_t *lms, const char *top_path)
+static int
+_lms_check(lms_t *lms, const char *top_path, int unparsed)
 {
     char path[PATH_SIZE];
     struct pinfo pinfo = {};
     int r = 0;
     size_t str_len = 0;
 
-    pthread_mutex_lock(lms->mtx);
-
-    log_info("+ lock [ pid : %d ] ..... [[ START ]]", getpid());
+    log_info("[ pid : %d ] ..... [[ START ]]", getpid());
 
     r = _lms_check_check_valid(lms, top_path);
-    if (r < 0) {
-        pthread_mutex_unlock(lms->mtx);
-        log_info("+ unlock [ pid : %d ]", getpid());
+    if (r < 0)
         return r;
-    }
 
     pinfo.common.lms = lms;
 
@@ -1098,42 +2290,203 @@ lms_check(lms_t *lms, const char *top_path)
        size_t len = strlen(top_path);
        if (len >= UINT_MAX) {
            log_error("ERROR: len may overflow");
-           pthread_mutex_unlock(lms->mtx);
-           return -5;
+           r = -5;
+           goto close;
        }
        if (len + 1 < PATH_SIZE) {
           memcpy(path, top_path, len + 1);
        }
        else {
           log_error("ERROR: path is too long: %s", top_path);
-          pthread_mutex_unlock(lms->mtx);
-          return -5;
+          r = -5;
+          goto close;
        }
     }
 
     lms->is_processing = 1;
     lms->stop_processing = 0;
+    *lms->cancel = 0;
     str_len = strlen(path);
     if (str_len > PATH_SIZE - 1) {
         log_error("ERROR: str_len may overflow");
-        pthread_mutex_unlock(lms->mtx);
-        return -5;
+        r = -5;
     } else {
-        r = _check(&pinfo, str_len, path);
+        r = _check(&pinfo, str_len, path, unparsed);
     }
     lms->is_processing = 0;
     lms->stop_processing = 0;
+    *lms->cancel = 0;
 
+close:
     lms_close_pipes(&pinfo);
 
 end:
+    log_info("[ pid : %d ] ..... [[ END ]]", getpid());
+
+    return r;
+}
+
+/**
+ * Check consistency of given directory or file.
+ *
+ * This will update media in the given directory or its children. If files
+ * are missing, they'll be marked as deleted (dtime is set), if they were
+ * marked as deleted and are now present, they are unmarked (dtime is unset).
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param top_path top directory or file to scan.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_check(lms_t *lms, const char *top_path)
+{
+    return _lms_check(lms, top_path, 0);
+}
+
+/**
+ * Parse the files that were only registered by lms_process_presence().
+ *
+ * This is the second phase of a two-phase scan. Rows are visited newest
+ * first and every one that still exists is handed to the parsers, the
+ * others are marked as deleted. It can be
+ * interrupted with lms_stop_processing() at any time, rows that were not
+ * reached yet stay flagged and will be picked up by the next call.
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param top_path top directory or file to parse.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_check_unparsed(lms_t *lms, const char *top_path)
+{
+    return _lms_check(lms, top_path, 1);
+}
+
+static const char _mark_outdated_sql[] =
+    "UPDATE files SET parsed = 0, fingerprint = NULL "
+    "WHERE path >= ? AND path < ? AND "
+    "dtime = 0 AND parsed = 1 AND parser = ? AND parser_version IS NOT ?";
+
+/*
+ * Flag as unparsed the files below path whose metadata was produced by
+ * a loaded parser with a different version than the loaded one.
+ */
+static int
+_mark_outdated(lms_t *lms, const char *top_path)
+{
+    char path[PATH_SIZE];
+    struct stat st;
+    sqlite3 *handle;
+    sqlite3_stmt *stmt;
+    int i, len, is_file, r = 0;
+
+    if (realpath(top_path, path) == NULL || stat(path, &st) != 0)
+        return 0; /* gone, lms_check_unparsed() won't parse anything */
+
+    is_file = !S_ISDIR(st.st_mode);
+    len = strlen(path);
+    if (!is_file && path[len - 1] != '/') {
+        if (len + 1 >= PATH_SIZE) {
+            log_error("ERROR: path is too long: %s", path);
+            return -1;
+        }
+        path[len++] = '/';
+        path[len] = '\0';
+    }
+
+    lms_mutex_lock(lms->mtx);
+
+    if (sqlite3_open(lms->db_path, &handle) != SQLITE_OK) {
+        log_error("ERROR: could not open DB \"%s\": %s",
+                lms->db_path, sqlite3_errmsg(handle));
+        r = -1;
+        goto close;
+    }
+
+    if (lms_db_files_upgrade(handle) != 0) {
+        r = -2;
+        goto close;
+    }
+
+    stmt = lms_db_compile_stmt(handle, _mark_outdated_sql);
+    if (!stmt) {
+        r = -3;
+        goto close;
+    }
+
+    /* one autocommit UPDATE per parser, the lock is only held for each */
     pthread_mutex_unlock(lms->mtx);
 
-    log_info("+ unlock [ pid : %d ] ..... [[ END ]]", getpid());
+    for (i = 0; i < lms->n_parsers; i++) {
+        const struct parser *parser = lms->parsers + i;
+
+        if (_db_get_files_range(stmt, path, len, is_file) != 0 ||
+            sqlite3_bind_text(stmt, 3, parser->plugin->name, -1,
+                              SQLITE_STATIC) != SQLITE_OK ||
+            sqlite3_bind_text(stmt, 4, parser->version, -1,
+                              SQLITE_STATIC) != SQLITE_OK) {
+            log_error("ERROR: could not bind outdated files query");
+            lms_db_reset_stmt(stmt);
+            r = -4;
+            break;
+        }
+
+        lms_mutex_lock(lms->mtx);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            log_error("ERROR: could not flag outdated files: %s",
+                    sqlite3_errmsg(handle));
+            r = -5;
+        } else if (sqlite3_changes(handle) > 0)
+            log_info("%d files of parser \"%s\" older than version %s",
+                     sqlite3_changes(handle), parser->plugin->name,
+                     parser->version ? parser->version : "(none)");
+        pthread_mutex_unlock(lms->mtx);
+
+        lms_db_reset_stmt(stmt);
+    }
+
+    lms_db_finalize_stmt(stmt, "mark_outdated");
+    sqlite3_close(handle);
+    return r;
 
+  close:
+    sqlite3_close(handle);
+    pthread_mutex_unlock(lms->mtx);
     return r;
 }
 
+/**
+ * Parse again the files whose metadata came from another version of a
+ * loaded parser.
+ *
+ * Every file records the name and version of the plugin that parsed it,
+ * files from the loaded plugins with a different version are flagged
+ * unparsed and handed to lms_check_unparsed(). Files from other plugins,
+ * or parsed before versions were recorded, are left untouched.
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param top_path top directory or file to parse.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_check_outdated(lms_t *lms, const char *top_path)
+{
+    int r;
+
+    r = _lms_check_check_valid(lms, top_path);
+    if (r < 0)
+        return r;
+
+    r = _mark_outdated(lms, top_path);
+    if (r < 0)
+        return r;
+
+    return _lms_check(lms, top_path, 1);
+}
+
 /**
  * Check consistency of given directory or file *without fork()-ing* into child process.
  *
@@ -1181,15 +2534,93 @@ lms_check_single_process(lms_t *lms, const char *top_path)
 
     lms->is_processing = 1;
     lms->stop_processing = 0;
+    *lms->cancel = 0;
     str_len = strlen(path);
     if (str_len > (PATH_SIZE - 1)) {
         log_error("ERROR: str_len may overflow");
         return -5;
     } else {
-        r = _check_single_process(&sinfo, str_len, path);
+        r = _check_single_process(&sinfo, str_len, path, 0);
     }
     lms->is_processing = 0;
     lms->stop_processing = 0;
+    *lms->cancel = 0;
+
+    return r;
+}
+
+/**
+ * Check and process the given directory in a single pass.
+ *
+ * Same result as lms_check() followed by lms_process(), but every
+ * directory is listed once, with the filters and order of lms_process(),
+ * and matched against the rows the DB has for it: each file is stat()'ed
+ * once and found to be new, changed, unchanged or deleted. Only new and
+ * changed files reach the parsers, all through a single slave.
+ *
+ * If @a top_path is a regular file this just calls lms_check() and
+ * lms_process().
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param top_path top directory to scan.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_sync(lms_t *lms, const char *top_path)
+{
+    char path[PATH_SIZE + 2];
+    struct pinfo pinfo = {};
+    size_t len;
+    int r;
+
+    r = _lms_check_check_valid(lms, top_path);
+    if (r < 0)
+        return r;
+
+    if (realpath(top_path, path) == NULL) {
+        perror("realpath");
+        return -5;
+    }
+
+    if (_is_file(path)) {
+        r = lms_check(lms, path);
+        if (r == 0)
+            r = lms_process(lms, path);
+        return r;
+    }
+
+    len = strlen(path);
+    if (len + 1 >= PATH_SIZE) {
+        log_error("ERROR: path is too long: %s", path);
+        return -5;
+    }
+    if (path[len - 1] != '/') {
+        path[len++] = '/';
+        path[len] = '\0';
+    }
+
+    log_info("[ pid : %d ] ..... [[ START ]]", getpid());
+
+    pinfo.common.lms = lms;
+
+    if (lms_create_pipes(&pinfo) != 0) {
+        r = -6;
+        goto end;
+    }
+
+    lms->is_processing = 1;
+    lms->stop_processing = 0;
+    *lms->cancel = 0;
+    r = _sync(&pinfo, (int)len, path);
+    lms->is_processing = 0;
+    lms->stop_processing = 0;
+    *lms->cancel = 0;
+
+    lms_close_pipes(&pinfo);
+
+end:
+    log_info("[ pid : %d ] ..... [[ END ]]", getpid());
 
     return r;
 }
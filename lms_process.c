@@ -22,15 +22,22 @@
 
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
 #include <gio/gio.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <ctype.h>
 
@@ -42,8 +49,25 @@
 #define SEPARATE_FILES_FROM_DIRECTORIES_PROCESSING
 #define TAB_BUFFER_SIZE		128
 
+/* While waiting for the slave the master wakes up every CANCEL_POLL_SLICE
+ * milliseconds to look at the cancellation token, once it is set the slave
+ * has CANCEL_GRACE milliseconds to finish on its own before it's killed. */
+#define CANCEL_POLL_SLICE	20
+#define CANCEL_GRACE		50
+
+/* A slave holds lms->mtx only while files keep coming: once the master
+ * sent nothing for SLAVE_IDLE_COMMIT milliseconds (walking an up to date
+ * tree, stat()-ing a slow medium) it commits and lets the other writers
+ * in until the next file arrives. */
+#define SLAVE_IDLE_COMMIT	100
+
+/* The presence scan only writes a row per file, so it can afford much
+ * larger transactions than the parsing scan. */
+#define PRESENCE_COMMIT_INTERVAL	2000
+
 struct db {
     sqlite3 *handle;
+    const char *path; /* lms->db_path, names the shared update_id */
     sqlite3_stmt *transaction_begin;
     sqlite3_stmt *transaction_commit;
     sqlite3_stmt *get_file_info;
@@ -51,6 +75,13 @@ struct db {
     sqlite3_stmt *update_file_info;
     sqlite3_stmt *delete_file_info;
     sqlite3_stmt *set_file_dtime;
+    sqlite3_stmt *set_file_parsed;
+    sqlite3_stmt *match_fingerprint;
+    sqlite3_stmt *set_fingerprint;
+    sqlite3_stmt *get_file_parsed;
+    int has_unparsed; /* rows left by lms_process_presence(), see _db_file_unparsed() */
+    unsigned long n_stmts; /* statements run, see _db_count_stmt() */
+    unsigned int update_id; /* set in the open transaction, 0 if none */
 };
 #if 0
 #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
@@ -184,19 +215,64 @@ _master_send_finish(const struct fds *master)
     return 0;
 }
 
-static int
-_master_recv_reply(const struct fds *master, struct pollfd *pfd, int *reply, int timeout)
+/**
+ * Wait for the slave to reply, watching the cancellation token.
+ *
+ * Shared by the lms_process() and lms_check() masters.
+ *
+ * @param pfd master side of the slave pipe.
+ * @param timeout milliseconds to wait at most, < 0 waits forever.
+ * @param lms instance whose token is checked.
+ *
+ * @return 0 once there is a reply to read, 1 if the slave took longer
+ *         than timeout, 2 if processing was cancelled while waiting,
+ *         < 0 on error.
+ */
+int
+lms_slave_poll(struct pollfd *pfd, int timeout, const lms_t *lms)
 {
-    int r;
+    int r, slice, waited = 0;
+
+    for (;;) {
+        slice = CANCEL_POLL_SLICE;
+        if (timeout >= 0 && timeout - waited < slice)
+            slice = timeout - waited;
+
+        r = poll(pfd, 1, slice);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return -1;
+        }
 
-    r = poll(pfd, 1, timeout);
-    if (r < 0) {
-        perror("poll");
-        return -1;
+        if (r > 0)
+            return 0;
+
+        if (lms_is_cancelled(lms))
+            return 2;
+
+        waited += slice;
+        if (timeout >= 0 && waited >= timeout)
+            return 1;
     }
+}
 
-    if (r == 0)
-        return 1;
+/*
+ * Return:
+ *  0: reply received
+ *  1: slave took longer than timeout
+ *  2: processing was cancelled while waiting
+ *  < 0 on error
+ */
+static int
+_master_recv_reply(const struct fds *master, struct pollfd *pfd, int *reply, int timeout, const lms_t *lms)
+{
+    int r;
+
+    r = lms_slave_poll(pfd, timeout, lms);
+    if (r != 0)
+        return r;
 
     long int _read = read(master->r, reply, sizeof(*reply));
     if (_read < 0) {
@@ -212,6 +288,33 @@ _master_recv_reply(const struct fds *master, struct pollfd *pfd, int *reply, int
     return 0;
 }
 
+/**
+ * Tell whether the master left the slave without work for a while.
+ *
+ * Shared by the lms_process() and lms_check() slaves, which commit and
+ * release lms->mtx when it returns 1.
+ *
+ * @param slave slave side of the master pipe.
+ *
+ * @return 1 if nothing arrived within SLAVE_IDLE_COMMIT milliseconds,
+ *         0 otherwise.
+ */
+int
+lms_slave_idle(const struct fds *slave)
+{
+    struct pollfd pfd;
+    int r;
+
+    pfd.fd = slave->r;
+    pfd.events = POLLIN;
+
+    do {
+        r = poll(&pfd, 1, SLAVE_IDLE_COMMIT);
+    } while (r < 0 && errno == EINTR);
+
+    return r == 0;
+}
+
 static int
 _slave_send_reply(const struct fds *slave, int reply)
 {
@@ -273,6 +376,12 @@ _slave_recv_path(const struct fds *slave, int *plen, int *dlen, char *path)
  * Slave-side.
  ***********************************************************************/
 
+static int
+_db_exists_cb(void *data, int n_cols, char **values, char **names)
+{
+    return 1; /* a row is all we wanted, abort */
+}
+
 static int
 _db_compile_all_stmts(struct db *db)
 {
@@ -307,8 +416,47 @@ _db_compile_all_stmts(struct db *db)
     if (!db->set_file_dtime)
         return -7;
 
+    db->set_file_parsed = lms_db_compile_stmt_set_file_parsed(handle);
+    if (!db->set_file_parsed)
+        return -8;
+
+    db->match_fingerprint = lms_db_compile_stmt_match_fingerprint(handle);
+    if (!db->match_fingerprint)
+        return -9;
+
+    db->set_fingerprint = lms_db_compile_stmt_set_fingerprint(handle);
+    if (!db->set_fingerprint)
+        return -10;
+
+    db->get_file_parsed = lms_db_compile_stmt(handle,
+        "SELECT parsed FROM files WHERE id = ?");
+    if (!db->get_file_parsed)
+        return -11;
+
+    /* one lookup on the partial index, so unchanged files only cost a
+     * query when an interrupted two-phase scan left something behind */
+    db->has_unparsed = sqlite3_exec(handle,
+        "SELECT 1 FROM files WHERE parsed = 0 LIMIT 1",
+        _db_exists_cb, NULL, NULL) == SQLITE_ABORT;
+
+    return 0;
+}
+
+#ifdef SQLITE_TRACE_STMT
+static int
+_db_count_stmt(unsigned int type, void *data, void *p, void *x)
+{
+    struct db *db = data;
+    const char *sql = x;
+
+    /* trigger bodies are reported as "-- TRIGGER name" */
+    if (sql && sql[0] == '-' && sql[1] == '-')
+        return 0;
+
+    db->n_stmts++;
     return 0;
 }
+#endif
 
 static struct db *
 _db_open(const char *db_path)
@@ -328,12 +476,24 @@ _db_open(const char *db_path)
                 db_path, sqlite3_errmsg(db->handle));
         goto error;
     }
+    db->path = db_path;
 
     if (lms_db_create_core_tables_if_required(db->handle) != 0) {
         log_error("ERROR: could not setup tables and indexes.");
         goto error;
     }
 
+    if (lms_db_files_upgrade(db->handle) != 0) {
+        log_error("ERROR: could not upgrade files table.");
+        goto error;
+    }
+
+    lms_db_writer_setup(db->handle);
+
+#ifdef SQLITE_TRACE_STMT
+    sqlite3_trace_v2(db->handle, SQLITE_TRACE_STMT, _db_count_stmt, db);
+#endif
+
     return db;
 
   error:
@@ -368,6 +528,15 @@ _db_close(struct db *db)
     if (db->set_file_dtime)
         lms_db_finalize_stmt(db->set_file_dtime, "set_file_dtime");
 
+    if (db->set_file_parsed)
+        lms_db_finalize_stmt(db->set_file_parsed, "set_file_parsed");
+    if (db->match_fingerprint)
+        lms_db_finalize_stmt(db->match_fingerprint, "match_fingerprint");
+    if (db->set_fingerprint)
+        lms_db_finalize_stmt(db->set_fingerprint, "set_fingerprint");
+    if (db->get_file_parsed)
+        lms_db_finalize_stmt(db->get_file_parsed, "get_file_parsed");
+
     if (sqlite3_close(db->handle) != SQLITE_OK) {
         log_error("ERROR: clould not close DB: %s",
                 sqlite3_errmsg(db->handle));
@@ -378,6 +547,51 @@ _db_close(struct db *db)
     return 0;
 }
 
+static void
+_db_update_id_set(struct db *db, unsigned int update_id)
+{
+    lms_db_update_id_set(db->handle, update_id);
+    db->update_id = update_id;
+}
+
+/* the update_id is only published once it is committed */
+static void
+_db_end_transaction(struct db *db)
+{
+    lms_db_end_transaction(db->transaction_commit);
+    if (db->update_id) {
+        lms_update_id_publish(db->path, db->update_id);
+        db->update_id = 0;
+    }
+}
+
+
+/*
+ * Whether an unchanged row still has parsed = 0, ie: a two-phase scan
+ * was stopped before lms_check_unparsed() reached it. Such rows are
+ * parsed as if they had changed.
+ */
+static int
+_db_file_unparsed(struct db *db, int64_t id)
+{
+    int r;
+
+    if (!db->has_unparsed)
+        return 0;
+
+    if (sqlite3_bind_int64(db->get_file_parsed, 1, id) != SQLITE_OK) {
+        log_error("ERROR: could not bind file id %lld", (long long)id);
+        lms_db_reset_stmt(db->get_file_parsed);
+        return 0;
+    }
+
+    r = sqlite3_step(db->get_file_parsed);
+    r = (r == SQLITE_ROW && sqlite3_column_int(db->get_file_parsed, 0) == 0);
+    lms_db_reset_stmt(db->get_file_parsed);
+
+    return r;
+}
+
 /*
  * Return:
  *  0: file found and nothing changed
@@ -385,43 +599,297 @@ _db_close(struct db *db)
  *  < 0: error
  */
 static int
-_retrieve_file_status(struct db *db, struct lms_file_info *finfo)
+_file_status_from_stat(struct db *db, struct lms_file_info *finfo,
+                       const struct stat64 *st)
 {
-    struct stat64 st;
     int r;
 
-    if (stat64(finfo->path, &st) != 0) {
-        perror("stat");
-        return -1;
-    }
-
     r = lms_db_get_file_info(db->get_file_info, finfo);
     if (r == 0) {
-        if (st.st_size < 0){
+        if (st->st_size < 0){
           log_error("ERROR: Unsigned integer overflow");
           return -1;
         } else {
-            if (st.st_mtime <= finfo->mtime && st.st_ctime <= finfo->ctime && finfo->size == st.st_size) {
+            if (st->st_mtime <= finfo->mtime && st->st_ctime <= finfo->ctime && finfo->size == st->st_size) {
               return 0;
             } else {
-                finfo->mtime = st.st_mtime;
-                finfo->ctime = st.st_ctime;
-                finfo->size = st.st_size;
+                finfo->mtime = st->st_mtime;
+                finfo->ctime = st->st_ctime;
+                finfo->size = st->st_size;
                 return 1;
             }
        }
     } else if (r == 1) {
-        finfo->mtime = st.st_mtime;
-        finfo->ctime = st.st_ctime;
-        finfo->size = st.st_size;
+        finfo->mtime = st->st_mtime;
+        finfo->ctime = st->st_ctime;
+        finfo->size = st->st_size;
         return 1;
     } else
         return -2;
 }
 
+static int
+_retrieve_file_status(struct db *db, struct lms_file_info *finfo)
+{
+    struct stat64 st;
+
+    if (stat64(finfo->path, &st) != 0) {
+        perror("stat");
+        return -1;
+    }
+
+    return _file_status_from_stat(db, finfo, &st);
+}
+
+/**
+ * Whether the current lms_check() or lms_process() should stop as soon as
+ * possible, either because lms_stop_processing() was called or because the
+ * device went away. Valid in both master and slave.
+ */
+int
+lms_is_cancelled(const lms_t *lms)
+{
+    if (lms->stop_processing)
+        return 1;
+
+    return lms->cancel && *lms->cancel;
+}
+
+/**
+ * Parser side of lms_is_cancelled(), plugins doing long I/O loops should
+ * check it between reads and give up with an error.
+ */
+int
+lms_context_is_cancelled(const struct lms_context *ctxt)
+{
+    return ctxt->cancel && *ctxt->cancel;
+}
+
+/*
+ * Head and tail of the file being parsed, read at most once and shared
+ * by every parser that matched it, see lms_context_read_at(). Most tag
+ * formats live there (ID3v2, MP4 moov at the start, ID3v1/APE at the
+ * end), so parsers and libmagic don't each open and read the file again.
+ * The buffers live on the stack of lms_parsers_run() and are freed once
+ * the file is done, lms_t instances in different threads share nothing.
+ */
+#define FILE_HEAD_SIZE		(64 * 1024)
+#define FILE_TAIL_SIZE		(16 * 1024)
+
+struct lms_file_data {
+    const char *path;
+    int fd; /* -1 until the first read */
+    off_t size;
+    unsigned char *head;
+    size_t head_len;
+    unsigned char *tail;
+    size_t tail_len;
+    off_t tail_off;
+    unsigned int head_loaded : 1;
+    unsigned int tail_loaded : 1;
+};
+
+static int
+_file_data_open(struct lms_file_data *f)
+{
+    struct stat st;
+
+    if (f->fd >= 0)
+        return 0;
+
+    f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (f->fd < 0)
+        return -1;
+
+    if (fstat(f->fd, &st) != 0) {
+        close(f->fd);
+        f->fd = -1;
+        return -1;
+    }
+
+    f->size = st.st_size;
+    return 0;
+}
+
+static ssize_t
+_file_data_fill(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t r = pread(fd, buf + done, len - done, offset + done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+
+    return done;
+}
+
+static int
+_file_data_load(struct lms_file_data *f, int tail)
+{
+    unsigned char **buf = tail ? &f->tail : &f->head;
+    size_t size = tail ? FILE_TAIL_SIZE : FILE_HEAD_SIZE;
+    off_t offset = 0;
+    ssize_t r;
+
+    if (_file_data_open(f) != 0)
+        return -1;
+
+    if (!*buf) {
+        *buf = malloc(size);
+        if (!*buf)
+            return -1;
+    }
+
+    if (tail) {
+        /* never overlaps the head, a small file is all head */
+        offset = f->size - FILE_TAIL_SIZE;
+        if (offset < FILE_HEAD_SIZE)
+            offset = FILE_HEAD_SIZE;
+        if (offset >= f->size)
+            size = 0;
+        else if ((off_t)size > f->size - offset)
+            size = f->size - offset;
+    }
+
+    r = _file_data_fill(f->fd, *buf, size, offset);
+    if (r < 0)
+        return -1;
+
+    if (tail) {
+        f->tail_off = offset;
+        f->tail_len = r;
+        f->tail_loaded = 1;
+    } else {
+        f->head_len = r;
+        f->head_loaded = 1;
+    }
+
+    return 0;
+}
+
+static void
+_file_data_begin(struct lms_file_data *f, const char *path)
+{
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    f->fd = -1;
+    f->size = -1;
+}
+
+static void
+_file_data_end(struct lms_file_data *f)
+{
+    if (f->fd >= 0)
+        close(f->fd);
+    f->fd = -1;
+    f->path = NULL;
+    free(f->head);
+    free(f->tail);
+    f->head = NULL;
+    f->tail = NULL;
+}
+
+/**
+ * Read from the file being parsed.
+ *
+ * Ranges within the first FILE_HEAD_SIZE or the last FILE_TAIL_SIZE
+ * bytes are served from buffers read once for all the parsers, anything
+ * else falls back to pread(2).
+ *
+ * @param ctxt context given to the parser.
+ * @param buf where to store the data.
+ * @param len number of bytes to read.
+ * @param offset offset in the file.
+ * @return number of bytes read, less than len at end of file, or -1 on
+ *         error with errno set.
+ */
+ssize_t
+lms_context_read_at(const struct lms_context *ctxt, void *buf, size_t len,
+                    off_t offset)
+{
+    struct lms_file_data *f = ctxt->file;
+
+    if (!f || !f->path || offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (offset < FILE_HEAD_SIZE) {
+        if (!f->head_loaded && _file_data_load(f, 0) != 0)
+            return -1;
+
+        /* a short head is the whole file */
+        if (offset + len <= f->head_len || f->head_len < FILE_HEAD_SIZE) {
+            if ((size_t)offset >= f->head_len)
+                return 0;
+            if (len > f->head_len - offset)
+                len = f->head_len - offset;
+            memcpy(buf, f->head + offset, len);
+            return len;
+        }
+    } else {
+        if (_file_data_open(f) != 0)
+            return -1;
+
+        if (offset >= f->size - FILE_TAIL_SIZE) {
+            if (!f->tail_loaded && _file_data_load(f, 1) != 0)
+                return -1;
+
+            if (offset >= f->tail_off) {
+                off_t rel = offset - f->tail_off;
+
+                if ((size_t)rel >= f->tail_len)
+                    return 0;
+                if (len > f->tail_len - rel)
+                    len = f->tail_len - rel;
+                memcpy(buf, f->tail + rel, len);
+                return len;
+            }
+        }
+    }
+
+    if (_file_data_open(f) != 0)
+        return -1;
+
+    return _file_data_fill(f->fd, buf, len, offset);
+}
+
+/**
+ * Get the shared head buffer of the file being parsed, for parsers that
+ * look at magic numbers or header blocks without copying them.
+ *
+ * @param ctxt context given to the parser.
+ * @param len where to store the number of valid bytes.
+ * @return the buffer, valid until parse() returns, or NULL on error.
+ */
+const void *
+lms_context_file_head(const struct lms_context *ctxt, size_t *len)
+{
+    struct lms_file_data *f = ctxt->file;
+
+    if (!f || !f->path)
+        return NULL;
+
+    if (!f->head_loaded && _file_data_load(f, 0) != 0)
+        return NULL;
+
+    *len = f->head_len;
+    return f->head;
+}
+
 static void
 _ctxt_init(struct lms_context *ctxt, const lms_t *lms, sqlite3 *db)
 {
+    ctxt->cancel = lms->cancel;
+    ctxt->file = NULL;
     ctxt->cs_conv = lms->cs_conv;
     ctxt->db = db;
     ctxt->country = lms->country;
@@ -526,13 +994,21 @@ lms_parsers_check_using(lms_t *lms, void **parser_match, struct lms_file_info *f
 }
 
 int
-lms_parsers_run(lms_t *lms, sqlite3 *db, void **parser_match, struct lms_file_info *finfo)
+lms_parsers_run(lms_t *lms, sqlite3 *db, void **parser_match, struct lms_file_info *finfo,
+                const struct parser **producer)
 {
     struct lms_context ctxt;
+    struct lms_file_data file_data;
     int i, failed, available;
 
     _ctxt_init(&ctxt, lms, db);
 
+    if (producer)
+        *producer = NULL;
+
+    _file_data_begin(&file_data, finfo->path);
+    ctxt.file = &file_data;
+
     finfo->parsed = 0;
     failed = 0;
     available = 0;
@@ -543,9 +1019,20 @@ lms_parsers_run(lms_t *lms, sqlite3 *db, void **parser_match, struct lms_file_in
         if (parser_match[i]) {
             int r;
 
-            if (available == INT_MAX)
+            if (lms_is_cancelled(lms)) {
+                /* whatever the previous parsers stored is incomplete, the
+                 * caller must not flag the file as parsed */
+                _file_data_end(&file_data);
+                if (producer)
+                    *producer = NULL;
+                finfo->parsed = 0;
+                return -ECANCELED;
+            }
+
+            if (available == INT_MAX) {
+                _file_data_end(&file_data);
                 return -1;
-            else
+            } else
                 available++;
             r = plugin->parse(plugin, &ctxt, finfo, parser_match[i]);
 
@@ -553,8 +1040,12 @@ lms_parsers_run(lms_t *lms, sqlite3 *db, void **parser_match, struct lms_file_in
                if (__builtin_sadd_overflow(failed, 1, &failed))
                   log_error("ERROR: failed may overflow");
             }
-            else
+            else {
+                /* the first one to succeed owns the metadata */
+                if (producer && !*producer)
+                    *producer = lms->parsers + i;
                 finfo->parsed = 1;
+            }
         }
     }
     if(finfo->parsed == 0) {
@@ -565,10 +1056,15 @@ lms_parsers_run(lms_t *lms, sqlite3 *db, void **parser_match, struct lms_file_in
             } else {
                 finfo->parsed = 1;
                 failed = 0;
+                for (i = 0; producer && i < lms->n_parsers; i++)
+                    if (lms->parsers[i].plugin == audio_dummy_plugin)
+                        *producer = lms->parsers + i;
             }
         }
     }
 
+    _file_data_end(&file_data);
+
     if (!failed)
         return 0;
     else if (failed == available)
@@ -643,7 +1139,7 @@ _db_and_parsers_process_file(lms_t *lms, struct db *db, void **parser_match,
                              unsigned int update_id)
 {
     struct lms_file_info finfo;
-    int used, r;
+    int used, existing, r;
 
     finfo.path = path;
     finfo.path_len = path_len;
@@ -655,14 +1151,13 @@ _db_and_parsers_process_file(lms_t *lms, struct db *db, void **parser_match,
 //    log_debug("[ pid : %d ] path = %s , path_len = %d , path_base = %d" , getpid() , path , path_len , path_base);
 
     r = _retrieve_file_status(db, &finfo);
-    if (r == 0) {
-        if (!finfo.dtime)
-            return LMS_PROGRESS_STATUS_UP_TO_DATE;
-
+    if (r == 0 && finfo.dtime) {
         finfo.dtime = 0;
         finfo.itime = time(NULL);
         lms_db_set_file_dtime(db->set_file_dtime, &finfo);
         return LMS_PROGRESS_STATUS_PROCESSED;
+    } else if (r == 0 && !_db_file_unparsed(db, finfo.id)) {
+        return LMS_PROGRESS_STATUS_UP_TO_DATE;
     } else if (r < 0) {
         log_error("ERROR: could not detect file status.(err=%d)", r);
         return r;
@@ -672,8 +1167,12 @@ _db_and_parsers_process_file(lms_t *lms, struct db *db, void **parser_match,
 
     log_debug("[ pid : %d ] path = %s , used = %d" , getpid() , path , used);
 
-    if (!used)
+    if (!used) {
+        /* an unparsed row no loaded parser wants, don't look at it again */
+        if (r == 0)
+            lms_db_set_file_parsed(db->set_file_parsed, finfo.id, 1, NULL);
         return LMS_PROGRESS_STATUS_SKIPPED;
+    }
 
     finfo.dtime = 0;
     finfo.itime = time(NULL);
@@ -682,7 +1181,8 @@ _db_and_parsers_process_file(lms_t *lms, struct db *db, void **parser_match,
        return LMS_PROGRESS_STATUS_UP_TO_DATE;
     }
 
-    if (finfo.id > 0)
+    existing = (finfo.id > 0);
+    if (existing)
         r = lms_db_update_file_info(db->update_file_info, &finfo, update_id);
     else
         r = lms_db_insert_file_info(db->insert_file_info, &finfo, update_id);
@@ -692,38 +1192,116 @@ _db_and_parsers_process_file(lms_t *lms, struct db *db, void **parser_match,
         return r;
     }
 
-    r = lms_parsers_run(lms, db->handle, parser_match, &finfo);
-    if (r < 0) {
-        log_warning("ERROR: pid=%d failed to parse \"%s\".",
-                getpid(), finfo.path);
-        lms_db_delete_file_info(db->delete_file_info, &finfo);
+    r = lms_db_parse_file(lms, parser_match, &finfo, existing,
+                          db->set_file_parsed, db->match_fingerprint,
+                          db->set_fingerprint, db->delete_file_info);
+    if (r == -ECANCELED)
+        return LMS_PROGRESS_STATUS_SKIPPED;
+    else if (r < 0)
         return r;
-    }
 
     return LMS_PROGRESS_STATUS_PROCESSED;
 }
 
+/*
+ * Presence-only variant of _db_and_parsers_process_file(): registers
+ * new or changed files with the facts stat() gave the walk, st, and
+ * flags them as not parsed, no plugin parse() is called.
+ *
+ * Return:
+ *  LMS_PROGRESS_STATUS_UP_TO_DATE
+ *  LMS_PROGRESS_STATUS_PROCESSED
+ *  LMS_PROGRESS_STATUS_SKIPPED
+ *  < 0 on error
+ */
 static int
-_slave_work(struct pinfo *pinfo)
+_db_register_file(lms_t *lms, struct db *db, void **parser_match,
+                  char *path, int path_len, int path_base,
+                  const struct stat64 *st, unsigned int update_id)
 {
-    lms_t *lms = pinfo->common.lms;
-    struct fds *fds = &pinfo->slave;
-    int r, len, base;
-#ifdef PATCH_LGE
-    char path[PATH_SIZE] ={0,};
-#else
-    char path[PATH_SIZE];
-#endif
-    void **parser_match;
+    struct lms_file_info finfo;
+    int used, r;
+
+    finfo.path = path;
+    finfo.path_len = path_len;
+    finfo.base = path_base;
+
+    r = _file_status_from_stat(db, &finfo, st);
+    if (r == 0) {
+        if (!finfo.dtime)
+            return LMS_PROGRESS_STATUS_UP_TO_DATE;
+
+        finfo.dtime = 0;
+        finfo.itime = time(NULL);
+        lms_db_set_file_dtime(db->set_file_dtime, &finfo);
+        return LMS_PROGRESS_STATUS_PROCESSED;
+    } else if (r < 0) {
+        log_error("ERROR: could not detect file status.(err=%d)", r);
+        return r;
+    }
+
+    /* plugins match on the extension, this does not touch the file */
+    used = lms_parsers_check_using(lms, parser_match, &finfo);
+    if (!used)
+        return LMS_PROGRESS_STATUS_SKIPPED;
+
+    finfo.dtime = 0;
+    finfo.itime = time(NULL);
+
+    if (finfo.id > 0)
+        r = lms_db_update_file_info(db->update_file_info, &finfo, update_id);
+    else
+        r = lms_db_insert_file_info(db->insert_file_info, &finfo, update_id);
+
+    if (r < 0) {
+        log_error("ERROR: could not register path in DB");
+        return r;
+    }
+
+    if (lms_db_set_file_parsed(db->set_file_parsed, finfo.id, 0, NULL) != 0)
+        return -1;
+
+    return LMS_PROGRESS_STATUS_PROCESSED;
+}
+
+/*
+ * Commit the slave's transaction, the update_id is set by the first
+ * commit that changed something.
+ */
+static void
+_slave_commit(struct db *db, unsigned int update_id, unsigned int *counter,
+              unsigned int *total_committed)
+{
+    if (*counter && !*total_committed) {
+        *total_committed += *counter;
+        _db_update_id_set(db, update_id);
+    }
+
+    _db_end_transaction(db);
+    *counter = 0;
+}
+
+static int
+_slave_work(struct pinfo *pinfo)
+{
+    lms_t *lms = pinfo->common.lms;
+    struct fds *fds = &pinfo->slave;
+    int r, len, base, locked;
+#ifdef PATCH_LGE
+    char path[PATH_SIZE] ={0,};
+#else
+    char path[PATH_SIZE];
+#endif
+    void **parser_match;
     struct db *db;
-    unsigned int total_committed, counter;
+    unsigned int total_committed, counter, processed = 0;
 
     //GTimer *timer = NULL;
     //double duration;
 
     int parentID = getppid();
 
-    pthread_mutex_lock(lms->mtx);
+    lms_mutex_lock(lms->mtx);
     log_info("+ db and parsers_setup , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
 
     r = _db_and_parsers_setup(lms, &db, &parser_match);
@@ -737,7 +1315,7 @@ _slave_work(struct pinfo *pinfo)
     log_info("- db and parsers_setup , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
     pthread_mutex_unlock(lms->mtx);
 
-    pthread_mutex_lock(lms->mtx);
+    lms_mutex_lock(lms->mtx);
     log_info("+ get update id , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
 
     r = lms_db_update_id_get(db->handle);
@@ -754,16 +1332,35 @@ _slave_work(struct pinfo *pinfo)
 
     counter = 0;
     total_committed = 0;
-
-    pthread_mutex_lock(lms->mtx);
+    locked = 0;
 
     //timer = g_timer_new();
 
-    log_info("+ begin_transaction , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
+    for (;;) {
 
-    lms_db_begin_transaction(db->transaction_begin);
+        if (locked && lms_slave_idle(fds)) {
+
+            /* nothing to parse for now, don't keep the other writers out */
+            _slave_commit(db, pinfo->common.update_id, &counter, &total_committed);
 
-    while (((r = _slave_recv_path(fds, &len, &base, path)) == 0) && len > 0) {
+            log_info("- end transaction (idle) , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
+
+            pthread_mutex_unlock(lms->mtx);
+            locked = 0;
+        }
+
+        if ((r = _slave_recv_path(fds, &len, &base, path)) != 0 || len <= 0)
+            break;
+
+        if (!locked) {
+
+            lms_mutex_lock(lms->mtx);
+            locked = 1;
+
+            log_info("+ begin_transaction , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
+
+            lms_db_begin_transaction(db->transaction_begin);
+        }
 
 /*
  * [CHS] : Disabled this log for system performance
@@ -780,6 +1377,7 @@ _slave_work(struct pinfo *pinfo)
             continue;
 
         counter++;
+        processed++;
 
         //duration = g_timer_elapsed(timer, NULL);
 
@@ -787,12 +1385,7 @@ _slave_work(struct pinfo *pinfo)
         //if (duration > lms->commit_duration) {
         if (counter > lms->commit_interval) {
 
-            if (!total_committed) {
-                total_committed += counter;
-                lms_db_update_id_set(db->handle, pinfo->common.update_id);
-            }
-
-            lms_db_end_transaction(db->transaction_commit);
+            _slave_commit(db, pinfo->common.update_id, &counter, &total_committed);
 
             log_info("- end transaction , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
 
@@ -800,35 +1393,40 @@ _slave_work(struct pinfo *pinfo)
 
             log_info("commit , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
 
-            pthread_mutex_lock(lms->mtx);
+            lms_mutex_lock(lms->mtx);
 
             log_info("+ begin_transaction , [ Parent ID : %d ] , [ pid : %d]" , parentID , getpid());
             lms_db_begin_transaction(db->transaction_begin);
 
-            counter = 0;
-
             // [ Static Analysis ] 2578276 : Value not atomically updated
             //g_timer_start (timer);
         }
 
     }
 
-    if (counter) {
-        total_committed += counter;
-        lms_db_update_id_set(db->handle, pinfo->common.update_id);
-    }
+    if (locked) {
 
-    lms_db_end_transaction(db->transaction_commit);
+        if (counter) {
+            total_committed += counter;
+            _db_update_id_set(db, pinfo->common.update_id);
+        }
 
-    log_info("- end transaction , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
+        _db_end_transaction(db);
 
-    pthread_mutex_unlock(lms->mtx);
+        log_info("- end transaction , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
+
+        pthread_mutex_unlock(lms->mtx);
+    }
 
 done:
-    pthread_mutex_lock(lms->mtx);
+    lms_mutex_lock(lms->mtx);
 
     log_info("+ slave done , [ Parent ID : %d ] , [ pid : %d ]" , parentID , getpid());
 
+    if (processed)
+        log_info("%lu statements for %u processed files, %0.2f per file , [ pid : %d ]",
+                 db->n_stmts, processed, (double)db->n_stmts / processed, getpid());
+
     free(parser_match);
 
     lms_parsers_finish(lms, db->handle);
@@ -934,6 +1532,26 @@ lms_create_pipes(struct pinfo *pinfo)
     return 0;
 }
 
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/**
+ * Move the calling thread to the idle I/O scheduling class.
+ *
+ * Slaves call it when they start, lightmediascannerd also calls it from
+ * its scanning threads so the master's walk doesn't compete with
+ * foreground I/O either.
+ */
+void
+lms_set_idle_io_priority(void)
+{
+    /* IOPRIO_WHO_PROCESS with 0 is the calling thread, not the process */
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        log_warning("could not set idle I/O priority: %s", strerror(errno));
+}
+
 int
 lms_create_slave(struct pinfo *pinfo, int (*work)(struct pinfo *pinfo))
 {
@@ -960,6 +1578,7 @@ lms_create_slave(struct pinfo *pinfo, int (*work)(struct pinfo *pinfo))
     _close_fds(&pinfo->master);
 
     niceValue = nice(19);
+    lms_set_idle_io_priority();
 
     // OYK_2019_03_25 : Replace the log context with the slave context.
     //init_log();
@@ -1034,6 +1653,53 @@ lms_finish_slave(struct pinfo *pinfo, int (*finish)(const struct fds *fds))
     return r;
 }
 
+/**
+ * Stop the slave after a cancellation without restarting it.
+ *
+ * The finish message is queued right away so the slave commits and exits
+ * as soon as the file it's working on is done, it is given CANCEL_GRACE
+ * milliseconds for that and killed afterwards. A killed slave may die
+ * while holding lms->mtx, the next one to lock it recovers it, see
+ * lms_mutex_lock(). Whatever transaction it had open is rolled back by
+ * SQLite, so the database only ever sees whole commits.
+ *
+ * @param pinfo slave to stop.
+ * @param finish function used to tell the slave to finish.
+ * @return On success 0 is returned.
+ */
+int
+lms_cancel_slave(struct pinfo *pinfo, int (*finish)(const struct fds *fds))
+{
+    int status, waited;
+
+    if (pinfo->child <= 0)
+        return 0;
+
+    (void)finish(&pinfo->master);
+
+    for (waited = 0; waited < CANCEL_GRACE; waited += 5) {
+        if (waitpid(pinfo->child, &status, WNOHANG) == pinfo->child) {
+            pinfo->child = 0;
+            return 0;
+        }
+        usleep(5000);
+    }
+
+    log_warning("slave %d did not stop in %d ms, killing it.",
+                pinfo->child, CANCEL_GRACE);
+
+    if (kill(pinfo->child, SIGKILL))
+        log_error("kill slave");
+
+    if (waitpid(pinfo->child, &status, 0) < 0)
+        log_error("waitpid");
+
+    (void)_consume_garbage(&pinfo->poll);
+    pinfo->child = 0;
+
+    return 0;
+}
+
 int
 lms_restart_slave(struct pinfo *pinfo, int (*work)(struct pinfo *pinfo))
 {
@@ -1128,51 +1794,86 @@ report_device(struct cinfo *info, const char *path, int path_len, lms_scanner_de
 }
 #endif
 
+/*
+ * Hand one path to the slave and wait for its reply, which is stored in
+ * reply. A slave that takes longer than slave_timeout is restarted and
+ * one that is still parsing when the scan is cancelled is stopped.
+ *
+ * Return:
+ *  0: reply received
+ *  1: the slave was killed, the path was reported as such
+ *  < 0 on error
+ */
 static int
-_process_file(struct cinfo *info, int base, char *path, const char *name , int depth)
+_master_process_path(struct pinfo *pinfo, char *path, int path_len, int base, int *reply)
 {
+    struct cinfo *info = (struct cinfo *)pinfo;
     lms_t *lms = info->lms;
-    struct pinfo *pinfo = (struct pinfo *)info;
-    int new_len, reply, r;
-
-#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-    char tapBuffer[TAB_BUFFER_SIZE] = {'\0', };
-    int i;
-#endif
+    int r;
 
-    //log_debug("    [ pid : %d ] , base = %d , path = %s , name = %s , depth = %d" , getpid() , base , path , name , depth);
-    if (lms->currentFileCount == INT_MAX)
-        return -1;
-    else
-        (lms->currentFileCount)++;
-    new_len = _strcat(base, path, name);
-    if (new_len < 0)
-        return -1;
+    lms_throttle_dispatch(lms);
 
-    if (_master_send_path(&pinfo->master, new_len, base, path) != 0)
+    if (_master_send_path(&pinfo->master, path_len, base, path) != 0)
         return -2;
 
-    r = _master_recv_reply(&pinfo->master, &pinfo->poll, &reply, pinfo->common.lms->slave_timeout);
+    r = _master_recv_reply(&pinfo->master, &pinfo->poll, reply, lms->slave_timeout, lms);
 
     if (r < 0) {
 
-        _report_progress(info, path, new_len, LMS_PROGRESS_STATUS_ERROR_COMM);
+        _report_progress(info, path, path_len, LMS_PROGRESS_STATUS_ERROR_COMM);
 
         return -3;
     }
+    else if (r == 2) {
+
+        log_info("scan cancelled while parsing \"%s\"", path);
+
+        _report_progress(info, path, path_len, LMS_PROGRESS_STATUS_KILLED);
+
+        lms_cancel_slave(pinfo, _master_send_finish);
+
+        /* not an error, the walker stops on the token */
+        return 1;
+    }
     else if (r == 1) {
 
         log_error("ERROR: slave took too long(path:%s), restart %d", path, pinfo->child);
 
-        _report_progress(info, path, new_len, LMS_PROGRESS_STATUS_KILLED);
-
-        pthread_mutex_unlock(lms->mtx);
+        _report_progress(info, path, path_len, LMS_PROGRESS_STATUS_KILLED);
 
         if (lms_restart_slave(pinfo, _slave_work) != 0)
             return -4;
 
         return 1;
     }
+
+    return 0;
+}
+
+static int
+_process_file(struct cinfo *info, int base, char *path, const char *name , int depth)
+{
+    lms_t *lms = info->lms;
+    struct pinfo *pinfo = (struct pinfo *)info;
+    int new_len, reply, r;
+
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+    char tapBuffer[TAB_BUFFER_SIZE] = {'\0', };
+    int i;
+#endif
+
+    //log_debug("    [ pid : %d ] , base = %d , path = %s , name = %s , depth = %d" , getpid() , base , path , name , depth);
+    if (lms->currentFileCount == INT_MAX)
+        return -1;
+    else
+        (lms->currentFileCount)++;
+    new_len = _strcat(base, path, name);
+    if (new_len < 0)
+        return -1;
+
+    r = _master_process_path(pinfo, path, new_len, base, &reply);
+    if (r != 0)
+        return r;
     else {
 
         if (reply < 0) {
@@ -1260,10 +1961,10 @@ _process_file_single_process(struct cinfo *info, int base, char *path, const cha
     if (sinfo->commit_counter > lms->commit_interval) {
         if (!sinfo->total_committed) {
             sinfo->total_committed += sinfo->commit_counter;
-            lms_db_update_id_set(db->handle, sinfo->common.update_id);
+            _db_update_id_set(db, sinfo->common.update_id);
         }
 
-        lms_db_end_transaction(db->transaction_commit);
+        _db_end_transaction(db);
         lms_db_begin_transaction(db->transaction_begin);
         sinfo->commit_counter = 0;
     }
@@ -1273,6 +1974,123 @@ _process_file_single_process(struct cinfo *info, int base, char *path, const cha
     return r;
 }
 
+/*
+ * lms_process_presence() stat()s the files without /lms_lock and only
+ * takes it to register a batch of PRESENCE_COMMIT_INTERVAL of them, so a
+ * large or slow medium doesn't keep the other writers out for the whole
+ * walk.
+ */
+struct presence_file {
+    char *path;
+    int path_len;
+    int base;
+    struct stat64 st;
+};
+
+struct presence_info {
+    struct sinfo sinfo; /* first, the walk passes it as a struct cinfo */
+    GPtrArray *pending; /* struct presence_file */
+};
+
+static void
+_presence_file_free(gpointer data)
+{
+    struct presence_file *pf = data;
+
+    free(pf->path);
+    free(pf);
+}
+
+/* register the pending files in one transaction */
+static int
+_presence_flush(struct presence_info *pi)
+{
+    struct sinfo *sinfo = &pi->sinfo;
+    struct db *db = sinfo->db;
+    lms_t *lms = sinfo->common.lms;
+    unsigned int i;
+    int r, ret = 0;
+
+    if (!pi->pending->len)
+        return 0;
+
+    lms_mutex_lock(lms->mtx);
+    lms_db_begin_transaction(db->transaction_begin);
+
+    for (i = 0; i < pi->pending->len; i++) {
+        struct presence_file *pf = g_ptr_array_index(pi->pending, i);
+
+        r = _db_register_file(lms, db, sinfo->parser_match, pf->path,
+                              pf->path_len, pf->base, &pf->st,
+                              sinfo->common.update_id);
+        if (r < 0) {
+            _report_progress(&sinfo->common, pf->path, pf->path_len,
+                             LMS_PROGRESS_STATUS_ERROR_COMM);
+            ret = r;
+            continue;
+        }
+
+        if (r == LMS_PROGRESS_STATUS_PROCESSED)
+            sinfo->commit_counter++;
+
+        _report_progress(&sinfo->common, pf->path, pf->path_len, r);
+    }
+
+    if (sinfo->commit_counter && !sinfo->total_committed) {
+        sinfo->total_committed += sinfo->commit_counter;
+        _db_update_id_set(db, sinfo->common.update_id);
+    }
+
+    _db_end_transaction(db);
+    pthread_mutex_unlock(lms->mtx);
+
+    sinfo->commit_counter = 0;
+    g_ptr_array_set_size(pi->pending, 0);
+
+    return ret;
+}
+
+static int
+_process_file_presence(struct cinfo *info, int base, char *path, const char *name , int depth)
+{
+    struct presence_info *pi = (struct presence_info *)info;
+    struct presence_file *pf;
+    struct stat64 st;
+    int new_len;
+
+    lms_t *lms = info->lms;
+
+    if (lms->currentFileCount == INT_MAX)
+        return -1;
+    else
+        (lms->currentFileCount)++;
+    new_len = _strcat(base, path, name);
+    if (new_len < 0)
+        return -1;
+
+    if (stat64(path, &st) != 0) {
+        perror("stat");
+        _report_progress(info, path, new_len, LMS_PROGRESS_STATUS_ERROR_COMM);
+        return -1;
+    }
+
+    pf = malloc(sizeof(*pf));
+    if (!pf || !(pf->path = strdup(path))) {
+        perror("malloc");
+        free(pf);
+        return -1;
+    }
+    pf->path_len = new_len;
+    pf->base = base;
+    pf->st = st;
+    g_ptr_array_add(pi->pending, pf);
+
+    if (pi->pending->len >= PRESENCE_COMMIT_INTERVAL)
+        return _presence_flush(pi) < 0 ? -1 : 0;
+
+    return 0;
+}
+
 static int _process_dir(struct cinfo *info, int base, char *path, const char *name, process_file_callback_t process_file , int depth);
 
 static int
@@ -1287,8 +2105,14 @@ _process_unknown(struct cinfo *info, int base, char *path, const char *name, pro
     if (new_len < 0)
         return -1;
 
+    if (lms_is_cancelled(info->lms))
+        return 0;
+
     if (stat(path, &st) != 0) {
         perror("stat");
+        /* the medium is going away, no point in walking the rest of it */
+        if (errno == EIO || errno == ENODEV)
+            lms_stop_processing(info->lms);
         return -2;
     }
 
@@ -1377,49 +2201,46 @@ _check_skip_scan_path(lms_t *lms, char *path)
     return ret;
 }
 
+/*
+ * Name rules of the scan filters below: whether an entry called name is
+ * listed as a file, or as a directory if dir is set. Also used to tell
+ * rows whose path the walk never lists, see lms_scan_path_skipped().
+ */
+static int
+_scan_dir_wants(const char *name, int dir)
+{
+    if (name[0] == '.')
+        return 0;
+
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+    #if defined(SEPARATE_FILES_FROM_DIRECTORIES_PROCESSING)
+        if (!dir)
+            return lms_which_extension(name, (unsigned int)strlen(name), g_mediaFileExtensions, LMS_ARRAY_SIZE(g_mediaFileExtensions)) >= 0;
+    #endif
+    return name[0] != '$';
+#else
+    return 1;
+#endif
+}
+
 #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
 
     int scandirFilter(const struct dirent* info)
     {
     	// return 1 => valid
-    	if ((info->d_name[0] == '.') || (info->d_name[0] == '$')) {
-    		return 0;
-    	}
-
-    	return 1;
+    	return _scan_dir_wants(info->d_name, info->d_type != DT_REG);
     }
 
     int scandirFilterFilesOnly(const struct dirent* info)
     {
-        int resultExtensions = -1;
-        size_t d_name_len = strlen(info->d_name);
-
         // return 1 => valid
-        if ((info->d_type == DT_REG)
-            && (info->d_name[0] != '.')
-            && ((resultExtensions = lms_which_extension(info->d_name, (unsigned int)d_name_len, g_mediaFileExtensions, LMS_ARRAY_SIZE(g_mediaFileExtensions))) >= 0)) {
-
-            //log_debug("info->d_name = %s , resultExtensions = %d" , info->d_name , resultExtensions);
-
-            return 1;
-        } else {
-            return 0;
-        }
+        return (info->d_type == DT_REG) && _scan_dir_wants(info->d_name, 0);
     }
 
     int scandirFilterDirectoriesOnly(const struct dirent* info)
     {
     	// return 1 => valid
-    	if ((info->d_type == DT_DIR)
-    	   && (info->d_name[0] != '.')
-    	   && (info->d_name[0] != '$')
-    	) {
-    		return 1;
-    	}
-    	// return 0 => invalid
-    	else {
-    		return 0;
-    	}
+    	return (info->d_type == DT_DIR) && _scan_dir_wants(info->d_name, 1);
     }
 
     // Sort the files first.
@@ -1456,15 +2277,350 @@ _check_skip_scan_path(lms_t *lms, char *path)
     	return strcoll (nameA, nameB);
     }
 
+    struct storage_order_entry {
+        struct dirent *de;
+        uint64_t key;
+    };
+
+    /*
+     * Physical address of the first extent of the file, so the parsers
+     * read headers in the order they are laid out on the device.
+     * Returns 0 if the filesystem doesn't support FIEMAP or the file
+     * has no extent yet.
+     */
+    static uint64_t
+    _first_physical_block(const char *dir, const char *name)
+    {
+        char path[PATH_SIZE + 1];
+        struct {
+            struct fiemap map;
+            struct fiemap_extent extent;
+        } fm;
+        uint64_t physical = 0;
+        int fd;
+
+        if (snprintf(path, sizeof(path), "%s%s", dir, name) >= (int)sizeof(path))
+            return 0;
+
+        fd = open(path, O_RDONLY | O_NOATIME);
+        if (fd < 0)
+            fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return 0;
+
+        memset(&fm, 0, sizeof(fm));
+        fm.map.fm_start = 0;
+        fm.map.fm_length = FIEMAP_MAX_OFFSET;
+        fm.map.fm_extent_count = 1;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents > 0)
+            physical = fm.map.fm_extents[0].fe_physical;
+
+        close(fd);
+        return physical;
+    }
+
+    static int
+    _storage_order_cmp(const void *a, const void *b)
+    {
+        const struct storage_order_entry *ea = a;
+        const struct storage_order_entry *eb = b;
+
+        if (ea->key < eb->key)
+            return -1;
+        if (ea->key > eb->key)
+            return 1;
+        return 0;
+    }
+
+    /*
+     * Reorder the files of one directory by inode number or by first
+     * physical block, so parsing them doesn't seek back and forth on
+     * rotating or slow flash media. Block numbers and inode numbers
+     * don't compare, so if FIEMAP can't locate one of the files the whole
+     * directory is sorted by inode number, which on FAT/exFAT follows the
+     * directory entry position and thus the allocation order.
+     */
+    void
+    lms_sort_by_storage_order(lms_t *lms, const char *dir, struct dirent **namelist, int count)
+    {
+        struct storage_order_entry *entries;
+        int i, by_block;
+
+        if (count < 2 || lms->storage_order == LMS_STORAGE_ORDER_NONE)
+            return;
+
+        entries = malloc((size_t)count * sizeof(*entries));
+        if (!entries) {
+            log_error("ERROR: could not allocate storage order entries");
+            return;
+        }
+
+        by_block = (lms->storage_order == LMS_STORAGE_ORDER_BLOCK);
+        for (i = 0; i < count && by_block; i++) {
+            entries[i].de = namelist[i];
+            entries[i].key = _first_physical_block(dir, namelist[i]->d_name);
+            if (entries[i].key == 0)
+                by_block = 0;
+        }
+
+        if (!by_block) {
+            for (i = 0; i < count; i++) {
+                entries[i].de = namelist[i];
+                entries[i].key = (uint64_t)namelist[i]->d_ino;
+            }
+        }
+
+        qsort(entries, (size_t)count, sizeof(*entries), _storage_order_cmp);
+
+        for (i = 0; i < count; i++)
+            namelist[i] = entries[i].de;
+
+        free(entries);
+    }
+
+    /*
+     * While the slave parses one file the headers of the next
+     * lms->prefetch_depth files are prefetched with POSIX_FADV_WILLNEED,
+     * so their first read doesn't wait on the media. The first file of a
+     * directory is never prefetched and gives the cold parse time, the
+     * others the warm one: their difference is the I/O wait and the
+     * depth is what covers it with parse time.
+     */
+    #define PREFETCH_HEAD_SIZE      (64 * 1024)
+    #define PREFETCH_DEPTH_MAX      16
+
+    void
+    lms_prefetch_head(const char *dir, const char *name)
+    {
+        char path[PATH_SIZE + 1];
+        int fd;
+
+        if (snprintf(path, sizeof(path), "%s%s", dir, name) >= (int)sizeof(path))
+            return;
+
+        fd = open(path, O_RDONLY | O_NOATIME);
+        if (fd < 0)
+            fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+
+        posix_fadvise(fd, 0, PREFETCH_HEAD_SIZE, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+
+    void
+    lms_prefetch_update(lms_t *lms, gint64 elapsed_us, int prefetched)
+    {
+        double *avg = prefetched ? &lms->prefetch_warm_us : &lms->prefetch_cold_us;
+        double ratio;
+        int depth;
+
+        /* moving average over the last ~8 files */
+        *avg = (*avg > 0) ? (*avg * 7 + elapsed_us) / 8 : elapsed_us;
+
+        if (lms->prefetch_warm_us <= 0)
+            return;
+
+        ratio = (lms->prefetch_cold_us - lms->prefetch_warm_us) / lms->prefetch_warm_us;
+        if (ratio < 1)
+            depth = 1;
+        else if (ratio >= PREFETCH_DEPTH_MAX)
+            depth = PREFETCH_DEPTH_MAX;
+        else
+            depth = (int)ratio + (ratio > (int)ratio); /* rounded up */
+
+        if (depth != lms->prefetch_depth) {
+            log_debug("prefetch depth %d -> %d (cold %.0fus, warm %.0fus)",
+                      lms->prefetch_depth, depth,
+                      lms->prefetch_cold_us, lms->prefetch_warm_us);
+            lms->prefetch_depth = depth;
+        }
+    }
+
 #endif              /* End of #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN) */
 
-static int _process_dir(struct cinfo *info, int base, char *path, const char *name, process_file_callback_t process_file , int depth)
+#if !defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+static int
+_scan_dir_filter(const struct dirent *de)
 {
-    lms_t *lms = info->lms;
+    if (!_scan_dir_wants(de->d_name, de->d_type != DT_REG))
+        return 0;
 
-    #if !defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-        struct dirent *de;
+    return de->d_type == DT_REG || de->d_type == DT_DIR || de->d_type == DT_UNKNOWN;
+}
+
+static int
+_scan_dir_files_first(const struct dirent **a, const struct dirent **b)
+{
+    return ((*a)->d_type != DT_REG) - ((*b)->d_type != DT_REG);
+}
+#endif
+
+/*
+ * List dir (ending with '/') for _process_dir() and lms_sync(): regular
+ * files come first, in the order they are parsed, followed by the
+ * directories to descend into. Returns the number of entries or -1
+ * with errno set if the directory can't be listed.
+ */
+int
+lms_scan_dir_list(lms_t *lms, const char *dir, struct dirent ***p_namelist)
+{
+    struct dirent **namelist = NULL;
+    int n;
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+    int n_files;
+#endif
+
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN) && defined(SEPARATE_FILES_FROM_DIRECTORIES_PROCESSING)
+    struct dirent **dirs = NULL, **tmp;
+    int n_dirs, i;
+
+    n_files = scandir(dir, &namelist, scandirFilterFilesOnly, alphaSortCaseInsensitiveFilesFirst);
+    if (n_files < 0)
+        return -1;
+
+    lms_sort_by_storage_order(lms, dir, namelist, n_files);
+
+    n_dirs = scandir(dir, &dirs, scandirFilterDirectoriesOnly, alphaSortCaseInsensitiveFilesFirst);
+    if (n_dirs < 0) {
+        int err = errno;
+
+        for (i = 0; i < n_files; i++)
+            free(namelist[i]);
+        free(namelist);
+        errno = err;
+        return -1;
+    }
+
+    n = n_files + n_dirs;
+    tmp = realloc(namelist, (n ? n : 1) * sizeof(*namelist));
+    if (!tmp) {
+        for (i = 0; i < n_files; i++)
+            free(namelist[i]);
+        for (i = 0; i < n_dirs; i++)
+            free(dirs[i]);
+        free(namelist);
+        free(dirs);
+        errno = ENOMEM;
+        return -1;
+    }
+    namelist = tmp;
+    memcpy(namelist + n_files, dirs, n_dirs * sizeof(*dirs));
+    free(dirs);
+#else
+    #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+        n = scandir(dir, &namelist, scandirFilter, alphaSortCaseInsensitiveFilesFirst);
+    #else
+        n = scandir(dir, &namelist, _scan_dir_filter, _scan_dir_files_first);
     #endif
+    if (n < 0)
+        return -1;
+
+    #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+        /* files come first, only they are reordered */
+        for (n_files = 0; n_files < n && namelist[n_files]->d_type == DT_REG; n_files++)
+            ;
+        lms_sort_by_storage_order(lms, dir, namelist, n_files);
+    #endif
+#endif
+
+    *p_namelist = namelist;
+    return n;
+}
+
+/*
+ * Directories _process_dir() doesn't enter: below a path another scan
+ * already completed, or skipped on purpose. path ends with '/'.
+ */
+gboolean
+lms_scan_dir_skip(lms_t *lms, char *path)
+{
+    if (_check_completed_scan_path(lms, path) == TRUE) {
+        log_debug("skip completed scan path : %s \n", path);
+        return TRUE;
+    }
+
+    if (_check_skip_scan_path(lms, path) == TRUE) {
+        log_warning("skip scan path : %s \n", path);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Whether a walk from top (ending with '/', top_len bytes) never reaches
+ * the file at path: the file or a directory below top is filtered out by
+ * lms_scan_dir_list(), or a directory is one lms_scan_dir_skip() leaves.
+ */
+gboolean
+lms_scan_path_skipped(lms_t *lms, const char *path, int top_len)
+{
+    char buf[PATH_SIZE + 1];
+    int len, start, i;
+
+    len = (int)strlen(path);
+    if (top_len < 1 || len <= top_len || len > PATH_SIZE)
+        return FALSE;
+
+    memcpy(buf, path, len + 1);
+    start = top_len;
+    for (i = top_len - 1; i < len; i++) {
+        gboolean skip;
+        char c;
+
+        if (buf[i] != '/')
+            continue;
+
+        if (i >= top_len) {
+            buf[i] = '\0';
+            skip = !_scan_dir_wants(buf + start, 1);
+            buf[i] = '/';
+            if (skip)
+                return TRUE;
+        }
+
+        c = buf[i + 1];
+        buf[i + 1] = '\0';
+        skip = lms_scan_dir_skip(lms, buf);
+        buf[i + 1] = c;
+        if (skip)
+            return TRUE;
+
+        start = i + 1;
+    }
+
+    return !_scan_dir_wants(buf + start, 0);
+}
+
+/*
+ * Report the start of a device scan if path (ending with '/') is the
+ * top of one of the device scan paths. Returns TRUE if it is, the
+ * caller then reports the end with lms_scan_device_stop().
+ */
+gboolean
+lms_scan_device_start(struct cinfo *info, char *path, int path_len)
+{
+    if (_check_different_device_scan_path(info->lms, path) != TRUE)
+        return FALSE;
+
+    log_info("device scan start path : %s", path);
+    report_device(info, path, path_len, LMS_SCANNER_DEVICE_STARTED);
+
+    return TRUE;
+}
+
+void
+lms_scan_device_stop(struct cinfo *info, const char *path, int path_len)
+{
+    log_info("device scan stop path : %s", path);
+    report_device(info, path, path_len, LMS_SCANNER_DEVICE_STOPPED);
+}
+
+static int _process_dir(struct cinfo *info, int base, char *path, const char *name, process_file_callback_t process_file , int depth)
+{
+    lms_t *lms = info->lms;
 
     int new_len = 0;
     int r = 0;
@@ -1472,17 +2628,19 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
     gboolean device = FALSE;
     char *device_path = NULL;
 
-#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
     struct dirent** namelist = NULL;
     const char* d_name = NULL;
     int d_type = 0;
     int idx = 0;
     int scanCount = 0;
+    int nFiles = 0;
 
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
     char currentDirectory[PATH_SIZE] = {'\0', };
     char tapBuffer[TAB_BUFFER_SIZE] = {'\0', };
 
-    size_t pathLength = 0;
+    int prefetchNext = 0;
+    int prefetchOn = 0;
 #endif
 
     //log_debug("base = %d , path = %s , name = %s , depth = %d .......... [[[ START ]]]" , base , path , name , depth);
@@ -1527,9 +2685,7 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
     }
 
     // OYK_2019_07_02 : For using scandir(...) instead of opendir(...), closedir(...) and readdir(...).
-    #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-        closedir(dir);
-    #endif
+    closedir(dir);
 
     //log_debug("base = %d , path = %s , new_len = %d" , base , path , new_len);
 
@@ -1543,10 +2699,6 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
 
         log_debug("skip completed scan path : %s \n", path);
 
-        #if !defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-            closedir(dir);
-        #endif
-
         //log_debug("path = %s , name = %s , depth = %d .......... [[[ END ]]]" , path , name , depth);
 
         return 4;
@@ -1556,10 +2708,6 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
 
         log_warning("skip scan path : %s \n", path);
 
-        #if !defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-            closedir(dir);
-        #endif
-
         //log_debug("path = %s , name = %s , depth = %d .......... [[[ END ]]]" , path , name , depth);
 
         return 5;
@@ -1578,209 +2726,74 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
         report_device(info, path, new_len, LMS_SCANNER_DEVICE_STARTED);
     }
 
-// OYK_2019_07_02 : For using scandir(...) instead of opendir(...), closedir(...) and readdir(...).
-//                  Limit the total number of scanned file to 8000(default value).
-#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-
     r = 0;
-    if (!lms->stop_processing) {
-
-        ///// Scan the files and directories following the below sequence.
-        ///// Check the files first. After that, check directories by HYUNDAI media specification.
-
-		// scandir(...) operation is different from PC version.
-		// PC version operates normally.
-		// But, AVN scandir(...) result is not good at the root directory.
-		// So, the files and directories processing should be separated.
-
-        #if defined(SEPARATE_FILES_FROM_DIRECTORIES_PROCESSING)
-
-            // [ Static Analysis ] 7342861 : Copy into fixed size buffer
-            //                     7341850 : Calling risky function
-            // Replace strcpy(...) with strncpy(...).
-            //strcpy(currentDirectory , path);
-            pathLength = strlen(path);
-            if (pathLength < (PATH_SIZE - 1)) {
-                memcpy(currentDirectory , path , pathLength);
-                currentDirectory[pathLength + 1] = '\0';
-            }
-            else {
-                strncpy(currentDirectory , path , PATH_SIZE-1);
-            }
-
-            ///// Process the files first.
-            if ((scanCount = scandir(path , &namelist , scandirFilterFilesOnly , alphaSortCaseInsensitiveFilesFirst)) == -1) {
-
-                log_debug("base = %d , %s scandir FAILED !!!!! : %s" , base , path , strerror(errno));
-            }
-
-            log_debug("base = %d , path = %s , [[[ FILES ]]] scanCount = %d" , base , path , scanCount);
-
-            for (idx = 0 ; idx < scanCount ; idx++) {
-
-                d_name = namelist[idx]->d_name;
-                d_type = namelist[idx]->d_type;
+    if (lms_is_cancelled(lms))
+        goto end;
 
-                //log_debug("d_name = %-32s \t d_type = %s ( %d ) , currentFileCount = %d" , d_name , (d_type==DT_REG) ? "DT_REG" : ((d_type==DT_DIR) ? "DT_DIR" : "DT_UNKNOWN") , d_type , lms->currentFileCount);
+    /* files first, then the directories, same listing as lms_sync() */
+    if ((scanCount = lms_scan_dir_list(lms, path, &namelist)) == -1) {
 
-                // If the current file count is greater than max file count, do not scan anymore.
-                if (lms->currentFileCount >= lms->maxFileScanCount) {
+        log_debug("base = %d , %s scandir FAILED !!!!! : %s" , base , path , strerror(errno));
+    }
 
-                    log_error("Do not scan anymore!, cur = [%s%s] , idx/scanCount = %d/%d, curFileCount = %d , maxCount = %d" , currentDirectory, d_name , idx +1 , scanCount , lms->currentFileCount , lms->maxFileScanCount);
+    for (nFiles = 0 ; nFiles < scanCount && namelist[nFiles]->d_type == DT_REG ; nFiles++)
+        ;
 
-                    goto end;
-                }
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+    /* process_file() appends each name to path, keep the directory */
+    memcpy(currentDirectory , path , new_len + 1);
+#endif
 
-                if (d_type == DT_REG) {
+    log_debug("base = %d , path = %s , scanCount = %d , files = %d" , base , path , scanCount , nFiles);
 
-                    if (process_file(info, new_len, path, d_name , depth) < 0) {
+    for (idx = 0 ; idx < scanCount ; idx++) {
 
-                        log_error("ERROR: unrecoverable error parsing file, exit \"%s\".", path);
+        if (lms_is_cancelled(lms))
+            goto end;
 
-                        path[new_len - 1] = '\0';
-                        r = -4;
+        d_name = namelist[idx]->d_name;
+        d_type = namelist[idx]->d_type;
 
-                        #ifndef PATCH_LGE
-                            goto end;
-                        #else
-                            continue;
-                        #endif
-                    }
-                }
+        if (d_type == DT_REG) {
 
-            }               /* for (idx = 0 ; idx < scanCount ; idx++) */
+            int reply;
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+            int prefetched = (idx < prefetchNext);
+            gint64 start;
 
-            // Free memory.
-            if (namelist != NULL) {
+            // If the current file count is greater than max file count, do not scan anymore.
+            if (lms->currentFileCount >= lms->maxFileScanCount) {
 
-                for (idx = 0 ; idx < scanCount ; idx++) {
-                    free(namelist[idx]);
-                }
+                log_error("Do not scan anymore!, cur = [%s%s] , idx/scanCount = %d/%d, curFileCount = %d , maxCount = %d" , currentDirectory, d_name , idx +1 , nFiles , lms->currentFileCount , lms->maxFileScanCount);
 
-                free(namelist);
-                namelist = NULL;
+                goto end;
             }
 
-            ///// Prcess the directories.
-            if ((scanCount = scandir(currentDirectory , &namelist , scandirFilterDirectoriesOnly , alphaSortCaseInsensitiveFilesFirst)) == -1) {
+            if (!prefetched)
+                prefetchNext = idx + 1;
 
-                log_debug("base = %d , %s scandir FAILED !!!!! : %s" , base , currentDirectory , strerror(errno));
+            /* only worth it while files are actually parsed, an
+             * up to date tree would read headers for nothing */
+            if (prefetchOn) {
+                for (; prefetchNext < nFiles && prefetchNext <= idx + lms->prefetch_depth; prefetchNext++)
+                    lms_prefetch_head(currentDirectory, namelist[prefetchNext]->d_name);
             }
 
-            log_debug("base = %d , path = %s , [[[ DIRECTORIES ]]] scanCount = %d" , base , path , scanCount);
-
-            for (idx = 0 ; idx < scanCount ; idx++) {
-
-                d_name = namelist[idx]->d_name;
-                d_type = namelist[idx]->d_type;
-
-
-                log_info("[DIR] [[%s%s]]     idx/scanCount = %d/%d, type = %s(%d)", currentDirectory, d_name, idx+1 , scanCount , (d_type==DT_REG) ? "DT_REG" : ((d_type==DT_DIR) ? "DT_DIR" : "DT_UNKNOWN") , d_type);
-                if (d_type == DT_DIR) {
-
-                    if (_process_dir(info, new_len, path, d_name, process_file , depth+1) < 0) {
-
-                        log_error("ERROR: unrecoverable error parsing dir, exit \"%s\".", path);
-
-                        path[new_len - 1] = '\0';
-                        r = -5;
-
-                        goto end;
-                    }
-                }
-                else if (d_type == DT_UNKNOWN) {
-
-                    if (_process_unknown(info, new_len, path, d_name, process_file , depth) < 0) {
-
-                        log_error("ERROR: unrecoverable error parsing DT_UNKNOWN, exit \"%s\".", path);
-
-                        path[new_len - 1] = '\0';
-                        r = -6;
-
-                        goto end;
-                    }
-                }
-
-            }               /* for (idx = 0 ; idx < scanCount ; idx++) */
-
-        #else               /* else of #if defined(SEPARATE_FILES_FROM_DIRECTORIES_PROCESSING) */
-
-            if ((scanCount = scandir(path , &namelist , scandirFilter , alphaSortCaseInsensitiveFilesFirst)) == -1) {
+            start = g_get_monotonic_time();
+#endif
+            reply = process_file(info, new_len, path, d_name , depth);
 
-                log_debug("base = %d , %s scandir FAILED !!!!! : %s" , base , path , strerror(errno));
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+            if (reply == LMS_PROGRESS_STATUS_PROCESSED && process_file != _process_file_presence) {
+                lms_prefetch_update(lms, g_get_monotonic_time() - start, prefetched);
+                prefetchOn = 1;
             }
+            else if (reply == LMS_PROGRESS_STATUS_UP_TO_DATE) {
+                prefetchOn = 0;
+            }
+#endif
 
-            //log_debug("base = %d , path = %s , scanCount = %d" , base , path , scanCount);
-
-            for (idx = 0 ; idx < scanCount ; idx++) {
-
-                d_name = namelist[idx]->d_name;
-                d_type = namelist[idx]->d_type;
-
-                //log_debug("d_name = %-32s \t d_type = %s ( %d )" , d_name , (d_type==DT_REG) ? "DT_REG" : ((d_type==DT_DIR) ? "DT_DIR" : "DT_UNKNOWN") , d_type);
-
-                if (d_type == DT_REG) {
-
-                    if (process_file(info, new_len, path, d_name , depth) < 0) {
-
-                        log_error("ERROR: unrecoverable error parsing file, exit \"%s\".", path);
-
-                        path[new_len - 1] = '\0';
-                        r = -4;
-
-                        #ifndef PATCH_LGE
-                            goto end;
-                        #else
-                            continue;
-                        #endif
-                    }
-                }
-                else if (d_type == DT_DIR) {
-
-                    if (_process_dir(info, new_len, path, d_name, process_file , depth+1) < 0) {
-
-                        log_error("ERROR: unrecoverable error parsing dir, exit \"%s\".", path);
-
-                        path[new_len - 1] = '\0';
-                        r = -5;
-
-                        goto end;
-                    }
-                }
-                else if (d_type == DT_UNKNOWN) {
-
-                    if (_process_unknown(info, new_len, path, d_name, process_file , depth) < 0) {
-
-                        log_error("ERROR: unrecoverable error parsing DT_UNKNOWN, exit \"%s\".", path);
-
-                        path[new_len - 1] = '\0';
-                        r = -6;
-
-                        goto end;
-                    }
-                }
-
-            }				/* for (idx = 0 ; idx < scanCount ; idx++) */
-
-        #endif              /* End of #if defined(SEPARATE_FILES_FROM_DIRECTORIES_PROCESSING) */
-
-        //log_debug("base = %d , path = %s , depth = %d" , base , path , depth);
-
-    }               /* if (!lms->stop_processing) */
-
-#else              /* else of #if defined(ENABLE_LIMITATION_OF_FILE_SCAN) */
-
-    r = 0;
-    while ((de = readdir(dir)) != NULL && !lms->stop_processing) {
-
-        log_debug("path = %s , name = %s , de->d_name = %s , de->d_type = %s ( %d )" , path , name , de->d_name , (de->d_type==DT_REG) ? "DT_REG" : ((de->d_type==DT_DIR) ? "DT_DIR" : "DT_UNKNOWN") , de->d_type);
-
-        if (de->d_name[0] == '.')
-            continue;
-
-        if (de->d_type == DT_REG) {
-
-            if (process_file(info, new_len, path, de->d_name , depth) < 0) {
+            if (reply < 0) {
 
                 log_error("ERROR: unrecoverable error parsing file, exit \"%s\".", path);
 
@@ -1794,9 +2807,13 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
                 #endif
             }
         }
-        else if (de->d_type == DT_DIR) {
+        else if (d_type == DT_DIR) {
 
-            if (_process_dir(info, new_len, path, de->d_name, process_file , depth+1) < 0) {
+#if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
+            log_info("[DIR] [[%s%s]]     idx/scanCount = %d/%d", currentDirectory, d_name, idx + 1 - nFiles , scanCount - nFiles);
+#endif
+
+            if (_process_dir(info, new_len, path, d_name, process_file , depth+1) < 0) {
 
                 log_error("ERROR: unrecoverable error parsing dir, exit \"%s\".", path);
 
@@ -1806,9 +2823,9 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
                 goto end;
             }
         }
-        else if (de->d_type == DT_UNKNOWN) {
+        else if (d_type == DT_UNKNOWN) {
 
-            if (_process_unknown(info, new_len, path, de->d_name, process_file , depth) < 0) {
+            if (_process_unknown(info, new_len, path, d_name, process_file , depth) < 0) {
 
                 log_error("ERROR: unrecoverable error parsing DT_UNKNOWN, exit \"%s\".", path);
 
@@ -1818,9 +2835,8 @@ static int _process_dir(struct cinfo *info, int base, char *path, const char *na
                 goto end;
             }
         }
-    }
 
-#endif              /* End of #if defined(ENABLE_LIMITATION_OF_FILE_SCAN) */
+    }               /* for (idx = 0 ; idx < scanCount ; idx++) */
 
 
 end:
@@ -1834,20 +2850,16 @@ end:
         free(device_path);
     }
 
-    #if defined(ENABLE_LIMIT_NUMBERS_OF_FILE_SCAN)
-    	// Free memory.
-        if (namelist != NULL) {
+    // Free memory.
+    if (namelist != NULL) {
 
-    		for (idx = 0 ; idx < scanCount ; idx++) {
-    			free(namelist[idx]);
-    		}
+        for (idx = 0 ; idx < scanCount ; idx++) {
+            free(namelist[idx]);
+        }
 
-    		free(namelist);
-    		namelist = NULL;
-		}
-    #else
-        closedir(dir);
-    #endif
+        free(namelist);
+        namelist = NULL;
+    }
 
     //log_debug("path = %s , name = %s , depth = %d .......... [[[ END ]]]" , path , name , depth);
 
@@ -1911,9 +2923,11 @@ _process_trigger(struct cinfo *info, const char *top_path, process_file_callback
 
     lms->is_processing = 1;
     lms->stop_processing = 0;
+    *lms->cancel = 0;
     r = _process_unknown(info, len, path, bname, process_file , 0);
     lms->is_processing = 0;
     lms->stop_processing = 0;
+    *lms->cancel = 0;
     free(bname);
 
     log_info("    [ pid : %d ] , top_path = %s ..... [[ END ]]", getpid() , top_path);
@@ -2012,10 +3026,10 @@ lms_process_single_process(lms_t *lms, const char *top_path)
     /* Check only if there are remaining commits to do */
     if (sinfo.commit_counter) {
         sinfo.total_committed += sinfo.commit_counter;
-        lms_db_update_id_set(sinfo.db->handle, sinfo.common.update_id);
+        _db_update_id_set(sinfo.db, sinfo.common.update_id);
     }
 
-    lms_db_end_transaction(sinfo.db->transaction_commit);
+    _db_end_transaction(sinfo.db);
 
 done:
     free(sinfo.parser_match);
@@ -2024,6 +3038,343 @@ done:
     return r;
 }
 
+/**
+ * Register the files in the given directory or file *without parsing them*.
+ *
+ * This is the first phase of a two-phase scan: only the facts we get from
+ * the directory walk and stat() (path, size, mtime, ...) are stored and the
+ * rows are flagged as not parsed, so they can be browsed right away. Use
+ * lms_check_unparsed() afterwards to run the parsers on them. Since no
+ * plugin parse() is called this runs in the calling process, the lock
+ * set with lms_set_mutex() is only held while a batch of files is
+ * written, not while the directories are walked.
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param top_path top directory or file to scan.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_process_presence(lms_t *lms, const char *top_path)
+{
+    struct presence_info pi;
+    struct sinfo *sinfo = &pi.sinfo;
+    int r;
+
+    log_info("    [ pid : %d ] , top_path = %s ..... [[ START ]]", getpid() , top_path);
+
+    r = _lms_process_check_valid(lms, top_path);
+    if (r < 0)
+        return r;
+
+    sinfo->common.lms = lms;
+    sinfo->commit_counter = 0;
+    sinfo->total_committed = 0;
+
+    lms_mutex_lock(lms->mtx);
+
+    r = _db_and_parsers_setup(sinfo->common.lms, &sinfo->db, &sinfo->parser_match);
+    if (r < 0) {
+        pthread_mutex_unlock(lms->mtx);
+        return r;
+    }
+
+    r = lms_db_update_id_get(sinfo->db->handle);
+    if (r < 0) {
+        log_error("ERROR: could not get global update id.");
+        goto done;
+    }
+
+    sinfo->common.update_id = r + 1;
+
+    /* see _presence_flush(), the walk runs unlocked */
+    pthread_mutex_unlock(lms->mtx);
+
+    pi.pending = g_ptr_array_new_with_free_func(_presence_file_free);
+
+    r = _process_trigger(&sinfo->common, top_path, _process_file_presence);
+    if (_presence_flush(&pi) < 0 && r == 0)
+        r = -1;
+
+    g_ptr_array_free(pi.pending, TRUE);
+
+    lms_mutex_lock(lms->mtx);
+
+done:
+    free(sinfo->parser_match);
+    lms_parsers_finish(lms, sinfo->db->handle);
+    _db_close(sinfo->db);
+
+    pthread_mutex_unlock(lms->mtx);
+
+    log_info("    [ pid : %d ] , top_path = %s ..... [[ END ]]", getpid() , top_path);
+
+    return r;
+}
+
+/*
+ * Mark the row of a file that no longer exists as deleted.
+ *
+ * Return:
+ *  LMS_PROGRESS_STATUS_DELETED
+ *  LMS_PROGRESS_STATUS_SKIPPED if there was nothing to mark
+ *  < 0 on error
+ */
+static int
+_db_mark_file_deleted(struct db *db, char *path, int path_len, int path_base)
+{
+    struct lms_file_info finfo;
+    int r;
+
+    finfo.path = path;
+    finfo.path_len = path_len;
+    finfo.base = path_base;
+
+    r = lms_db_get_file_info(db->get_file_info, &finfo);
+    if (r == 1 || (r == 0 && finfo.dtime))
+        return LMS_PROGRESS_STATUS_SKIPPED;
+    else if (r < 0)
+        return r;
+
+    finfo.dtime = time(NULL);
+    if (lms_db_set_file_dtime(db->set_file_dtime, &finfo) != 0)
+        return -1;
+
+    return LMS_PROGRESS_STATUS_DELETED;
+}
+
+/*
+ * realpath() of a file that may be gone: then its directory is resolved
+ * instead, so the path still matches the row, which was stored resolved.
+ *
+ * Return:
+ *  1 if the file exists
+ *  0 if it doesn't
+ *  < 0 on error
+ */
+static int
+_file_realpath(const char *path, char *resolved)
+{
+    char dir[PATH_SIZE + 1];
+    const char *name;
+    size_t dir_len, len;
+
+    if (realpath(path, resolved) != NULL)
+        return 1;
+    if (errno != ENOENT && errno != ENOTDIR)
+        return -1;
+
+    name = strrchr(path, '/');
+    if (!name || name[1] == '\0')
+        return -1;
+
+    dir_len = (size_t)(name - path);
+    if (dir_len >= sizeof(dir))
+        return -1;
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = '\0';
+
+    if (realpath(dir_len ? dir : "/", resolved) == NULL) {
+        /* the whole directory is gone, keep the path as given */
+        if (strlen(path) > PATH_SIZE)
+            return -1;
+        strcpy(resolved, path);
+        return 0;
+    }
+
+    len = strlen(resolved);
+    if (len + strlen(name) > PATH_SIZE)
+        return -1;
+    if (len == 1)
+        len = 0; /* resolved is "/" */
+    strcpy(resolved + len, name);
+
+    return 0;
+}
+
+/*
+ * Mark the rows of the files lms_process_files() found gone. No parser
+ * is involved, so it runs in the calling process, in one transaction.
+ */
+static int
+_db_mark_files_deleted(struct cinfo *info, GPtrArray *gone)
+{
+    lms_t *lms = info->lms;
+    struct db *db;
+    unsigned int i;
+    int r, changed = 0;
+
+    lms_mutex_lock(lms->mtx);
+
+    db = _db_open(lms->db_path);
+    if (!db) {
+        pthread_mutex_unlock(lms->mtx);
+        return -1;
+    }
+
+    if (_db_compile_all_stmts(db) != 0) {
+        log_error("ERROR: could not compile statements.");
+        r = -2;
+        goto done;
+    }
+
+    r = lms_db_update_id_get(db->handle);
+    if (r < 0) {
+        log_error("ERROR: could not get global update id.");
+        goto done;
+    }
+
+    info->update_id = r + 1;
+
+    lms_db_begin_transaction(db->transaction_begin);
+
+    for (i = 0; i < gone->len; i++) {
+        char *path = g_ptr_array_index(gone, i);
+        int len = (int)strlen(path), base;
+
+        for (base = len; base > 0 && path[base - 1] != '/'; base--);
+
+        r = _db_mark_file_deleted(db, path, len, base);
+        if (r < 0) {
+            log_warning("ERROR: could not mark \"%s\" as deleted.", path);
+            _report_progress(info, path, len, LMS_PROGRESS_STATUS_ERROR_PARSE);
+            continue;
+        }
+
+        if (r == LMS_PROGRESS_STATUS_DELETED)
+            changed++;
+
+        _report_progress(info, path, len, r);
+    }
+
+    if (changed)
+        _db_update_id_set(db, info->update_id);
+
+    _db_end_transaction(db);
+    r = 0;
+
+done:
+    _db_close(db);
+    pthread_mutex_unlock(lms->mtx);
+
+    return r;
+}
+
+/**
+ * Update the given files and only them, no directory is walked.
+ *
+ * Each path goes through the same status check as lms_process(): new or
+ * changed files are parsed by a slave process, so slave_timeout and
+ * lms_stop_processing() apply, up to date ones are left alone and the
+ * ones that are gone are marked as deleted. This is meant for a handful
+ * of files an application just wrote, use lms_process() for whole trees.
+ *
+ * The call is not one transaction: the slave commits like lms_process()
+ * does, every commit_interval files and whenever it waits for the next
+ * path, so /lms_lock is not held while a file is parsed. The gone files
+ * are marked afterwards, in a transaction of their own. Readers may thus
+ * see part of the update, each commit bumps the update_id.
+ *
+ * @param lms previously allocated Light Media Scanner instance.
+ * @param paths absolute paths of the files to update.
+ * @param n_paths number of elements in @a paths.
+ *
+ * @return On success 0 is returned.
+ */
+int
+lms_process_files(lms_t *lms, const char * const *paths, int n_paths)
+{
+    struct pinfo pinfo;
+    char path[PATH_SIZE + 1];
+    GPtrArray *gone;
+    int i, r, reply;
+
+    if (n_paths <= 0)
+        return 0;
+
+    r = _lms_process_check_valid(lms, paths[0]);
+    if (r < 0)
+        return r;
+
+    pinfo.common.lms = lms;
+
+    if (lms_create_pipes(&pinfo) != 0)
+        return -1;
+
+    if (lms_create_slave(&pinfo, _slave_work) != 0) {
+        r = -2;
+        goto close_pipes;
+    }
+
+    gone = g_ptr_array_new_with_free_func(g_free);
+
+    lms->is_processing = 1;
+    lms->stop_processing = 0;
+    *lms->cancel = 0;
+
+    r = 0;
+    for (i = 0; i < n_paths && !lms_is_cancelled(lms); i++) {
+        struct stat st;
+        int len, base;
+
+        if (paths[i][0] != '/') {
+            log_warning("invalid path \"%s\", skipped.", paths[i]);
+            continue;
+        }
+
+        r = _file_realpath(paths[i], path);
+        if (r < 0) {
+            log_warning("could not resolve \"%s\", skipped.", paths[i]);
+            r = 0;
+            continue;
+        } else if (r == 0) {
+            g_ptr_array_add(gone, g_strdup(path));
+            continue;
+        }
+
+        len = (int)strlen(path);
+        for (base = len; base > 0 && path[base - 1] != '/'; base--);
+
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            log_warning("\"%s\" is not a regular file, skipped.", path);
+            r = 0;
+            continue;
+        }
+
+        r = _master_process_path(&pinfo, path, len, base, &reply);
+        if (r < 0)
+            break;
+        else if (r > 0) {
+            r = 0;
+            continue;
+        }
+
+        if (reply < 0) {
+            log_warning("ERROR: pid=%d failed to parse \"%s\".", getpid(), path);
+            _report_progress(&pinfo.common, path, len, LMS_PROGRESS_STATUS_ERROR_PARSE);
+            continue;
+        }
+
+        _report_progress(&pinfo.common, path, len, reply);
+    }
+
+    lms_finish_slave(&pinfo, _master_send_finish);
+
+    if (r == 0 && gone->len && !lms_is_cancelled(lms))
+        r = _db_mark_files_deleted(&pinfo.common, gone);
+
+    lms->is_processing = 0;
+    lms->stop_processing = 0;
+    *lms->cancel = 0;
+
+    g_ptr_array_free(gone, TRUE);
+
+close_pipes:
+    lms_close_pipes(&pinfo);
+
+    return r;
+}
+
 void
 lms_stop_processing(lms_t *lms)
 {
@@ -2033,4 +3384,5 @@ lms_stop_processing(lms_t *lms)
         return;
 
     lms->stop_processing = 1;
+    *lms->cancel = 1;
 }